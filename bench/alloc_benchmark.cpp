@@ -0,0 +1,297 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Heap allocations and wall time of the per-chunk loops in packing and unpacking. The chunks of a
+// synthetic pseudoalignment are built, serialized and deserialized one at a time, first with a new
+// bit vector, buffer and deserializer for each chunk and then with the block pool and the reused
+// buffers of block_pool.hpp. The whole pack, unpack and print operations are timed as well.
+// The results are written as JSON.
+//
+// Usage: alloc_benchmark [options], run with --help for the options
+//
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <exception>
+#include <vector>
+
+#include "bm64.h"
+#include "bmserial.h"
+#include "cxxargs.hpp"
+
+#include "block_pool.hpp"
+#include "chunk_writer.hpp"
+#include "pack.hpp"
+#include "unpack.hpp"
+#include "synthetic_alignment.hpp"
+#include "version.h"
+#include "alignment-writer_openmp_config.hpp"
+
+#if defined(__GLIBC__)
+// Count the calls to the allocation functions of the C library, operator new and the
+// BitMagic block allocator both allocate through malloc.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+}
+
+namespace {
+std::atomic<size_t> n_allocations(0);
+std::atomic<size_t> n_allocated_bytes(0);
+}
+
+extern "C" {
+void *malloc(size_t size) {
+    n_allocations.fetch_add(1, std::memory_order_relaxed);
+    n_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+void *calloc(size_t n, size_t size) {
+    n_allocations.fetch_add(1, std::memory_order_relaxed);
+    n_allocated_bytes.fetch_add(n*size, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+void *realloc(void *ptr, size_t size) {
+    n_allocations.fetch_add(1, std::memory_order_relaxed);
+    n_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+}
+constexpr bool COUNTS_ALLOCATIONS = true;
+#else
+namespace {
+std::atomic<size_t> n_allocations(0);
+std::atomic<size_t> n_allocated_bytes(0);
+}
+constexpr bool COUNTS_ALLOCATIONS = false;
+#endif
+
+namespace {
+struct Measurement {
+    double seconds = 0.0;
+    size_t allocations = 0;
+    size_t allocated_bytes = 0;
+};
+
+// Time `repeats` calls to `func` and count the allocations made by them
+template <typename Func>
+Measurement Measure(const size_t repeats, Func &&func) {
+    Measurement result;
+    const size_t allocations = n_allocations.load();
+    const size_t allocated_bytes = n_allocated_bytes.load();
+    const auto &start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+	func();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.allocations = n_allocations.load() - allocations;
+    result.allocated_bytes = n_allocated_bytes.load() - allocated_bytes;
+    return result;
+}
+
+// Discards the output
+class NullBuffer : public std::streambuf {
+protected:
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    int overflow(int c) override { return c; }
+};
+
+void SetThreads(const size_t n_threads) {
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    omp_set_num_threads(n_threads);
+#endif
+}
+}
+
+int main(int argc, char* argv[]) {
+    cxxargs::Arguments args("alloc_benchmark", "Usage: alloc_benchmark [options]");
+    args.add_short_argument<size_t>('r', "Number of reads (default: 2000000).", (size_t)2000000);
+    args.add_short_argument<size_t>('n', "Number of reference sequences (default: 1000).", (size_t)1000);
+    args.add_short_argument<std::string>('o', "Write the results to this file instead of cout.", "");
+    args.add_long_argument<size_t>("buffer-size", "Pseudoalignments per chunk (default: 10000).", (size_t)10000);
+    args.add_long_argument<size_t>("repeats", "Number of times each chunk loop is run (default: 5).", (size_t)5);
+    args.add_long_argument<size_t>("threads", "Number of threads for parallel pack and unpack (default: 1).", (size_t)1);
+    args.add_long_argument<size_t>("seed", "Random seed (default: 1).", (size_t)1);
+    try {
+	args.parse(argc, argv);
+    } catch (const std::exception &e) {
+	std::cerr << "Parsing arguments failed: " << e.what() << '\n' << args.help() << std::endl;
+	return 1;
+    }
+
+    alignment_writer::SyntheticOptions options;
+    options.n_reads = args.value<size_t>('r');
+    options.n_refs = args.value<size_t>('n');
+    options.seed = args.value<size_t>("seed");
+    const size_t buffer_size = args.value<size_t>("buffer-size");
+    const size_t repeats = args.value<size_t>("repeats");
+    const size_t n_threads = args.value<size_t>("threads");
+    SetThreads(n_threads);
+
+    const std::string &text = alignment_writer::GenerateAlignment(alignment_writer::themisto, options);
+    std::string packed;
+    {
+	std::istringstream in(text);
+	std::ostringstream out;
+	alignment_writer::BufferedPack(alignment_writer::themisto, options.n_refs, options.n_reads, buffer_size, &in, &out);
+	packed = out.str();
+    }
+    const unsigned char *data = reinterpret_cast<const unsigned char*>(packed.data());
+    alignment_writer::FileHeader header;
+    const std::vector<alignment_writer::ChunkInfo> &index = alignment_writer::ScanChunks(data, packed.size(), &header);
+
+    // Set bits of each chunk, inserted again when building the chunks
+    std::vector<std::vector<size_t>> chunk_bits(index.size());
+    for (size_t i = 0; i < index.size(); ++i) {
+	bm::bvector<> bits;
+	bm::deserialize(bits, data + index[i].offset);
+	for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+	    chunk_bits[i].emplace_back(*en);
+	}
+    }
+
+    std::ostringstream results;
+    bool first_result = true;
+    auto add_result = [&](const std::string &operation, const std::string &variant, const size_t n_chunks, const Measurement &run) {
+	results << (first_result ? "" : ",\n") << "    {\"operation\": \"" << operation << "\", \"variant\": \"" << variant
+		<< "\", \"seconds\": " << run.seconds << ", \"chunks\": " << n_chunks;
+	if (COUNTS_ALLOCATIONS) {
+	    results << ", \"allocations\": " << run.allocations << ", \"allocations_per_chunk\": " << (n_chunks > 0 ? (double)run.allocations/n_chunks : 0.0)
+		    << ", \"allocated_bytes\": " << run.allocated_bytes;
+	}
+	results << "}";
+	first_result = false;
+    };
+
+    // Build and serialize each chunk, as in ChunkBuilder
+    add_result("build", "baseline", repeats*index.size(), Measure(repeats, [&]() {
+	bm::serializer<bm::bvector<>> bvs;
+	alignment_writer::ConfigureSerializer(&bvs, alignment_writer::CompressionProfile());
+	bm::bvector<> bits(bm::BM_GAP);
+	for (const std::vector<size_t> &positions : chunk_bits) {
+	    bm::bvector<>::bulk_insert_iterator it(bits);
+	    for (const size_t pos : positions) {
+		it = pos;
+	    }
+	    it.flush();
+	    alignment_writer::SerializedChunk chunk;
+	    bvs.serialize(bits, chunk.data);
+	    bits.clear(true);
+	    bits.set_new_blocks_strat(bm::BM_GAP);
+	}
+    }));
+    add_result("build", "pooled", repeats*index.size(), Measure(repeats, [&]() {
+	bm::serializer<bm::bvector<>> bvs;
+	alignment_writer::ConfigureSerializer(&bvs, alignment_writer::CompressionProfile());
+	alignment_writer::BlockPool pool;
+	bm::bvector<> bits(bm::BM_GAP);
+	bits.set_allocator_pool(&pool);
+	alignment_writer::SerializedChunk chunk;
+	for (const std::vector<size_t> &positions : chunk_bits) {
+	    bm::bvector<>::bulk_insert_iterator it(bits);
+	    for (const size_t pos : positions) {
+		it = pos;
+	    }
+	    it.flush();
+	    bvs.serialize(bits, chunk.data);
+	    bits.clear(true);
+	    bits.set_new_blocks_strat(bm::BM_GAP);
+	}
+    }));
+
+    // Deserialize each chunk into its own vector, as in the unpack loops
+    add_result("deserialize", "baseline", repeats*index.size(), Measure(repeats, [&]() {
+	for (const alignment_writer::ChunkInfo &info : index) {
+	    bm::bvector<> bits(bm::BM_GAP);
+	    bm::deserialize(bits, data + info.offset);
+	}
+    }));
+    add_result("deserialize", "pooled", repeats*index.size(), Measure(repeats, [&]() {
+	for (const alignment_writer::ChunkInfo &info : index) {
+	    alignment_writer::PooledBitVector bits(bm::BM_GAP);
+	    alignment_writer::DeserializeChunk(data + info.offset, &bits);
+	}
+    }));
+
+    // The library operations, which use the pooled loops
+    add_result("pack", (n_threads > 1 ? "parallel" : "sequential"), index.size(), Measure(1, [&]() {
+	std::istringstream in(text);
+	std::ostringstream out;
+	if (n_threads > 1) {
+	    alignment_writer::ParallelBufferedPack(alignment_writer::themisto, options.n_refs, options.n_reads, buffer_size, &in, &out);
+	} else {
+	    alignment_writer::BufferedPack(alignment_writer::themisto, options.n_refs, options.n_reads, buffer_size, &in, &out);
+	}
+    }));
+    add_result("unpack", (n_threads > 1 ? "parallel" : "sequential"), index.size(), Measure(1, [&]() {
+	std::istringstream in(packed);
+	size_t n_reads, n_refs;
+	if (n_threads > 1) {
+	    alignment_writer::ParallelUnpack(&in, &n_reads, &n_refs);
+	} else {
+	    alignment_writer::Unpack(&in, &n_reads, &n_refs);
+	}
+    }));
+    add_result("print", (n_threads > 1 ? "parallel" : "sequential"), index.size(), Measure(1, [&]() {
+	std::istringstream in(packed);
+	NullBuffer null;
+	std::ostream out(&null);
+	alignment_writer::Print(&in, &out);
+    }));
+
+    std::ofstream file;
+    if (!args.value<std::string>('o').empty()) {
+	file.open(args.value<std::string>('o'));
+    }
+    std::ostream &out = (file.is_open() ? file : std::cout);
+    out << "{\n"
+	<< "  \"version\": \"" << ALIGNMENT_WRITER_BUILD_VERSION << "\",\n"
+	<< "  \"input\": {\"reads\": " << options.n_reads << ", \"references\": " << options.n_refs << ", \"buffer_size\": " << buffer_size
+	<< ", \"chunks\": " << index.size() << ", \"repeats\": " << repeats << ", \"threads\": " << n_threads
+	<< ", \"text_bytes\": " << text.size() << ", \"packed_bytes\": " << packed.size() << "},\n"
+	<< "  \"results\": [\n" << results.str() << "\n  ]\n"
+	<< "}" << std::endl;
+    return 0;
+}
@@ -0,0 +1,83 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Write a synthetic Themisto or Fulgor pseudoalignment to cout.
+//
+// Usage: generate_alignment -r <number of reads> -n <number of references> [options]
+//
+#include <cstddef>
+#include <string>
+#include <iostream>
+#include <exception>
+
+#include "cxxargs.hpp"
+
+#include "pack.hpp"
+#include "synthetic_alignment.hpp"
+
+int main(int argc, char* argv[]) {
+    cxxargs::Arguments args("generate_alignment", "Usage: generate_alignment -r <number of reads> -n <number of references> [options]");
+    args.add_short_argument<size_t>('r', "Number of reads (default: 1000000).", (size_t)1000000);
+    args.add_short_argument<size_t>('n', "Number of reference sequences (default: 1000).", (size_t)1000);
+    args.add_long_argument<std::string>("format", "Output format (one of `themisto` (default), `fulgor`).", "themisto");
+    args.add_long_argument<std::string>("distribution", "Distribution of the pseudoalignments per read (one of `uniform` (default), `geometric`).", "uniform");
+    args.add_long_argument<size_t>("max-alignments", "Largest number of pseudoalignments per read (default: 8).", (size_t)8);
+    args.add_long_argument<double>("mean-alignments", "Mean number of pseudoalignments per read with `--distribution geometric` (default: 2).", 2.0);
+    args.add_long_argument<double>("unsorted-fraction", "Fraction of the lines moved to random positions, Themisto only (default: 0).", 0.0);
+    args.add_long_argument<size_t>("classes", "Number of distinct sets of references, 0 draws the references of each read independently (default: 0).", (size_t)0);
+    args.add_long_argument<double>("class-skew", "Exponent of the Zipf distribution of the class frequencies (default: 1).", 1.0);
+    args.add_long_argument<size_t>("seed", "Random seed (default: 1).", (size_t)1);
+    try {
+	args.parse(argc, argv);
+    } catch (const std::exception &e) {
+	std::cerr << "Parsing arguments failed: " << e.what() << '\n' << args.help() << std::endl;
+	return 1;
+    }
+
+    alignment_writer::SyntheticOptions options;
+    options.n_reads = args.value<size_t>('r');
+    options.n_refs = args.value<size_t>('n');
+    options.distribution = (args.value<std::string>("distribution") == "geometric" ? alignment_writer::SyntheticOptions::geometric : alignment_writer::SyntheticOptions::uniform);
+    options.max_alignments = args.value<size_t>("max-alignments");
+    options.mean_alignments = args.value<double>("mean-alignments");
+    options.unsorted_fraction = args.value<double>("unsorted-fraction");
+    options.n_classes = args.value<size_t>("classes");
+    options.class_skew = args.value<double>("class-skew");
+    options.seed = args.value<size_t>("seed");
+    const alignment_writer::Format format = (args.value<std::string>("format") == "fulgor" ? alignment_writer::fulgor : alignment_writer::themisto);
+
+    std::cout << alignment_writer::GenerateAlignment(format, options);
+    std::cout.flush();
+    return 0;
+}
@@ -0,0 +1,140 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Microbenchmark comparing the line-by-line std::stringstream parser used by
+// earlier versions of BufferedPack against the block-based parser in line_parser.hpp.
+//
+// Usage: parse_benchmark [number of reads] [number of references]
+//
+#include <cstddef>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <functional>
+
+#include "bm64.h"
+
+#include "pack.hpp"
+#include "line_parser.hpp"
+#include "synthetic_alignment.hpp"
+
+namespace {
+size_t LegacyThemistoParser(const std::string &line, const size_t n_refs, bm::bvector<>::bulk_insert_iterator *it, size_t read_id=0) {
+    char separator = ' ';
+    std::stringstream stream(line);
+    std::string part;
+    std::getline(stream, part, separator);
+    read_id = std::stoul(part);
+    size_t n_alignments = 0;
+    while(std::getline(stream, part, separator)) {
+	(*it) = read_id*n_refs + std::stoul(part);
+	++n_alignments;
+    }
+    return n_alignments;
+}
+
+size_t LegacyFulgorParser(const std::string &line, const size_t n_refs, bm::bvector<>::bulk_insert_iterator *it, size_t read_id) {
+    char separator = '\t';
+    std::stringstream stream(line);
+    std::string part;
+    std::getline(stream, part, separator);
+    std::getline(stream, part, separator);
+    size_t n_alignments = std::stoul(part);
+    while(std::getline(stream, part, separator)) {
+	(*it) = read_id*n_refs + std::stoul(part);
+    }
+    return n_alignments;
+}
+
+double LegacyParse(const alignment_writer::Format format, const std::string &input, const size_t n_refs, size_t *n_alignments) {
+    bm::bvector<> bits;
+    bm::bvector<>::bulk_insert_iterator it(bits);
+    std::function<size_t(const std::string &line, const size_t n_refs, bm::bvector<>::bulk_insert_iterator *it, size_t read_id)> parser;
+    parser = (format == alignment_writer::themisto ? LegacyThemistoParser : LegacyFulgorParser);
+
+    std::istringstream in(input);
+    const auto &start = std::chrono::steady_clock::now();
+    size_t line_number = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+	(*n_alignments) += parser(line, n_refs, &it, line_number);
+	++line_number;
+    }
+    it.flush();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <alignment_writer::Format F>
+double BlockParse(const std::string &input, const size_t n_refs, size_t *n_alignments) {
+    bm::bvector<> bits;
+    bm::bvector<>::bulk_insert_iterator it(bits);
+
+    std::istringstream in(input);
+    const auto &start = std::chrono::steady_clock::now();
+    size_t line_number = 0;
+    alignment_writer::ForEachLine(&in, [&](const char *begin, const char *end) {
+	size_t read_id = line_number;
+	(*n_alignments) += alignment_writer::ParseLine<F>(begin, end, read_id, [&](const size_t ref_id) {
+	    it = read_id*n_refs + ref_id;
+	});
+	++line_number;
+    });
+    it.flush();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Run(const alignment_writer::Format format, const std::string &name, const size_t n_reads, const size_t n_refs) {
+    const std::string &input = alignment_writer::GenerateAlignment(format, n_reads, n_refs);
+    size_t legacy_alignments = 0;
+    size_t block_alignments = 0;
+    double legacy = LegacyParse(format, input, n_refs, &legacy_alignments);
+    double block = (format == alignment_writer::themisto ? BlockParse<alignment_writer::themisto>(input, n_refs, &block_alignments)
+		    : BlockParse<alignment_writer::fulgor>(input, n_refs, &block_alignments));
+    if (legacy_alignments != block_alignments) {
+	std::cerr << "Parsers disagree on " << name << " input." << std::endl;
+    }
+    std::cout << name << "\tlegacy\t" << (size_t)(n_reads/legacy) << " lines/s" << '\n'
+	      << name << "\tblock\t" << (size_t)(n_reads/block) << " lines/s" << '\n'
+	      << name << "\tspeedup\t" << legacy/block << 'x' << std::endl;
+}
+}
+
+int main(int argc, char* argv[]) {
+    size_t n_reads = (argc > 1 ? std::stoul(argv[1]) : 5000000);
+    size_t n_refs = (argc > 2 ? std::stoul(argv[2]) : 1000);
+    Run(alignment_writer::themisto, "themisto", n_reads, n_refs);
+    Run(alignment_writer::fulgor, "fulgor", n_reads, n_refs);
+    return 0;
+}
@@ -0,0 +1,169 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_BENCH_SYNTHETIC_ALIGNMENT_HPP
+#define ALIGNMENT_WRITER_BENCH_SYNTHETIC_ALIGNMENT_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <sstream>
+#include <random>
+#include <vector>
+
+#include "pack.hpp"
+
+namespace alignment_writer {
+// Parameters of a synthetic pseudoalignment
+struct SyntheticOptions {
+    enum Distribution { uniform, geometric };
+
+    size_t n_reads = 1000000;
+    size_t n_refs = 1000;
+    // Pseudoalignments per read, uniform in [0, max_alignments] or geometric with
+    // mean `mean_alignments` truncated to max_alignments
+    Distribution distribution = uniform;
+    size_t max_alignments = 8;
+    double mean_alignments = 2.0;
+    // Fraction of the lines that are moved to random positions, only used for Themisto
+    // output since Fulgor reads are identified by their line
+    double unsorted_fraction = 0.0;
+    // If nonzero, the reads pseudoalign to one of `n_classes` random sets of references
+    // chosen with probability proportional to 1/rank^class_skew. Otherwise the references
+    // of each read are drawn independently.
+    size_t n_classes = 0;
+    double class_skew = 1.0;
+    size_t seed = 1;
+};
+
+// Generate a synthetic pseudoalignment with the parameters in `options`
+inline std::string GenerateAlignment(const Format format, const SyntheticOptions &options) {
+    std::mt19937_64 gen(options.seed);
+    std::uniform_int_distribution<size_t> uniform_count(0, options.max_alignments);
+    std::geometric_distribution<size_t> geometric_count(1.0/(1.0 + options.mean_alignments));
+    std::uniform_int_distribution<size_t> ref_id(0, options.n_refs - 1);
+    auto n_alignments = [&]() {
+	return (options.distribution == SyntheticOptions::uniform ? uniform_count(gen) : std::min(geometric_count(gen), options.max_alignments));
+    };
+    // Draws a sorted set of distinct references like Themisto reports them
+    auto draw_refs = [&](std::vector<size_t> *refs) {
+	const size_t n = std::min(n_alignments(), options.n_refs);
+	while (refs->size() < n) {
+	    refs->emplace_back(ref_id(gen));
+	    std::sort(refs->begin(), refs->end());
+	    refs->erase(std::unique(refs->begin(), refs->end()), refs->end());
+	}
+    };
+
+    // Sets of sorted references and the distribution of their ranks
+    std::vector<std::vector<size_t>> classes(options.n_classes);
+    for (std::vector<size_t> &refs : classes) {
+	draw_refs(&refs);
+    }
+    std::vector<double> weights(options.n_classes);
+    for (size_t i = 0; i < options.n_classes; ++i) {
+	weights[i] = 1.0/std::pow((double)(i + 1), options.class_skew);
+    }
+    std::discrete_distribution<size_t> class_id(weights.begin(), weights.end());
+
+    std::ostringstream out;
+    std::vector<size_t> line_starts; // Only needed for shuffling the lines
+    const bool shuffle = (format == themisto && options.unsorted_fraction > 0.0);
+    std::vector<size_t> refs;
+    for (size_t i = 0; i < options.n_reads; ++i) {
+	refs.clear();
+	if (options.n_classes > 0) {
+	    refs = classes[class_id(gen)];
+	} else {
+	    draw_refs(&refs);
+	}
+	if (shuffle) {
+	    line_starts.emplace_back(out.tellp());
+	}
+	if (format == themisto) {
+	    out << i;
+	    for (const size_t ref : refs) {
+		out << ' ' << ref;
+	    }
+	} else {
+	    out << "read" << i << '\t' << refs.size();
+	    for (const size_t ref : refs) {
+		out << '\t' << ref;
+	    }
+	}
+	out << '\n';
+    }
+    if (!shuffle) {
+	return out.str();
+    }
+
+    // Move a random subset of the lines to random positions among themselves
+    const std::string &sorted = out.str();
+    line_starts.emplace_back(sorted.size());
+    std::vector<size_t> order(options.n_reads);
+    for (size_t i = 0; i < order.size(); ++i) {
+	order[i] = i;
+    }
+    std::vector<size_t> moved;
+    std::bernoulli_distribution move(options.unsorted_fraction);
+    for (size_t i = 0; i < order.size(); ++i) {
+	if (move(gen)) {
+	    moved.emplace_back(i);
+	}
+    }
+    std::vector<size_t> targets(moved);
+    std::shuffle(targets.begin(), targets.end(), gen);
+    for (size_t i = 0; i < moved.size(); ++i) {
+	order[targets[i]] = moved[i];
+    }
+    std::string shuffled;
+    shuffled.reserve(sorted.size());
+    for (const size_t line : order) {
+	shuffled.append(sorted, line_starts[line], line_starts[line + 1] - line_starts[line]);
+    }
+    return shuffled;
+}
+
+// Generate a sorted synthetic pseudoalignment with 0-8 pseudoalignments per read
+inline std::string GenerateAlignment(const Format format, const size_t n_reads, const size_t n_refs, const size_t seed = 1) {
+    SyntheticOptions options;
+    options.n_reads = n_reads;
+    options.n_refs = n_refs;
+    options.seed = seed;
+    return GenerateAlignment(format, options);
+}
+}
+
+#endif
@@ -0,0 +1,293 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Pack and unpack throughput, packed size and peak memory use of a synthetic
+// pseudoalignment across compression profiles, buffer sizes and thread counts.
+// The results are written as JSON.
+//
+// Usage: throughput_benchmark [options], run with --help for the options
+//
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <exception>
+#include <system_error>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bm64.h"
+#include "cxxargs.hpp"
+
+#include "chunk_writer.hpp"
+#include "pack.hpp"
+#include "unpack.hpp"
+#include "synthetic_alignment.hpp"
+#include "version.h"
+#include "alignment-writer_openmp_config.hpp"
+
+namespace {
+struct Measurement {
+    double seconds = 0.0;
+    size_t packed_bytes = 0;
+    long peak_rss_kb = 0;
+    bool ok = false;
+};
+
+// Run `func` in a child process so that its peak resident set size is measured separately from
+// the other runs. `func` returns the size of the packed file in bytes, or 0 if it does not pack.
+template <typename Func>
+Measurement Measure(Func &&func) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+	throw std::system_error(errno, std::generic_category(), "could not create a pipe");
+    }
+    std::cout.flush();
+    const pid_t pid = fork();
+    if (pid < 0) {
+	throw std::system_error(errno, std::generic_category(), "could not start a benchmark process");
+    }
+    Measurement result;
+    if (pid == 0) {
+	close(fds[0]);
+	try {
+	    const auto &start = std::chrono::steady_clock::now();
+	    result.packed_bytes = func();
+	    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	    result.ok = true;
+	} catch (const std::exception &e) {
+	    std::cerr << "Benchmark run failed: " << e.what() << std::endl;
+	}
+	(void)!write(fds[1], &result, sizeof(result));
+	_exit(result.ok ? 0 : 1);
+    }
+    close(fds[1]);
+    if (read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+	result.ok = false;
+    }
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result.peak_rss_kb = usage.ru_maxrss;
+    return result;
+}
+
+// Discards the output and counts the bytes written to it
+class CountingBuffer : public std::streambuf {
+public:
+    size_t count = 0;
+
+protected:
+    std::streamsize xsputn(const char*, std::streamsize n) override { this->count += n; return n; }
+    int overflow(int c) override { if (c != EOF) { ++this->count; } return c; }
+};
+
+std::vector<std::string> ParseList(const std::string &list) {
+    std::vector<std::string> parts;
+    std::stringstream stream(list);
+    std::string part;
+    while (std::getline(stream, part, ',')) {
+	parts.emplace_back(part);
+    }
+    return parts;
+}
+
+std::vector<size_t> ParseSizes(const std::string &list) {
+    std::vector<size_t> sizes;
+    for (const std::string &part : ParseList(list)) {
+	sizes.emplace_back(std::stoul(part));
+    }
+    return sizes;
+}
+
+void SetThreads(const size_t n_threads) {
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    omp_set_num_threads(n_threads);
+#endif
+}
+}
+
+int main(int argc, char* argv[]) {
+    cxxargs::Arguments args("throughput_benchmark", "Usage: throughput_benchmark [options]");
+    args.add_short_argument<size_t>('r', "Number of reads (default: 2000000).", (size_t)2000000);
+    args.add_short_argument<size_t>('n', "Number of reference sequences (default: 1000).", (size_t)1000);
+    args.add_short_argument<std::string>('o', "Write the results to this file instead of cout.", "");
+    args.add_long_argument<std::string>("format", "Input format (one of `themisto` (default), `fulgor`).", "themisto");
+    args.add_long_argument<std::string>("distribution", "Distribution of the pseudoalignments per read (one of `uniform` (default), `geometric`).", "uniform");
+    args.add_long_argument<size_t>("max-alignments", "Largest number of pseudoalignments per read (default: 8).", (size_t)8);
+    args.add_long_argument<double>("mean-alignments", "Mean number of pseudoalignments per read with `--distribution geometric` (default: 2).", 2.0);
+    args.add_long_argument<double>("unsorted-fraction", "Fraction of the lines moved to random positions, Themisto only (default: 0).", 0.0);
+    args.add_long_argument<size_t>("classes", "Number of distinct sets of references, 0 draws the references of each read independently (default: 0).", (size_t)0);
+    args.add_long_argument<double>("class-skew", "Exponent of the Zipf distribution of the class frequencies (default: 1).", 1.0);
+    args.add_long_argument<size_t>("seed", "Random seed (default: 1).", (size_t)1);
+    args.add_long_argument<std::string>("compression", "Comma-separated compression profiles (default: default).", "default");
+    args.add_long_argument<std::string>("buffer-sizes", "Comma-separated --buffer-size values (default: 10000,100000,1000000).", "10000,100000,1000000");
+    args.add_long_argument<std::string>("threads", "Comma-separated thread counts (default: powers of two up to the number of cores).", "");
+    args.add_long_argument<std::string>("temp-dir", "Directory for the input and packed files (default: system temporary directory).", "");
+    try {
+	args.parse(argc, argv);
+    } catch (const std::exception &e) {
+	std::cerr << "Parsing arguments failed: " << e.what() << '\n' << args.help() << std::endl;
+	return 1;
+    }
+
+    alignment_writer::SyntheticOptions options;
+    options.n_reads = args.value<size_t>('r');
+    options.n_refs = args.value<size_t>('n');
+    options.distribution = (args.value<std::string>("distribution") == "geometric" ? alignment_writer::SyntheticOptions::geometric : alignment_writer::SyntheticOptions::uniform);
+    options.max_alignments = args.value<size_t>("max-alignments");
+    options.mean_alignments = args.value<double>("mean-alignments");
+    options.unsorted_fraction = args.value<double>("unsorted-fraction");
+    options.n_classes = args.value<size_t>("classes");
+    options.class_skew = args.value<double>("class-skew");
+    options.seed = args.value<size_t>("seed");
+    const alignment_writer::Format format = (args.value<std::string>("format") == "fulgor" ? alignment_writer::fulgor : alignment_writer::themisto);
+
+    std::vector<std::pair<std::string, alignment_writer::CompressionProfile>> profiles;
+    try {
+	for (const std::string &name : ParseList(args.value<std::string>("compression"))) {
+	    profiles.emplace_back(name, alignment_writer::NamedCompressionProfile(name));
+	}
+    } catch (const std::exception &e) {
+	std::cerr << "Parsing arguments failed: " << e.what() << std::endl;
+	return 1;
+    }
+
+    std::vector<size_t> thread_counts = ParseSizes(args.value<std::string>("threads"));
+    if (thread_counts.empty()) {
+	size_t max_threads = 1;
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+	max_threads = omp_get_max_threads();
+#endif
+	for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+	    thread_counts.emplace_back(n_threads);
+	}
+    }
+
+    // The runs read the input from a file so that it does not count towards their memory use
+    const std::filesystem::path &dir = (args.value<std::string>("temp-dir").empty() ? std::filesystem::temp_directory_path() : std::filesystem::path(args.value<std::string>("temp-dir")));
+    const std::string &prefix = (dir / ("alignment-writer-bench-" + std::to_string(getpid()))).string();
+    const std::string &text_path = prefix + ".txt";
+    const std::string &packed_path = prefix + ".aln";
+    size_t text_bytes;
+    {
+	const std::string &text = alignment_writer::GenerateAlignment(format, options);
+	text_bytes = text.size();
+	std::ofstream file(text_path, std::ios::binary);
+	file << text;
+    }
+
+    std::ostringstream results;
+    bool first_result = true;
+    auto add_result = [&](const std::string &operation, const std::string &profile, const size_t buffer_size, const size_t n_threads, const Measurement &run) {
+	results << (first_result ? "" : ",\n") << "    {\"operation\": \"" << operation << "\", \"compression\": \"" << profile << "\", \"buffer_size\": " << buffer_size
+		<< ", \"threads\": " << n_threads << ", \"ok\": " << (run.ok ? "true" : "false")
+		<< ", \"seconds\": " << run.seconds << ", \"mb_per_s\": " << (run.ok ? text_bytes/1000000.0/run.seconds : 0.0)
+		<< ", \"lines_per_s\": " << (run.ok ? options.n_reads/run.seconds : 0.0) << ", \"packed_bytes\": " << run.packed_bytes
+		<< ", \"peak_rss_kb\": " << run.peak_rss_kb << "}";
+	first_result = false;
+    };
+
+    for (const auto &profile : profiles) {
+	for (const size_t buffer_size : ParseSizes(args.value<std::string>("buffer-sizes"))) {
+	    for (const size_t n_threads : thread_counts) {
+		const Measurement &pack = Measure([&]() {
+		    SetThreads(n_threads);
+		    alignment_writer::ChunkPolicy policy;
+		    policy.size = buffer_size;
+		    policy.compression = profile.second;
+		    std::ifstream in(text_path, std::ios::binary);
+		    std::ofstream out(packed_path, std::ios::binary);
+		    if (n_threads > 1) {
+			alignment_writer::ParallelBufferedPack(format, options.n_refs, options.n_reads, policy, &in, &out);
+		    } else {
+			alignment_writer::BufferedPack(format, options.n_refs, options.n_reads, policy, &in, &out);
+		    }
+		    return (size_t)out.tellp();
+		});
+		add_result("pack", profile.first, buffer_size, n_threads, pack);
+
+		const Measurement &unpack = Measure([&]() {
+		    SetThreads(n_threads);
+		    std::ifstream in(packed_path, std::ios::binary);
+		    size_t n_reads, n_refs;
+		    if (n_threads > 1) {
+			alignment_writer::ParallelUnpack(&in, &n_reads, &n_refs);
+		    } else {
+			alignment_writer::Unpack(&in, &n_reads, &n_refs);
+		    }
+		    return (size_t)0;
+		});
+		add_result("unpack", profile.first, buffer_size, n_threads, unpack);
+
+		const Measurement &print = Measure([&]() {
+		    SetThreads(n_threads);
+		    std::ifstream in(packed_path, std::ios::binary);
+		    CountingBuffer counter;
+		    std::ostream out(&counter);
+		    alignment_writer::Print(&in, &out, format);
+		    return (size_t)0;
+		});
+		add_result("print", profile.first, buffer_size, n_threads, print);
+	    }
+	}
+    }
+    std::remove(text_path.c_str());
+    std::remove(packed_path.c_str());
+
+    std::ofstream file;
+    if (!args.value<std::string>('o').empty()) {
+	file.open(args.value<std::string>('o'));
+    }
+    std::ostream &out = (file.is_open() ? file : std::cout);
+    out << "{\n"
+	<< "  \"version\": \"" << ALIGNMENT_WRITER_BUILD_VERSION << "\",\n"
+	<< "  \"input\": {\"format\": \"" << (format == alignment_writer::fulgor ? "fulgor" : "themisto") << "\", \"reads\": " << options.n_reads
+	<< ", \"references\": " << options.n_refs << ", \"distribution\": \"" << (options.distribution == alignment_writer::SyntheticOptions::geometric ? "geometric" : "uniform")
+	<< "\", \"max_alignments\": " << options.max_alignments << ", \"mean_alignments\": " << options.mean_alignments
+	<< ", \"unsorted_fraction\": " << options.unsorted_fraction << ", \"classes\": " << options.n_classes
+	<< ", \"class_skew\": " << options.class_skew << ", \"seed\": " << options.seed << ", \"text_bytes\": " << text_bytes << "},\n"
+	<< "  \"results\": [\n" << results.str() << "\n  ]\n"
+	<< "}" << std::endl;
+    return 0;
+}
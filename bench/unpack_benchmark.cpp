@@ -0,0 +1,108 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+// Thread-scaling benchmark for ParallelUnpack.
+//
+// Usage: unpack_benchmark [number of reads] [number of references] [buffer size] [max threads]
+//
+#include <cstddef>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <chrono>
+
+#include "bm64.h"
+
+#include "pack.hpp"
+#include "unpack.hpp"
+#include "mapped_file.hpp"
+#include "synthetic_alignment.hpp"
+#include "alignment-writer_openmp_config.hpp"
+
+int main(int argc, char* argv[]) {
+    size_t n_reads = (argc > 1 ? std::stoul(argv[1]) : 20000000);
+    size_t n_refs = (argc > 2 ? std::stoul(argv[2]) : 1000);
+    size_t buffer_size = (argc > 3 ? std::stoul(argv[3]) : 100000);
+
+    std::stringstream packed;
+    {
+	std::istringstream text(alignment_writer::GenerateAlignment(alignment_writer::themisto, n_reads, n_refs));
+	alignment_writer::BufferedPack(alignment_writer::themisto, n_refs, n_reads, buffer_size, &text, &packed);
+    }
+    const std::string &data = packed.str();
+
+    // Also time reading the same data from a memory-mapped file
+    const std::string &path = "unpack_benchmark.aln";
+    {
+	std::ofstream file(path, std::ios::binary);
+	file << data;
+    }
+    const alignment_writer::MappedFile mapped(path);
+    std::remove(path.c_str());
+
+    size_t n_bits = 0;
+    auto time_unpack = [&](const bool parallel, const bool use_mapped) {
+	std::istringstream in(data);
+	size_t file_n_reads, file_n_refs;
+	const auto &start = std::chrono::steady_clock::now();
+	const bm::bvector<> &bits = (use_mapped ? (parallel ? alignment_writer::ParallelUnpack(mapped, &file_n_reads, &file_n_refs)
+						   : alignment_writer::Unpack(mapped, &file_n_reads, &file_n_refs))
+				     : (parallel ? alignment_writer::ParallelUnpack(&in, &file_n_reads, &file_n_refs)
+					: alignment_writer::Unpack(&in, &file_n_reads, &file_n_refs)));
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (n_bits == 0) {
+	    n_bits = bits.count();
+	} else if (n_bits != bits.count()) {
+	    std::cerr << "Unpacked alignments differ." << std::endl;
+	}
+	return seconds;
+    };
+
+    double serial = time_unpack(false, false);
+    double serial_mapped = time_unpack(false, true);
+    std::cout << "threads\tseconds\tspeedup\tmapped_seconds\tmapped_speedup" << '\n';
+    std::cout << "Unpack\t" << serial << '\t' << 1.0 << '\t' << serial_mapped << '\t' << serial/serial_mapped << std::endl;
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    size_t max_threads = (argc > 4 ? std::stoul(argv[4]) : omp_get_max_threads());
+    for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+	omp_set_num_threads(n_threads);
+	double parallel = time_unpack(true, false);
+	double parallel_mapped = time_unpack(true, true);
+	std::cout << n_threads << '\t' << parallel << '\t' << serial/parallel << '\t' << parallel_mapped << '\t' << serial/parallel_mapped << std::endl;
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,79 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_BLOCK_POOL_HPP
+#define ALIGNMENT_WRITER_BLOCK_POOL_HPP
+
+#include <cstddef>
+
+#include "bm64.h"
+#include "bmserial.h"
+
+namespace alignment_writer {
+// Free 8 KiB bit blocks of the bit vectors that the pool is set on (bm::bvector<>::set_allocator_pool).
+// New blocks are taken from the pool before allocating, so vectors that are cleared and refilled
+// chunk after chunk reuse the same memory. A pool must only be used by one thread at a time.
+typedef bm::bvector<>::allocator_pool_type BlockPool;
+
+// Number of free blocks kept in a pool, the rest are returned to the heap
+constexpr size_t BLOCK_POOL_LIMIT = 1024;
+
+// Pool of the calling thread. Set it on a bit vector with bm::bvector<>::mem_pool_guard so the
+// vector does not keep using the pool after leaving the scope or the thread.
+BlockPool& ThreadBlockPool();
+
+// Bit vector that takes its blocks from ThreadBlockPool and returns them there when it is cleared
+// or destroyed. For temporary vectors that are created, filled and destroyed on the same thread.
+class PooledBitVector : public bm::bvector<> {
+public:
+    PooledBitVector(const bm::strategy strat = bm::BM_BIT) : bm::bvector<>(strat) {
+	this->set_allocator_pool(&ThreadBlockPool());
+    }
+    PooledBitVector(const size_t size, const bm::strategy strat) : bm::bvector<>(strat, bm::gap_len_table<true>::_len, size) {
+	this->set_allocator_pool(&ThreadBlockPool());
+    }
+    PooledBitVector(const PooledBitVector&) = delete;
+    PooledBitVector& operator=(const PooledBitVector&) = delete;
+    ~PooledBitVector() {
+	this->clear(true);
+	this->set_allocator_pool(nullptr);
+    }
+};
+
+// Deserialize `chunk` into `bits` (OR with the old contents). The deserializer and its buffers are
+// kept per thread, and blocks for `bits` come from ThreadBlockPool if it has no pool of its own.
+void DeserializeChunk(const unsigned char *chunk, bm::bvector<> *bits);
+}
+
+#endif
@@ -0,0 +1,75 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_CHUNK_INDEX_HPP
+#define ALIGNMENT_WRITER_CHUNK_INDEX_HPP
+
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+namespace alignment_writer {
+// Location and read range of one chunk written by BufferedPack.
+// In reference-major files the read range fields contain the range of reference ids.
+struct ChunkInfo {
+    size_t offset; // Byte offset of the serialized chunk from the start of the file
+    size_t size; // Size of the serialized chunk in bytes
+    size_t first_read; // Smallest read id stored in the chunk
+    size_t last_read; // Largest read id stored in the chunk
+    size_t first_bit; // First bit position the chunk can set when unpacked, 0 if not known
+    size_t last_bit; // Last bit position the chunk can set when unpacked, SIZE_MAX if not known
+
+    // Check if the chunk may contain reads in the closed interval [first, last]
+    bool Overlaps(const size_t first, const size_t last) const { return first_read <= last && last_read >= first; }
+    // Check if the chunk may set bits in the closed interval [first, last]
+    bool OverlapsBits(const size_t first, const size_t last) const { return first_bit <= last && last_bit >= first; }
+};
+
+// Write the chunk index footer, `index_offset` is the position of the footer in the file.
+// Returns the number of bytes written.
+size_t WriteIndex(const std::vector<ChunkInfo> &index, const size_t index_offset, std::ostream *out);
+
+// Read the chunk index footer from a seekable stream, returns false if the stream has no index
+// and throws if the size of the index does not match its number of chunks.
+// The read position of `in` is restored before returning.
+bool ReadIndex(std::istream *in, std::vector<ChunkInfo> *index);
+
+// Find the offset of the binary index footer from the trailer at the end of a seekable stream or a
+// file in memory, returns false if there is no binary index. The read position of `in` is restored.
+bool FindIndexOffset(std::istream *in, size_t *index_offset);
+bool FindIndexOffset(const unsigned char *data, const size_t size, size_t *index_offset);
+}
+
+#endif
@@ -0,0 +1,234 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_CHUNK_SOURCE_HPP
+#define ALIGNMENT_WRITER_CHUNK_SOURCE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <istream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "chunk_index.hpp"
+#include "file_format.hpp"
+#include "run_stats.hpp"
+#include "alignment-writer_openmp_config.hpp"
+
+namespace alignment_writer {
+// The chunk sources below provide
+//   bool Next(ChunkInfo *info, const unsigned char **chunk, std::vector<unsigned char> *storage)
+// which points `chunk` to the next serialized chunk and fills in `info`.
+
+// Reads the chunks from a stream into a reusable buffer
+class StreamChunks {
+public:
+    StreamChunks(std::istream *_in, const FileHeader &_header) : in(_in), version(_header.version) {}
+
+    // Point `chunk` to the next chunk and fill in `info`, returns false if there are no chunks left.
+    // The chunk is read into `storage` and stays valid until `storage` is modified.
+    bool Next(ChunkInfo *info, const unsigned char **chunk, std::vector<unsigned char> *storage) {
+	run_stats::StageTimer timer(RunStats::read);
+	if (!this->chunks_left || !(this->chunks_left = ReadChunk(this->in, this->version, info, storage))) {
+	    return false;
+	}
+	run_stats::Count(run_stats::bytes_in, info->size);
+	(*chunk) = storage->data();
+	return true;
+    }
+
+private:
+    std::istream *in;
+    uint16_t version;
+    bool chunks_left = true;
+};
+
+// Points to the chunks of a packed file in memory without copying them
+class MappedChunks {
+public:
+    MappedChunks(const unsigned char *_data, const std::vector<ChunkInfo> &_chunks) : data(_data), chunks(_chunks) {}
+
+    // Point `chunk` to the next chunk and fill in `info`, returns false if there are no chunks left. `storage` is not used.
+    bool Next(ChunkInfo *info, const unsigned char **chunk, std::vector<unsigned char> *) {
+	if (this->next_chunk == this->chunks.size()) {
+	    return false;
+	}
+	(*info) = this->chunks[this->next_chunk];
+	(*chunk) = this->data + info->offset;
+	run_stats::Count(run_stats::bytes_in, info->size);
+	++this->next_chunk;
+	return true;
+    }
+
+private:
+    const unsigned char *data;
+    const std::vector<ChunkInfo> &chunks;
+    size_t next_chunk = 0;
+};
+
+// Reads the chunks listed in `chunks` from a seekable stream
+class IndexedChunks {
+public:
+    IndexedChunks(std::istream *_in, const std::vector<ChunkInfo> &_chunks) : in(_in), chunks(_chunks) {}
+
+    // Point `chunk` to the next chunk and fill in `info`, returns false if there are no chunks left.
+    // The chunk is read into `storage` and stays valid until `storage` is modified.
+    bool Next(ChunkInfo *info, const unsigned char **chunk, std::vector<unsigned char> *storage) {
+	if (this->next_chunk == this->chunks.size()) {
+	    return false;
+	}
+	(*info) = this->chunks[this->next_chunk];
+	run_stats::StageTimer timer(RunStats::read);
+	storage->resize(info->size);
+	this->in->seekg(info->offset);
+	this->in->read(reinterpret_cast<char*>(storage->data()), info->size);
+	if (!this->in->good() || (size_t)this->in->gcount() != info->size) {
+	    throw std::runtime_error("Packed file is truncated.");
+	}
+	run_stats::Count(run_stats::bytes_in, info->size);
+	(*chunk) = storage->data();
+	++this->next_chunk;
+	return true;
+    }
+
+private:
+    std::istream *in;
+    const std::vector<ChunkInfo> &chunks;
+    size_t next_chunk = 0;
+};
+
+// Number of result slots used by ForEachChunkInParallel
+inline size_t ChunkSlots() {
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    return 2*omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Calls `process(slot, info, chunk)` for each chunk from `source` in parallel using the number of threads
+// set with omp_set_num_threads, and `finish(slot, info)` for each processed chunk in file order from the
+// calling thread. Results for a chunk can be stored at index `slot` of a vector with ChunkSlots() elements;
+// the slot is not reused before `finish` has returned. The first exception thrown by `process` in file order,
+// or by `finish` or `source`, is rethrown to the caller after the running tasks have completed.
+template <typename ChunkSource, typename Process, typename Finish>
+void ForEachChunkInParallel(ChunkSource &source, Process &&process, Finish &&finish) {
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    const size_t batch_size = ChunkSlots()/2;
+    // Exceptions can not leave the parallel region, the first one is stored and rethrown after it
+    std::exception_ptr error;
+#pragma omp parallel
+    {
+#pragma omp single
+	{
+	    // The slots are split into two halves. While the worker threads process the chunks in one
+	    // half, this thread finishes the previous batch and then reads the next batch into the other half.
+	    std::vector<const unsigned char*> chunks(2*batch_size);
+	    std::vector<std::vector<unsigned char>> storage(2*batch_size);
+	    std::vector<ChunkInfo> infos(2*batch_size);
+	    std::vector<std::exception_ptr> errors(2*batch_size); // Exception thrown by `process` for each slot
+
+	    // Reads the next batch into the slots starting from `first_slot`, returns the number of chunks read
+	    auto read_batch = [&](const size_t first_slot) {
+		size_t n_chunks = 0;
+		while (n_chunks < batch_size && source.Next(&infos[first_slot + n_chunks], &chunks[first_slot + n_chunks], &storage[first_slot + n_chunks])) {
+		    ++n_chunks;
+		}
+		return n_chunks;
+	    };
+
+	    try {
+		size_t current = 0;
+		size_t n_chunks = read_batch(current);
+		size_t done = batch_size;
+		size_t n_done = 0;
+		while (n_chunks > 0) {
+		    for (size_t i = 0; i < n_chunks; ++i) {
+			const size_t slot = current + i;
+#pragma omp task firstprivate(slot) shared(infos, chunks, errors)
+			{
+			    try {
+				process(slot, infos[slot], chunks[slot]);
+			    } catch (...) {
+				errors[slot] = std::current_exception();
+			    }
+			}
+		    }
+
+		    for (size_t i = 0; i < n_done; ++i) {
+			finish(done + i, infos[done + i]);
+		    }
+		    size_t n_next = read_batch(done);
+
+#pragma omp taskwait
+		    // Rethrow before `finish` is called for the failed slot
+		    for (size_t i = 0; i < n_chunks; ++i) {
+			if (errors[current + i]) {
+			    std::rethrow_exception(errors[current + i]);
+			}
+		    }
+		    std::swap(current, done);
+		    n_done = n_chunks;
+		    n_chunks = n_next;
+		}
+
+		// Finish the last batch
+		for (size_t i = 0; i < n_done; ++i) {
+		    finish(done + i, infos[done + i]);
+		}
+	    } catch (...) {
+		// The running tasks use the buffers of this block
+#pragma omp taskwait
+		error = std::current_exception();
+	    }
+	}
+    }
+    if (error) {
+	std::rethrow_exception(error);
+    }
+#else
+    std::vector<unsigned char> storage;
+    ChunkInfo info;
+    const unsigned char *chunk;
+    while (source.Next(&info, &chunk, &storage)) {
+	process(0, info, chunk);
+	finish(0, info);
+    }
+#endif
+}
+}
+
+#endif
@@ -0,0 +1,98 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_CHUNK_WRITER_HPP
+#define ALIGNMENT_WRITER_CHUNK_WRITER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "bm64.h"
+#include "bmserial.h"
+
+#include "chunk_index.hpp"
+#include "file_format.hpp"
+
+namespace alignment_writer {
+// Trade-off between the size of the packed file and the time to pack and unpack it. The chunks
+// record how they were encoded, so files packed with any profile are read the same way.
+struct CompressionProfile {
+    // BitMagic compression level (0-6), see bm::serializer::set_compression_level
+    unsigned level = bm::set_compression_default;
+    // XOR-compress the bit planes of the class id vectors of equivalence class chunks against
+    // each other (bmxor.h). A single bit vector is compressed block by block on its own.
+    bool xor_planes = false;
+};
+
+// Named profiles: `fast` (light encodings that are several times faster to decode than
+// `default` but larger), `default` and `max`. Throws std::invalid_argument for other names.
+// `max` only differs from `default` in the class id chunks of the equivalence class encoding.
+CompressionProfile NamedCompressionProfile(const std::string &name);
+
+// Set the serializer options used for all chunks, with the compression level of `profile`
+void ConfigureSerializer(bm::serializer<bm::bvector<>> *bvs, const CompressionProfile &profile);
+
+// A serialized chunk and the range of reads it contains
+struct SerializedChunk {
+    bm::serializer<bm::bvector<>>::buffer data;
+    size_t first_read;
+    size_t last_read;
+};
+
+// Writes the header, the chunks and the chunk index of a packed file. The bit range of each
+// chunk is computed from its read range (reference range in reference-major files).
+// If `n_reads` is UNKNOWN_DIMENSION the number of reads is given to Finish and either filled
+// in to the header, if `out` is seekable, or written after the chunks.
+class ChunkWriter {
+public:
+    ChunkWriter(const size_t n_refs, const size_t n_reads, std::ostream *_out, const uint16_t flags = 0);
+
+    void WriteBuffer(const SerializedChunk &chunk);
+    void Finish();
+    void Finish(const size_t n_reads);
+
+private:
+    std::ostream *out;
+    FileHeader header;
+    std::streampos header_pos; // Position of the header in `out`, -1 if `out` is not seekable
+    size_t row_size; // Number of bits per read, or per reference in reference-major files
+    size_t bytes_written;
+    std::vector<ChunkInfo> index;
+};
+}
+
+#endif
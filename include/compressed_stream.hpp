@@ -0,0 +1,98 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_COMPRESSED_STREAM_HPP
+#define ALIGNMENT_WRITER_COMPRESSED_STREAM_HPP
+
+#include <cstddef>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+
+namespace alignment_writer {
+// Reads `source` on a background thread in blocks of `block_size` bytes, so that decompressing
+// a compressed input stream such as a bxz::ifstream runs concurrently with parsing it. At most
+// the block that is being read and the next block are held in memory. Errors from `source`
+// are rethrown from the reading functions of the stream.
+class ReadAheadStream : public std::istream {
+public:
+    ReadAheadStream(std::unique_ptr<std::istream> source, const size_t block_size = 4194304);
+    ~ReadAheadStream();
+
+private:
+    std::unique_ptr<std::istream> source;
+    std::unique_ptr<std::streambuf> buffer;
+};
+
+// Check if the file at `path` starts with a BGZF block
+bool IsBgzf(const std::string &path);
+
+// Decompresses a BGZF file, a gzip file written as independent members of at most 64 KiB with
+// their compressed size in the header (written by `bgzip` and BgzfOutputStream). Batches of
+// `batch_blocks` blocks are decompressed in parallel on a background thread while the previous
+// batch is read, using the number of threads set with omp_set_num_threads when the stream is created.
+class BgzfInputStream : public std::istream {
+public:
+    BgzfInputStream(const std::string &path, const size_t batch_blocks = 256);
+    ~BgzfInputStream();
+
+private:
+    std::ifstream file;
+    std::unique_ptr<std::streambuf> buffer;
+};
+
+// Compresses the output in BGZF blocks. The result can be read with gzip and bxz::ifstream like
+// any other gzip file, and in parallel with BgzfInputStream. Batches of `batch_blocks` blocks are
+// compressed in parallel and written to `out` on a background thread while the next batch is
+// filled, using the number of threads set with omp_set_num_threads when the stream is created.
+// The stream is not seekable, so ChunkWriter stores an unknown number of reads after the chunks.
+class BgzfOutputStream : public std::ostream {
+public:
+    BgzfOutputStream(std::ostream *out, const int level = 6, const size_t batch_blocks = 256);
+    // Calls Finish if it has not been called
+    ~BgzfOutputStream();
+
+    // Compress and write the remaining output and the end-of-file block
+    void Finish();
+
+private:
+    std::unique_ptr<std::streambuf> buffer;
+    bool finished = false;
+};
+}
+
+#endif
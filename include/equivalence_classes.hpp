@@ -0,0 +1,152 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_EQUIVALENCE_CLASSES_HPP
+#define ALIGNMENT_WRITER_EQUIVALENCE_CLASSES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "bm64.h"
+#include "bmsparsevec_compr.h"
+
+#include "chunk_index.hpp"
+#include "chunk_writer.hpp"
+#include "file_format.hpp"
+
+namespace alignment_writer {
+// Class id of each read in a chunk, indexed by the read id. Reads without pseudoalignments are NULL.
+typedef bm::rsc_sparse_vector<uint32_t, bm::sparse_vector<uint32_t, bm::bvector<>>> ClassIds;
+
+// Dictionary of the distinct sets of references that the reads pseudoalign to
+class EquivalenceClasses {
+public:
+    EquivalenceClasses() = default;
+
+    // Returns the id of the class with the references in `refs` (sorted), adding the class if it is new
+    uint32_t Insert(const std::vector<uint32_t> &refs);
+
+    // Number of classes
+    size_t size() const { return this->offsets.size() - 1; }
+    // References in class `class_id`
+    const uint32_t* begin(const size_t class_id) const { return this->refs.data() + this->offsets[class_id]; }
+    const uint32_t* end(const size_t class_id) const { return this->refs.data() + this->offsets[class_id + 1]; }
+
+    // The dictionary is stored as a bit vector with the bit for class `c` and reference `k` at `c*n_refs + k`
+    void Serialize(const size_t n_refs, const CompressionProfile &compression, SerializedChunk *chunk) const;
+    void Deserialize(const unsigned char *chunk, const size_t n_refs);
+
+private:
+    struct RefsHash {
+	size_t operator()(const std::vector<uint32_t> &refs) const;
+    };
+
+    std::vector<size_t> offsets = { 0 };
+    std::vector<uint32_t> refs;
+    std::unordered_map<std::vector<uint32_t>, uint32_t, RefsHash> ids; // Only used when packing
+};
+
+// Serialize the class ids of the reads in [first_read, last_read]
+void SerializeClassIds(const ClassIds &ids, const size_t first_read, const size_t last_read, const CompressionProfile &compression, SerializedChunk *chunk);
+void DeserializeClassIds(const unsigned char *chunk, ClassIds *ids);
+
+// Calls `func(read_id, class_id)` for each read with pseudoalignments in `ids` in read order
+template <typename ClassFunc>
+void ForEachClassId(const ClassIds &ids, ClassFunc &&func) {
+    // The values of the non-NULL reads are stored contiguously in read order
+    const bm::bvector<> *aligned = ids.get_null_bvector();
+    std::vector<uint32_t> values(aligned->count());
+    if (!values.empty()) {
+	ids.get_sv().decode(values.data(), 0, values.size());
+    }
+    size_t i = 0;
+    for (bm::bvector<>::enumerator en = aligned->first(); en.valid(); ++en) {
+	func(*en, values[i++]);
+    }
+}
+
+// Deserializes the chunks of a packed file. Chunks in files packed with equivalence
+// classes are expanded to the read-major layout and chunks in files packed with
+// chunk-relative addressing are moved to the rows of their reads.
+class ChunkDecoder {
+public:
+    ChunkDecoder(const FileHeader &_header) : header(_header) {}
+
+    // Read the dictionary from `source` if the file was packed with equivalence classes.
+    // The dictionary is the first chunk so this must be called before reading the other chunks.
+    template <typename ChunkSource>
+    void ReadDictionary(ChunkSource &source) {
+	if (this->HasClasses()) {
+	    std::vector<unsigned char> storage;
+	    ChunkInfo info;
+	    const unsigned char *chunk;
+	    if (!source.Next(&info, &chunk, &storage)) {
+		throw std::runtime_error("the equivalence class dictionary is missing");
+	    }
+	    this->dictionary.Deserialize(chunk, this->header.n_refs);
+	}
+    }
+
+    // Deserialize `chunk` with the metadata `info` into the layout of the whole file (OR with old data in `bits`)
+    void Deserialize(const ChunkInfo &info, const unsigned char *chunk, bm::bvector<> *bits) const;
+    // Deserialize `chunk` without moving its bits to the rows of the whole file (OR with old data in `bits`).
+    // Returns the read id of the first row of `bits`, which is 0 unless the file was packed with
+    // chunk-relative addressing or equivalence classes.
+    size_t DeserializeLocal(const ChunkInfo &info, const unsigned char *chunk, bm::bvector<> *bits) const;
+
+    bool HasClasses() const { return this->header.flags & EQUIVALENCE_CLASS_FLAG; }
+    bool ChunkRelative() const { return this->header.flags & CHUNK_RELATIVE_FLAG; }
+    const EquivalenceClasses& classes() const { return this->dictionary; }
+
+private:
+    // Expand the class ids in `chunk` to the rows of the reads starting from `first_row`
+    void ExpandClasses(const unsigned char *chunk, const size_t first_row, bm::bvector<> *bits) const;
+
+    FileHeader header;
+    EquivalenceClasses dictionary;
+};
+
+// Find the equivalence classes of a packed file and the number of reads in each class.
+// Files that were not packed with equivalence classes are unpacked to find the classes.
+void CountClasses(std::istream *in, EquivalenceClasses *classes, std::vector<size_t> *counts);
+// Print `<number of reads> <ref id> <ref id> ...` for each class
+void PrintClassCounts(const EquivalenceClasses &classes, const std::vector<size_t> &counts, std::ostream *out);
+}
+
+#endif
@@ -0,0 +1,139 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_FILE_FORMAT_HPP
+#define ALIGNMENT_WRITER_FILE_FORMAT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "chunk_index.hpp"
+
+namespace alignment_writer {
+// Binary packed files start with these four bytes followed by the format version. Files
+// that start with a digit use the legacy text framing (`n_reads,n_refs` header and chunk size lines).
+constexpr unsigned char FILE_MAGIC[4] = { 'A', 'L', 'N', 'W' };
+constexpr uint16_t LEGACY_TEXT_VERSION = 0;
+constexpr uint16_t BINARY_FORMAT_VERSION = 1;
+
+// Magic, version, flags, number of reads, number of references
+constexpr size_t BINARY_HEADER_SIZE = 24;
+
+// Chunk size field value that marks the end of the chunks
+constexpr uint64_t CHUNKS_END = 0xFFFFFFFFFFFFFFFF;
+
+// Metadata slots stored before each chunk. Readers ignore slots they do not know about.
+// The bit range slots contain the closed range of bit positions that the chunk can set
+// when it is unpacked, which covers the whole rows of the reads (or references) in the chunk.
+enum ChunkMetadataSlot { FIRST_READ_SLOT = 0, LAST_READ_SLOT = 1, FIRST_BIT_SLOT = 2, LAST_BIT_SLOT = 3, N_METADATA_SLOTS = 4 };
+// Largest number of metadata slots accepted by the readers, larger counts are treated as corrupt
+constexpr uint64_t MAX_METADATA_SLOTS = 1024;
+
+// Header flags
+// The bit for read `n` and reference `k` is stored at `k*n_reads + n` instead of `n*n_refs + k`
+// and the chunks contain whole references. The chunk metadata slots contain the first and
+// last reference id in the chunk in place of the read ids.
+constexpr uint16_t REFERENCE_MAJOR_FLAG = 1;
+// The first chunk is a dictionary of the distinct sets of references (equivalence classes) and the other
+// chunks contain the class id of each read (see equivalence_classes.hpp). The dictionary has no reads so
+// its metadata slots contain an empty read range. Unpacking returns the read-major layout.
+constexpr uint16_t EQUIVALENCE_CLASS_FLAG = 2;
+// The number of reads was not known when the header was written. The header contains UNKNOWN_DIMENSION
+// in its place and the chunks end marker is followed by a DIMENSIONS_RECORD_SIZE byte record with the
+// number of reads and references. Writers that can seek back fill in the header and clear the flag instead.
+constexpr uint16_t DIMENSIONS_IN_TRAILER_FLAG = 4;
+constexpr size_t DIMENSIONS_RECORD_SIZE = 16;
+// The bit for read `n` and reference `k` is stored at `(n - first_read)*n_refs + k` where `first_read` is
+// the first read id in the metadata slots of the chunk. A chunk only needs as many bits as its reads
+// times the number of references, so the size of the whole alignment is not limited by the size of
+// a bit vector. Only used with the read-major layout.
+constexpr uint16_t CHUNK_RELATIVE_FLAG = 8;
+
+// Value of a dimension that is not known before the input has been read
+constexpr size_t UNKNOWN_DIMENSION = 0xFFFFFFFFFFFFFFFF;
+
+struct FileHeader {
+    uint16_t version;
+    uint16_t flags;
+    size_t n_reads;
+    size_t n_refs;
+};
+
+// First read of the rows stored in a chunk of a file packed with CHUNK_RELATIVE_FLAG.
+// Chunks without the read range in their metadata start from the first read.
+inline size_t ChunkFirstRow(const ChunkInfo &chunk) { return (chunk.first_read <= chunk.last_read ? chunk.first_read : 0); }
+
+// Fixed-width little-endian integers
+void WriteLittleEndian(const uint64_t value, const size_t n_bytes, std::ostream *out);
+uint64_t DecodeLittleEndian(const unsigned char *data, const size_t n_bytes);
+
+// Write the binary header, returns the number of bytes written
+size_t WriteFileHeader(const FileHeader &header, std::ostream *out);
+
+// Read the header from the start of a packed file in either the binary or the legacy text framing.
+// Dimensions stored at the end of the file are read by seeking to them if `in` is seekable,
+// otherwise DIMENSIONS_IN_TRAILER_FLAG stays set and n_reads is UNKNOWN_DIMENSION.
+FileHeader ReadFileHeader(std::istream *in);
+// Parse the header of a packed file stored in memory, sets `header_size` to the number of bytes in the header
+FileHeader ParseFileHeader(const unsigned char *data, const size_t size, size_t *header_size);
+
+// Write the dimensions record after the chunks end marker, returns the number of bytes written
+size_t WriteDimensions(const FileHeader &header, std::ostream *out);
+// Read the dimensions record that follows the chunks end marker into `header` and clear DIMENSIONS_IN_TRAILER_FLAG
+void ReadDimensions(std::istream *in, FileHeader *header);
+// Throw if the dimensions of the file were not read from its end
+void CheckDimensions(const FileHeader &header);
+
+// Function for reading the header line of the legacy text framing
+void ReadHeader(const std::string &header_line, size_t *n_reads, size_t *n_refs);
+
+// Write one chunk and its metadata slots in a single call per field.
+// Returns the number of bytes written before the serialized chunk.
+size_t WriteChunk(const unsigned char *chunk, const size_t chunk_size, const std::vector<uint64_t> &metadata, std::ostream *out);
+// Write the marker after the last chunk, returns the number of bytes written
+size_t WriteChunksEnd(std::ostream *out);
+
+// Read the next chunk of a file with format `version` into `payload` and fill in `chunk`
+// from the metadata slots. Returns false if there are no chunks left.
+bool ReadChunk(std::istream *in, const uint16_t version, ChunkInfo *chunk, std::vector<unsigned char> *payload);
+// Find the chunk that starts at byte `*pos` of a packed file stored in memory and advance
+// `*pos` past it. Returns false if there are no chunks left.
+bool ParseChunk(const unsigned char *data, const size_t size, const uint16_t version, size_t *pos, ChunkInfo *chunk);
+}
+
+#endif
@@ -0,0 +1,183 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_LINE_PARSER_HPP
+#define ALIGNMENT_WRITER_LINE_PARSER_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <charconv>
+#include <istream>
+#include <vector>
+#include <stdexcept>
+#include <system_error>
+
+#include "pack.hpp"
+#include "run_stats.hpp"
+
+namespace alignment_writer {
+// Parse one unsigned integer from [*pos, end) and advance *pos past it
+inline size_t ParseNumber(const char **pos, const char *end) {
+    size_t value;
+    const std::from_chars_result &res = std::from_chars(*pos, end, value);
+    if (res.ec != std::errc()) {
+	throw std::invalid_argument("expected a number in the input");
+    }
+    *pos = res.ptr;
+    return value;
+}
+
+// Returns the id of the read on the line in [begin, end) without parsing the pseudoalignments.
+// The *Fulgor* format does not store the read id, it is given by `line_number`.
+template <Format F>
+size_t LineReadId(const char *begin, const char *end, const size_t line_number) {
+    if constexpr (F == themisto) {
+	return ParseNumber(&begin, end);
+    } else {
+	return line_number;
+    }
+}
+
+// Parses the pseudoalignment line in [begin, end) (excluding the newline) stored in format `F`.
+// Calls `insert(ref_id)` for each pseudoalignment on the line and returns the number of pseudoalignments.
+// The *Themisto* format stores the read id in the first column and overwrites `read_id`;
+// for the *Fulgor* format `read_id` should be the line number.
+template <Format F, typename Inserter>
+size_t ParseLine(const char *begin, const char *end, size_t &read_id, Inserter &&insert) {
+    // Ignore carriage returns from files with Windows line endings
+    if (end > begin && *(end - 1) == '\r') {
+	--end;
+    }
+
+    size_t n_alignments = 0;
+    if constexpr (F == themisto) {
+	// `<read id> <ref id> <ref id> ...` separated by spaces
+	read_id = ParseNumber(&begin, end); // First column is a numerical ID for the read
+	while (begin < end) {
+	    if (*begin == ' ') {
+		++begin;
+		continue;
+	    }
+	    insert(ParseNumber(&begin, end));
+	    ++n_alignments;
+	}
+    } else if constexpr (F == fulgor) {
+	// `<fragment name>\t<number of alignments>\t<ref id>\t<ref id>...` separated by tabs
+	begin = static_cast<const char*>(std::memchr(begin, '\t', end - begin)); // First column is the fragment name
+	if (begin == nullptr) {
+	    throw std::invalid_argument("expected a tab-separated line in the input");
+	}
+	++begin;
+	n_alignments = ParseNumber(&begin, end); // Second column is the number of alignments
+	while (begin < end) {
+	    if (*begin == '\t') {
+		++begin;
+		continue;
+	    }
+	    insert(ParseNumber(&begin, end));
+	}
+    }
+    return n_alignments;
+}
+
+// Calls `line_func(begin, end)` for each line in the block [begin, end).
+// The last line does not need to end in a newline.
+template <typename LineFunc>
+void ForEachLineInBlock(const char *begin, const char *end, LineFunc &&line_func) {
+    const char *newline;
+    while ((newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin))) != nullptr) {
+	line_func(begin, newline);
+	begin = newline + 1;
+    }
+    if (begin < end) {
+	line_func(begin, end);
+    }
+}
+
+// Reads a stream in blocks of approximately `block_size` bytes that end at line boundaries
+class LineBlockReader {
+public:
+    LineBlockReader(std::istream *_in, const size_t _block_size) : in(_in), block_size(_block_size) {}
+
+    // Replace the contents of `block` with the next block of complete lines, returns false at the end of the input
+    bool NextBlock(std::vector<char> *block) {
+	block->swap(this->carry);
+	this->carry.clear();
+	size_t n_bytes = block->size();
+	while (*(this->in)) {
+	    block->resize(n_bytes + this->block_size);
+	    {
+		run_stats::StageTimer timer(RunStats::read);
+		this->in->read(block->data() + n_bytes, this->block_size);
+	    }
+	    const size_t n_read = this->in->gcount();
+	    run_stats::Count(run_stats::bytes_in, n_read);
+
+	    // Find the last newline in the new bytes, keep reading if the block contains no complete lines
+	    const char *begin = block->data() + n_bytes;
+	    const char *last = begin + n_read;
+	    while (last > begin && *(last - 1) != '\n') {
+		--last;
+	    }
+	    n_bytes += n_read;
+	    if (last > begin) {
+		// Save the incomplete line for the next block
+		this->carry.assign(last, static_cast<const char*>(block->data() + n_bytes));
+		n_bytes = last - block->data();
+		break;
+	    }
+	}
+	block->resize(n_bytes);
+	return n_bytes > 0;
+    }
+
+private:
+    std::istream *in;
+    size_t block_size;
+    std::vector<char> carry; // Incomplete line at the end of the previous block
+};
+
+// Reads `in` in blocks of `block_size` bytes and calls `line_func(begin, end)` for each line.
+// Lines are passed as pointers into the block so no memory is allocated per line.
+template <typename LineFunc>
+void ForEachLine(std::istream *in, LineFunc &&line_func, const size_t block_size = 1048576) {
+    LineBlockReader reader(in, block_size);
+    std::vector<char> block;
+    while (reader.NextBlock(&block)) {
+	ForEachLineInBlock(block.data(), block.data() + block.size(), line_func);
+    }
+}
+}
+
+#endif
@@ -0,0 +1,61 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_MERGE_HPP
+#define ALIGNMENT_WRITER_MERGE_HPP
+
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "chunk_writer.hpp"
+
+// The chunks of each input are remapped and reserialized in parallel using the
+// number of threads set with omp_set_num_threads. The output is in the read-major layout
+// and its chunks are serialized with the `compression` profile.
+namespace alignment_writer {
+// Concatenate packed files that contain different reads against the same references. The reads
+// of input `i` are offset by the total number of reads in inputs 0, ..., i-1.
+void MergeReads(const std::vector<std::istream*> &inputs, std::ostream *out, const CompressionProfile &compression = CompressionProfile());
+
+// Union packed files that contain the same reads against different references. Reference `k` of
+// input `i` is written as reference `ref_maps[i][k]` of the `n_refs` references in the output.
+// The inputs are read in lockstep so they must be in the read-major layout and sorted by read id.
+void MergeReferences(const std::vector<std::istream*> &inputs, const std::vector<std::vector<size_t>> &ref_maps, const size_t n_refs, std::ostream *out, const CompressionProfile &compression = CompressionProfile());
+// Union with the references of each input placed after the references of the previous inputs
+void MergeReferences(const std::vector<std::istream*> &inputs, std::ostream *out, const CompressionProfile &compression = CompressionProfile());
+}
+
+#endif
@@ -36,19 +36,127 @@
 #define ALIGNMENT_WRITER_PACK_HPP
 
 #include <cstddef>
+#include <cstdint>
 #include <istream>
+#include <memory>
 #include <ostream>
+#include <string>
+#include <vector>
 
 #include "bm64.h"
 
+#include "chunk_writer.hpp"
+#include "file_format.hpp"
+
 namespace alignment_writer {
 enum Format { themisto, fulgor };
 
+// Target size of the chunks written by the packing functions. A chunk is closed once it reaches
+// the target and the next input line belongs to a different read, so the pseudoalignments of a
+// read are never split between chunks. The `bytes` target is approximate: the size of the next
+// chunk is estimated from the compression ratio of the previous chunks.
+//
+// With `relative` set, the bits of each chunk are stored relative to its first read
+// (see CHUNK_RELATIVE_FLAG) and the number of reads times the number of references
+// is not limited to 2^47. This requires input sorted by read id and is used
+// automatically if the alignment is too large for the whole-file addressing.
+//
+// The chunks are serialized with the `compression` profile (see CompressionProfile).
+struct ChunkPolicy {
+    enum Unit { alignments, reads, bytes };
+    Unit unit = alignments;
+    size_t size = 100000;
+    bool relative = false;
+    CompressionProfile compression;
+};
+
 // Pack a pseudoalignment that is already in memory
-void Pack(const bm::bvector<> &bits, const size_t n_refs, const size_t n_reads, std::ostream *out);
+void Pack(const bm::bvector<> &bits, const size_t n_refs, const size_t n_reads, std::ostream *out, const CompressionProfile &compression = CompressionProfile());
 
-// Buffered read of a pseudoalignment from a stream and packing
+// Buffered read of a pseudoalignment from a stream and packing in chunks of about `buffer_size` pseudoalignments.
+// `n_reads` and `n_refs` can be UNKNOWN_DIMENSION to take them from the largest read and reference ids in the
+// input. An unknown number of reads is stored at the end of the file or filled in to the header if `out` is
+// seekable (see DIMENSIONS_IN_TRAILER_FLAG). With an unknown number of references, the chunks are held until
+// the end of the input, up to 64 MB in memory and the rest in a temporary file, and then re-encoded for the
+// final number of references, which about doubles the packing time.
 void BufferedPack(const Format &format, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::istream *in, std::ostream *out);
+void BufferedPack(const Format &format, const size_t n_refs, const size_t n_reads, const ChunkPolicy &policy, std::istream *in, std::ostream *out);
+// Parallel buffered packing, uses the number of threads set with omp_set_num_threads.
+// The chunks are split at different points than in BufferedPack but unpack to the same alignment.
+// Chunks also end at the boundaries of the blocks of input lines that are packed in parallel.
+void ParallelBufferedPack(const Format &format, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::istream *in, std::ostream *out);
+void ParallelBufferedPack(const Format &format, const size_t n_refs, const size_t n_reads, const ChunkPolicy &policy, std::istream *in, std::ostream *out);
+
+// Packs pseudoalignments that are passed in memory, for example directly from an aligner, into the same
+// file that BufferedPack writes for the same reads given as text. The arguments are as in BufferedPack.
+// A full chunk is serialized and written on a background thread while the next chunk is filled.
+//
+// A PackWriter is used from one thread at a time. Threads that add reads concurrently each get their own
+// SubWriter from NewSubWriter, which builds its own chunks. The chunks of different SubWriters are
+// written in the order they fill up, so the file is not in read order unless each SubWriter adds a
+// separate range of reads and the ranges fill up in order.
+class PackWriter {
+public:
+    class SubWriter {
+    public:
+	~SubWriter();
+
+	// Add the pseudoalignments of read `read_id` against the `n` references in `refs`.
+	// The pseudoalignments of a read can be added in several calls if no other read is added in between.
+	void AddRead(const size_t read_id, const uint32_t *refs, const size_t n);
+	// Add `n` reads, the references of read `read_ids[i]` are in [refs + offsets[i], refs + offsets[i + 1])
+	void AddBatch(const size_t n, const size_t *read_ids, const size_t *offsets, const uint32_t *refs);
+
+    private:
+	friend class PackWriter;
+	class Impl;
+	SubWriter(Impl *_impl);
+	std::unique_ptr<Impl> impl;
+    };
+
+    PackWriter(const size_t n_refs, const size_t n_reads, const ChunkPolicy &policy, std::ostream *out);
+    ~PackWriter();
+
+    void AddRead(const size_t read_id, const uint32_t *refs, const size_t n) { this->main->AddRead(read_id, refs, n); }
+    void AddBatch(const size_t n, const size_t *read_ids, const size_t *offsets, const uint32_t *refs) { this->main->AddBatch(n, read_ids, offsets, refs); }
+
+    // Create a writer for one thread, it stays valid until the PackWriter is destroyed. Thread-safe.
+    SubWriter& NewSubWriter();
+
+    // Write the remaining chunks of all writers and the end of the file. The
+    // SubWriters must not be used during or after the call.
+    void Finish();
+
+private:
+    class Output;
+    std::unique_ptr<Output> output;
+    std::vector<std::unique_ptr<SubWriter>> writers;
+    SubWriter *main;
+};
+
+// Pack input that is not sorted by read id into the same file that BufferedPack writes for the sorted
+// input. The input lines are grouped into buckets of consecutive read ids. If the buckets held in memory
+// grow beyond `memory_budget` bytes, they are appended to temporary files in a new directory under
+// `temp_dir`. The buckets are then sorted and packed one at a time in read order. Fulgor input is
+// always in read order and is packed directly. Requires the number of reads, `n_refs` can be UNKNOWN_DIMENSION.
+void BucketedPack(const Format &format, const size_t n_refs, const size_t n_reads, const ChunkPolicy &policy, const size_t memory_budget, const std::string &temp_dir, std::istream *in, std::ostream *out);
+
+// Pack in the reference-major layout where the reads of each reference are stored contiguously.
+// The chunks contain whole references and about `buffer_size` pseudoalignments.
+// The transposed alignment is held in memory while packing.
+void PackReferenceMajor(const bm::bvector<> &bits, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::ostream *out, const CompressionProfile &compression = CompressionProfile());
+void BufferedPackReferenceMajor(const Format &format, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::istream *in, std::ostream *out, const CompressionProfile &compression = CompressionProfile());
+
+// Pack in the equivalence class encoding where each distinct set of references is stored once in a
+// dictionary and the chunks contain the class id of each read. The chunks contain about `buffer_size`
+// pseudoalignments. The serialized chunks are held in memory until the dictionary has been written, so
+// BufferedPackEquivalenceClasses accepts UNKNOWN_DIMENSION for `n_reads` and `n_refs`.
+void PackEquivalenceClasses(const bm::bvector<> &bits, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::ostream *out, const CompressionProfile &compression = CompressionProfile());
+void BufferedPackEquivalenceClasses(const Format &format, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::istream *in, std::ostream *out, const CompressionProfile &compression = CompressionProfile());
+
+// Transpose a contiguously stored `n_rows x n_cols` matrix,
+// the bit at `row*n_cols + col` is moved to `col*n_rows + row`.
+bm::bvector<> Transpose(const bm::bvector<> &bits, const size_t n_rows, const size_t n_cols);
 }
 
 #endif
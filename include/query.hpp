@@ -0,0 +1,73 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_QUERY_HPP
+#define ALIGNMENT_WRITER_QUERY_HPP
+
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "bm64.h"
+
+#include "chunk_writer.hpp"
+
+namespace alignment_writer {
+// Selects reads by the references they pseudoalign to. A read matches if it pseudoaligns to at least
+// one reference in `any_of` (or `any_of` is empty), to all references in `all_of`, and to none in `none_of`.
+struct ReferenceQuery {
+    std::vector<size_t> any_of;
+    std::vector<size_t> all_of;
+    std::vector<size_t> none_of;
+};
+
+// Find the reads matching `query` from the read sets of the references in `ref_ids`
+// (as returned by UnpackReferences) using the BitMagic aggregator.
+bm::bvector<> SelectReads(const ReferenceQuery &query, const std::vector<size_t> &ref_ids, const std::vector<bm::bvector<>> &reads, const size_t n_reads);
+
+// Return the ids of the reads in a packed file that match `query` as set bits.
+// Only the references in the query are extracted from the chunks, which are processed in parallel.
+bm::bvector<> QueryReads(std::istream *in, const ReferenceQuery &query, size_t *n_reads, size_t *n_refs);
+// Print the ids of the matching reads one per line
+void PrintQuery(std::istream *in, const ReferenceQuery &query, std::ostream *out);
+
+// Write a packed file that contains the pseudoalignments of the matching reads. The query is evaluated
+// separately for each chunk so the pseudoalignments of a read must be stored in one chunk, which is
+// true for files written by BufferedPack and ParallelBufferedPack. Reference-major files are not supported.
+// The chunks are serialized with the `compression` profile.
+void QueryPack(std::istream *in, const ReferenceQuery &query, std::ostream *out, const CompressionProfile &compression = CompressionProfile());
+}
+
+#endif
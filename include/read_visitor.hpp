@@ -0,0 +1,232 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_READ_VISITOR_HPP
+#define ALIGNMENT_WRITER_READ_VISITOR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bm64.h"
+
+#include "block_pool.hpp"
+#include "chunk_index.hpp"
+#include "chunk_source.hpp"
+#include "equivalence_classes.hpp"
+#include "file_format.hpp"
+#include "mapped_file.hpp"
+#include "unpack.hpp"
+#include "alignment-writer_openmp_config.hpp"
+
+namespace alignment_writer {
+// The reads of one chunk with their reference ids stored contiguously. The references
+// of read `read_ids[i]` are in [begin(i), end(i)) in increasing order.
+struct ReadBatch {
+    std::vector<size_t> read_ids;
+    std::vector<size_t> offsets = { 0 };
+    std::vector<size_t> refs;
+
+    // Number of reads
+    size_t size() const { return this->read_ids.size(); }
+    // References of the `i`th read
+    const size_t* begin(const size_t i) const { return this->refs.data() + this->offsets[i]; }
+    const size_t* end(const size_t i) const { return this->refs.data() + this->offsets[i + 1]; }
+
+    void clear() {
+	this->read_ids.clear();
+	this->offsets.resize(1);
+	this->refs.clear();
+    }
+};
+
+// Decode the reads with pseudoalignments in `chunk` into `batch`. The bits are read row by row
+// so reference ids are found without dividing each bit position by the number of references.
+inline void DecodeReads(const ChunkDecoder &decoder, const size_t n_refs, const ChunkInfo &info, const unsigned char *chunk, ReadBatch *batch) {
+    batch->clear();
+    if (decoder.HasClasses()) {
+	// Copy the references of the class of each read from the dictionary
+	const EquivalenceClasses &classes = decoder.classes();
+	ClassIds ids;
+	DeserializeClassIds(chunk, &ids);
+	ForEachClassId(ids, [&](const size_t read_id, const uint32_t class_id) {
+	    batch->read_ids.emplace_back(read_id);
+	    batch->refs.insert(batch->refs.end(), classes.begin(class_id), classes.end(class_id));
+	    batch->offsets.emplace_back(batch->refs.size());
+	});
+	return;
+    }
+
+    PooledBitVector bits(bm::BM_GAP);
+    const size_t first_row = decoder.DeserializeLocal(info, chunk, &bits);
+    size_t row_start = 0;
+    size_t row_end = 0; // First bit after the current row
+    for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+	if (*en >= row_end) {
+	    // Close the previous read and start the row of the next one
+	    if (!batch->read_ids.empty()) {
+		batch->offsets.emplace_back(batch->refs.size());
+	    }
+	    const size_t row = (*en)/n_refs;
+	    row_start = row*n_refs;
+	    row_end = row_start + n_refs;
+	    batch->read_ids.emplace_back(first_row + row);
+	}
+	batch->refs.emplace_back((*en) - row_start);
+    }
+    if (!batch->read_ids.empty()) {
+	batch->offsets.emplace_back(batch->refs.size());
+    }
+}
+
+// Calls `visit(source, header)` with the chunks and header of `in` and then
+// stores the number of reads and references, reading them after the chunks if needed
+template <typename Visit>
+void VisitFile(std::istream *in, Visit &&visit, size_t *n_reads, size_t *n_refs) {
+    FileHeader header = ReadFileHeader(in);
+    if (header.flags & REFERENCE_MAJOR_FLAG) {
+	throw std::runtime_error("reference-major files can not be visited by read");
+    }
+    StreamChunks chunks(in, header);
+    visit(chunks, header);
+    if (header.flags & DIMENSIONS_IN_TRAILER_FLAG) {
+	ReadDimensions(in, &header);
+    }
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
+}
+
+template <typename Visit>
+void VisitFile(const MappedFile &file, Visit &&visit, size_t *n_reads, size_t *n_refs) {
+    FileHeader header;
+    const std::vector<ChunkInfo> &index = ScanChunks(file.data(), file.size(), &header);
+    if (header.flags & REFERENCE_MAJOR_FLAG) {
+	throw std::runtime_error("reference-major files can not be visited by read");
+    }
+    MappedChunks chunks(file.data(), index);
+    visit(chunks, header);
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
+}
+
+// Calls `func(batch)` with a ReadBatch for each chunk of a read-major file in file order.
+// Only one chunk is decoded at a time and `batch` is reused for the next chunk after `func` returns.
+// Reads without pseudoalignments are skipped. The pseudoalignments of a read are split over several
+// batches only if the file was packed from input that was not sorted by read id.
+template <typename Input, typename BatchFunc>
+void ForEachReadBatch(Input &&in, BatchFunc &&func, size_t *n_reads, size_t *n_refs) {
+    VisitFile(in, [&](auto &source, const FileHeader &header) {
+	ChunkDecoder decoder(header);
+	decoder.ReadDictionary(source);
+
+	ReadBatch batch;
+	std::vector<unsigned char> storage;
+	ChunkInfo info;
+	const unsigned char *chunk;
+	while (source.Next(&info, &chunk, &storage)) {
+	    DecodeReads(decoder, header.n_refs, info, chunk, &batch);
+	    func(static_cast<const ReadBatch&>(batch));
+	}
+    }, n_reads, n_refs);
+}
+
+// Calls `func(read_id, refs_begin, refs_end)` for each read with pseudoalignments in file order,
+// where [refs_begin, refs_end) are the reference ids of the read as `const size_t*`.
+template <typename Input, typename ReadFunc>
+void ForEachRead(Input &&in, ReadFunc &&func, size_t *n_reads, size_t *n_refs) {
+    ForEachReadBatch(in, [&](const ReadBatch &batch) {
+	for (size_t i = 0; i < batch.size(); ++i) {
+	    func(batch.read_ids[i], batch.begin(i), batch.end(i));
+	}
+    }, n_reads, n_refs);
+}
+
+// Decodes the chunks in parallel using the number of threads set with omp_set_num_threads and
+// calls `(*funcs)[thread](batch)` for each chunk, where `thread` is the OpenMP thread number.
+// `funcs` must contain at least omp_get_max_threads() functions. The functions are called
+// concurrently and the chunks are visited in no particular order, so each function should
+// accumulate its own results that are combined after the call.
+template <typename Input, typename BatchFunc>
+void ParallelForEachReadBatch(Input &&in, std::vector<BatchFunc> *funcs, size_t *n_reads, size_t *n_refs) {
+    size_t n_threads = 1;
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    n_threads = omp_get_max_threads();
+#endif
+    if (funcs->size() < n_threads) {
+	throw std::invalid_argument("one function per thread is required, got " + std::to_string(funcs->size()) + " for " + std::to_string(n_threads) + " threads");
+    }
+    VisitFile(in, [&](auto &source, const FileHeader &header) {
+	ChunkDecoder decoder(header);
+	decoder.ReadDictionary(source);
+
+	std::vector<ReadBatch> batches(ChunkSlots());
+	ForEachChunkInParallel(source, [&](const size_t slot, const ChunkInfo &info, const unsigned char *chunk) {
+	    DecodeReads(decoder, header.n_refs, info, chunk, &batches[slot]);
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+	    (*funcs)[omp_get_thread_num()](static_cast<const ReadBatch&>(batches[slot]));
+#else
+	    (*funcs)[0](static_cast<const ReadBatch&>(batches[slot]));
+#endif
+	}, [](const size_t, const ChunkInfo&) {});
+    }, n_reads, n_refs);
+}
+
+// Calls a function taking one read for each read in a batch
+template <typename ReadFunc>
+struct ForEachReadInBatch {
+    ReadFunc *func;
+
+    void operator()(const ReadBatch &batch) const {
+	for (size_t i = 0; i < batch.size(); ++i) {
+	    (*this->func)(batch.read_ids[i], batch.begin(i), batch.end(i));
+	}
+    }
+};
+
+// Parallel ForEachRead, calls `(*funcs)[thread](read_id, refs_begin, refs_end)` for each read
+// with pseudoalignments as in ParallelForEachReadBatch.
+template <typename Input, typename ReadFunc>
+void ParallelForEachRead(Input &&in, std::vector<ReadFunc> *funcs, size_t *n_reads, size_t *n_refs) {
+    std::vector<ForEachReadInBatch<ReadFunc>> batch_funcs;
+    for (ReadFunc &func : *funcs) {
+	batch_funcs.push_back(ForEachReadInBatch<ReadFunc>{ &func });
+    }
+    ParallelForEachReadBatch(in, &batch_funcs, n_reads, n_refs);
+}
+}
+
+#endif
@@ -0,0 +1,153 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_RUN_STATS_HPP
+#define ALIGNMENT_WRITER_RUN_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+namespace alignment_writer {
+// Time spent in the stages of packing or unpacking and the amount of data that passed through them.
+// The stage times are summed over the threads and exclude the time of the stages nested in them,
+// with several threads they can add up to more than `seconds`.
+struct RunStats {
+    enum Stage {
+	read, // Reading and decompressing the input
+	parse, // Parsing input lines and inserting them into the bit vectors
+	flush, // Flushing the inserted bits at the end of a chunk
+	serialize, // bm::serializer
+	deserialize, // bm::deserialize and expanding equivalence classes
+	format, // Formatting the unpacked lines
+	write, // Writing the output
+	n_stages
+    };
+
+    double seconds = 0.0; // Wall time from the start of the collection
+    double stage_seconds[n_stages] = {};
+    size_t bytes_in = 0; // Bytes read from the input after decompression
+    size_t bytes_out = 0; // Bytes written to the output before compression
+    size_t text_bytes = 0; // Bytes in the pseudoalignment lines that were parsed or formatted
+    size_t lines = 0; // Reads that were packed or printed
+    size_t alignments = 0; // Pseudoalignments that were packed or printed
+    size_t chunks = 0; // Chunks that were serialized or deserialized
+    size_t chunk_bytes = 0;
+    std::vector<size_t> chunk_sizes; // Element `i` is the number of chunks with [2^i, 2^(i+1)) bytes
+    long peak_rss_kb = 0; // Peak resident set size of the process
+
+    // Text bytes per chunk byte
+    double CompressionRatio() const { return (this->chunk_bytes > 0 ? (double)this->text_bytes/this->chunk_bytes : 0.0); }
+
+    static const char* StageName(const Stage stage);
+};
+
+// Collects RunStats from the library functions called on any thread while the collector exists.
+// Only one collector may exist at a time. Without a collector the instrumentation only checks a flag,
+// and the stages are timed per block of lines or per chunk so the overhead stays small with one.
+class StatsCollector {
+public:
+    StatsCollector();
+    ~StatsCollector();
+
+    // The stats collected so far
+    RunStats Stats() const;
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+// Write the stats as tab-separated `name value` lines followed by the chunk size histogram
+void PrintRunStats(const RunStats &stats, std::ostream *out);
+// Write the stats as a JSON object
+void WriteRunStatsJson(const RunStats &stats, std::ostream *out);
+
+// Instrumentation used by the library
+namespace run_stats {
+enum Counter { bytes_in, bytes_out, text_bytes, lines, alignments, n_counters };
+
+extern std::atomic<bool> enabled;
+inline bool Enabled() { return enabled.load(std::memory_order_relaxed); }
+
+void AddCount(const Counter counter, const size_t n);
+void AddChunk(const size_t bytes);
+
+// Add `n` to `counter` if a StatsCollector exists
+inline void Count(const Counter counter, const size_t n) {
+    if (Enabled()) {
+	AddCount(counter, n);
+    }
+}
+
+// Record a serialized or deserialized chunk of `bytes` bytes if a StatsCollector exists
+inline void Chunk(const size_t bytes) {
+    if (Enabled()) {
+	AddChunk(bytes);
+    }
+}
+
+// Adds the time from its construction to its destruction to `stage` if a StatsCollector exists.
+// The time of StageTimers created on the same thread in between is subtracted.
+class StageTimer {
+public:
+    StageTimer(const RunStats::Stage _stage) : stage(_stage) {
+	if (Enabled()) {
+	    this->Start();
+	}
+    }
+    ~StageTimer() {
+	if (this->running) {
+	    this->Stop();
+	}
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    void Start();
+    void Stop();
+
+    RunStats::Stage stage;
+    bool running = false;
+    StageTimer *parent = nullptr;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::duration nested{0};
+};
+}
+}
+
+#endif
@@ -0,0 +1,124 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_SPARSE_MATRIX_HPP
+#define ALIGNMENT_WRITER_SPARSE_MATRIX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bm64.h"
+
+#include "mapped_file.hpp"
+
+// The pseudoalignment as a reads x references sparse matrix for numeric tools. In the compressed
+// sparse row (CSR) layout the reference ids of read `i` are indices[offsets[i]], ..., indices[offsets[i + 1] - 1]
+// in increasing order. The compressed sparse column (CSC) layout stores the read ids of each reference.
+// The conversion runs in parallel using the number of threads set with omp_set_num_threads.
+namespace alignment_writer {
+enum SparseLayout { csr, csc };
+
+// Sparse matrix files start with these four bytes followed by the format version
+constexpr unsigned char SPARSE_MATRIX_MAGIC[4] = { 'A', 'L', 'N', 'S' };
+constexpr uint16_t SPARSE_MATRIX_VERSION = 1;
+// Magic, version, layout, bytes per array element, number of reads, number of references and
+// number of pseudoalignments. The header is followed by the offsets and the indices arrays as
+// little-endian integers, so both arrays are aligned to their element size in the file.
+constexpr size_t SPARSE_MATRIX_HEADER_SIZE = 32;
+
+template <typename Index>
+struct SparseMatrix {
+    SparseLayout layout = csr;
+    size_t n_reads = 0;
+    size_t n_refs = 0;
+    std::vector<Index> offsets; // n_reads + 1 (CSR) or n_refs + 1 (CSC) elements
+    std::vector<Index> indices; // Reference ids (CSR) or read ids (CSC)
+};
+
+// Convert the read-major `n_reads x n_refs` bit vector returned by Unpack. The reads are split into
+// ranges with about the same number of pseudoalignments by selecting evenly spaced set bits, and the
+// position of each range in `indices` is the rank of its first bit, so the ranges are filled
+// independently. Throws std::overflow_error if the number of pseudoalignments or the largest
+// index does not fit in `Index` (only instantiated for uint32_t and uint64_t).
+template <typename Index>
+SparseMatrix<Index> ToSparseMatrix(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs, const SparseLayout layout);
+
+// Write `matrix` in the sparse matrix file format
+template <typename Index>
+void WriteSparseMatrix(const SparseMatrix<Index> &matrix, std::ostream *out);
+
+// Convert and write in one call with `index_bytes` (4 or 8) bytes per array element
+void WriteSparseMatrix(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs, const SparseLayout layout, const size_t index_bytes, std::ostream *out);
+
+// Read-only memory mapping of a sparse matrix file, the arrays are used in place.
+// Throws std::runtime_error if the file is not a sparse matrix file or the machine is not little-endian.
+class MappedSparseMatrix {
+public:
+    MappedSparseMatrix(const std::string &path);
+
+    SparseLayout layout() const { return this->matrix_layout; }
+    size_t n_reads() const { return this->n_rows; }
+    size_t n_refs() const { return this->n_cols; }
+    // Number of pseudoalignments
+    size_t size() const { return this->n_indices; }
+    // Bytes per array element
+    size_t index_bytes() const { return this->element_size; }
+
+    // The arrays, `Index` must have index_bytes() bytes
+    template <typename Index>
+    const Index* offsets() const { this->CheckIndex(sizeof(Index)); return reinterpret_cast<const Index*>(this->file.data() + SPARSE_MATRIX_HEADER_SIZE); }
+    template <typename Index>
+    const Index* indices() const { return this->offsets<Index>() + (this->matrix_layout == csr ? this->n_rows : this->n_cols) + 1; }
+
+private:
+    void CheckIndex(const size_t size) const {
+	if (size != this->element_size) {
+	    throw std::invalid_argument("the sparse matrix has " + std::to_string(this->element_size) + "-byte indices");
+	}
+    }
+
+    MappedFile file;
+    SparseLayout matrix_layout;
+    size_t element_size;
+    size_t n_rows;
+    size_t n_cols;
+    size_t n_indices;
+};
+}
+
+#endif
@@ -0,0 +1,68 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_STATS_HPP
+#define ALIGNMENT_WRITER_STATS_HPP
+
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+namespace alignment_writer {
+// Summary statistics of a packed pseudoalignment
+struct AlignmentStats {
+    size_t n_reads = 0;
+    size_t n_refs = 0;
+    size_t n_alignments = 0; // Total number of pseudoalignments
+    size_t n_aligned = 0; // Reads with at least one pseudoalignment
+    size_t n_unaligned = 0;
+    std::vector<size_t> reads_per_ref; // Number of reads pseudoaligned to each reference
+    std::vector<size_t> refs_per_read; // Element `i` is the number of reads pseudoaligned to `i` references
+};
+
+// Compute the statistics from the chunks of a packed file in parallel using the number of threads
+// set with omp_set_num_threads. The pseudoalignments of a read are counted with range popcounts
+// over its row, which assumes that the row is stored in one chunk as in files written by BufferedPack.
+AlignmentStats ComputeStats(std::istream *in);
+AlignmentStats ComputeStats(const MappedFile &file);
+
+// Write the statistics as tab-separated `name value` lines followed by the per-reference
+// counts and the histogram of references per read
+void PrintStats(const AlignmentStats &stats, std::ostream *out);
+}
+
+#endif
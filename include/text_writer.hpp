@@ -0,0 +1,66 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef ALIGNMENT_WRITER_TEXT_WRITER_HPP
+#define ALIGNMENT_WRITER_TEXT_WRITER_HPP
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+#include "bm64.h"
+
+#include "pack.hpp"
+
+namespace alignment_writer {
+// Maximum number of characters in the decimal representation of a size_t
+constexpr size_t MAX_NUMBER_DIGITS = 20;
+
+// Write the decimal representation of `value` starting at `out` and return a pointer past the last digit.
+// `out` must have room for MAX_NUMBER_DIGITS characters.
+char* FormatNumber(size_t value, char *out);
+
+// Append the reads in the closed interval [first_read, last_read] of `bits` to `buffer` as text in `format`.
+// The *Themisto* layout is `<read id> <ref id> <ref id> ... \n` and the *Fulgor* layout is
+// `<read id>\t<number of alignments>\t<ref id>\t<ref id>...\n` with the read id in place of the fragment name.
+// The first row of `bits` contains read `first_row`.
+void FormatReads(const Format &format, const bm::bvector<> &bits, const size_t n_refs, const size_t first_read, const size_t last_read, std::vector<char> *buffer, const size_t first_row = 0);
+
+// Write the reads in the closed interval [first_read, last_read] of `bits` to `out` as text in `format`.
+// Blocks of reads are formatted in parallel using the number of threads set with omp_set_num_threads
+// and written to `out` in order with one write call per block.
+void WriteReads(const Format &format, const bm::bvector<> &bits, const size_t n_refs, const size_t first_read, const size_t last_read, std::ostream *out, const size_t first_row = 0);
+}
+
+#endif
@@ -36,29 +36,83 @@
 #define ALIGNMENT_WRITER_UNPACK_HPP
 
 #include <cstddef>
+#include <functional>
 #include <istream>
 #include <ostream>
+#include <utility>
 #include <vector>
 
 #include "bm64.h"
 
+#include "chunk_index.hpp"
+#include "file_format.hpp"
+#include "mapped_file.hpp"
+#include "pack.hpp"
+
 namespace alignment_writer {
-// Print data that has been written using BufferedPack
-void Print(std::istream *in, std::ostream *out);
-void StreamingPrint(std::istream *in, std::ostream *out);
+// Print data that has been written using BufferedPack as text in `format`.
+// The output is formatted with WriteReads using the number of threads set with omp_set_num_threads.
+void Print(std::istream *in, std::ostream *out, const Format &format = themisto);
+// Print only the reads in the closed interval [first_read, last_read]
+void PrintRange(std::istream *in, const size_t first_read, const size_t last_read, std::ostream *out, const Format &format = themisto);
+// Print while reading the chunks so that only about two chunks are held in memory. Requires
+// that the chunks are in read order (input sorted by read id), throws std::runtime_error otherwise.
+void StreamingPrint(std::istream *in, std::ostream *out, const Format &format = themisto);
+// Print data from a memory-mapped uncompressed file. Uses the same bounded memory
+// approach as StreamingPrint if the chunk metadata shows that the chunks are in read order.
+void Print(const MappedFile &file, std::ostream *out, const Format &format = themisto);
 
-// Read in pseudoalignment data written using BufferedPack
+// Read in pseudoalignment data written using BufferedPack, `header` is the header read with ReadFileHeader
+void UnpackData(std::istream *infile, const FileHeader &header, bm::bvector<> &pseudoalignment);
+// Read chunks in the legacy text framing (header line read with ReadHeader)
 void UnpackData(std::istream *infile, bm::bvector<> &pseudoalignment);
 bm::bvector<> Unpack(std::istream *infile, size_t *n_reads, size_t *n_refs);
 // Parallel read
+void ParallelUnpackData(std::istream *infile, const FileHeader &header, bm::bvector<> &pseudoalignment);
 void ParallelUnpackData(std::istream *infile, bm::bvector<> &pseudoalignment);
 bm::bvector<> ParallelUnpack(std::istream *infile, size_t *n_reads, size_t *n_refs);
+// The Unpack functions return the read-major layout, files packed in the reference-major layout are transposed
+// and the equivalence classes of files packed with BufferedPackEquivalenceClasses are expanded.
+// Read from a memory-mapped uncompressed file, the chunks are deserialized without copying them
+bm::bvector<> Unpack(const MappedFile &file, size_t *n_reads, size_t *n_refs);
+bm::bvector<> ParallelUnpack(const MappedFile &file, size_t *n_reads, size_t *n_refs);
+// Read only the reads in the closed interval [first_read, last_read].
+// Seeks directly to the relevant chunks if `infile` is seekable and the file has a chunk index.
+bm::bvector<> UnpackRange(std::istream *infile, const size_t first_read, const size_t last_read, size_t *n_reads, size_t *n_refs);
+bm::bvector<> UnpackRange(std::istream *infile, const FileHeader &header, const size_t first_read, const size_t last_read, size_t *n_reads, size_t *n_refs);
+
+// One chunk of a packed file in the read-major layout. The bit for read `first_row + n` and reference `k`
+// is at `n*n_refs + k`. `first_row` is the first read of the chunk in files packed with chunk-relative
+// addressing or equivalence classes, and 0 otherwise.
+struct UnpackedChunk {
+    size_t first_row;
+    size_t n_refs;
+    bm::bvector<> bits;
+};
+// Call `func` for each chunk of a packed file in file order. Only one chunk is held in memory at a time,
+// so files packed with chunk-relative addressing can be read even if the whole alignment does not fit in
+// one bit vector. Reference-major files can not be read by chunk.
+void UnpackByChunk(std::istream *infile, const std::function<void(const UnpackedChunk &chunk)> &func, size_t *n_reads, size_t *n_refs);
+void UnpackByChunk(const MappedFile &file, const std::function<void(const UnpackedChunk &chunk)> &func, size_t *n_reads, size_t *n_refs);
+// Read the (read id, reference id) pairs of a packed file in file order
+std::vector<std::pair<size_t, size_t>> UnpackPairs(std::istream *infile, size_t *n_reads, size_t *n_refs);
+
+// Read the ids of the reads that pseudoalign to each reference in `ref_ids`, element `i` of the
+// result contains the reads of `ref_ids[i]` as set bits. Only the chunks that contain the references
+// are read from reference-major files with a chunk index, read-major files are scanned in full.
+// Repeated ids are extracted once and each of their elements contains the same reads.
+std::vector<bm::bvector<>> UnpackReferences(std::istream *infile, const std::vector<size_t> &ref_ids, size_t *n_reads, size_t *n_refs);
+// Print `<ref id> <read id> <read id> ...` for each reference in `ref_ids`
+void PrintReferences(std::istream *in, const std::vector<size_t> &ref_ids, std::ostream *out);
 
 // Deserialize one section of data written with BufferedPack
 void DeserializeBuffer(const size_t buffer_size, std::istream *in, bm::bvector<> *out);
 
-// Function for reading the header line of the alignment file
-void ReadHeader(const std::string &header_line, size_t *n_reads, size_t *n_refs);
+// Find the header values and the chunks of a packed file stored in memory with one pass over the file
+std::vector<ChunkInfo> ScanChunks(const unsigned char *data, const size_t size, size_t *n_reads, size_t *n_refs);
+std::vector<ChunkInfo> ScanChunks(const unsigned char *data, const size_t size, FileHeader *header);
+// Returns true if the read ranges of `chunks` do not overlap except at their boundaries
+bool ChunksInReadOrder(const std::vector<ChunkInfo> &chunks);
 }
 
 #endif
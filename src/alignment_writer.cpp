@@ -36,8 +36,12 @@
 #include <string>
 #include <algorithm>
 #include <iostream>
+#include <fstream>
 #include <exception>
 #include <memory>
+#include <limits>
+#include <vector>
+#include <sstream>
 
 #include "cxxargs.hpp"
 #include "bxzstr.hpp"
@@ -45,22 +49,154 @@
 #include "version.h"
 #include "unpack.hpp"
 #include "pack.hpp"
+#include "chunk_index.hpp"
+#include "chunk_writer.hpp"
+#include "query.hpp"
+#include "stats.hpp"
+#include "run_stats.hpp"
+#include "sparse_matrix.hpp"
+#include "compressed_stream.hpp"
+#include "merge.hpp"
+#include "equivalence_classes.hpp"
+#include "alignment-writer_openmp_config.hpp"
 
 bool CmdOptionPresent(char **begin, char **end, const std::string &option) {
   return (std::find(begin, end, option) != end);
 }
 
+bool IsCompressed(const std::string &path) {
+  // Check for the gzip, bzip2, xz, and zstd magic numbers
+  std::ifstream in(path, std::ios::binary);
+  unsigned char magic[6] = { 0 };
+  in.read(reinterpret_cast<char*>(magic), 6);
+  return (magic[0] == 0x1F && magic[1] == 0x8B) ||
+         (magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h') ||
+         (magic[0] == 0xFD && magic[1] == '7' && magic[2] == 'z' && magic[3] == 'X' && magic[4] == 'Z' && magic[5] == 0x00) ||
+         (magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD);
+}
+
+std::unique_ptr<std::istream> OpenCompressed(const std::string &path) {
+  // Decompress on a background thread while the input is parsed, BGZF blocks also in parallel
+  if (alignment_writer::IsBgzf(path)) {
+    return std::unique_ptr<std::istream>(new alignment_writer::BgzfInputStream(path));
+  }
+  return std::unique_ptr<std::istream>(new alignment_writer::ReadAheadStream(std::unique_ptr<std::istream>(new bxz::ifstream(path))));
+}
+
+std::vector<std::string> ParseList(const std::string &list) {
+  // Parse a comma-separated list
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    items.emplace_back(item);
+  }
+  return items;
+}
+
+std::vector<size_t> ReadRefMap(const std::string &path) {
+  // Read the global reference ids stored one per line
+  std::vector<size_t> ref_map;
+  bxz::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty()) {
+      ref_map.emplace_back(std::stoull(line));
+    }
+  }
+  return ref_map;
+}
+
+int Merge(const cxxargs::Arguments &args, const bool n_refs_given, const alignment_writer::CompressionProfile &compression, std::ostream *out) {
+  // Merge the packed files given with --inputs, `n_refs_given` is true if -n sets the number of merged references
+  const std::vector<std::string> &paths = ParseList(args.value<std::string>("inputs"));
+  std::vector<std::unique_ptr<std::istream>> files;
+  std::vector<std::istream*> inputs;
+  for (const std::string &path : paths) {
+    // Uncompressed files are read directly so the dimensions stored at the end of a file can be found
+    if (IsCompressed(path)) {
+      files.emplace_back(OpenCompressed(path));
+    } else {
+      files.emplace_back(new std::ifstream(path, std::ios::binary));
+    }
+    inputs.emplace_back(files.back().get());
+  }
+
+  try {
+    if (args.value<std::string>("mode") == "reads") {
+      alignment_writer::MergeReads(inputs, out, compression);
+    } else if (args.value<std::string>("mode") == "references" && args.value<std::string>("ref-maps").empty()) {
+      alignment_writer::MergeReferences(inputs, out, compression);
+    } else if (args.value<std::string>("mode") == "references") {
+      std::vector<std::vector<size_t>> ref_maps;
+      size_t n_refs = 0;
+      for (const std::string &path : ParseList(args.value<std::string>("ref-maps"))) {
+	ref_maps.emplace_back(ReadRefMap(path));
+	for (const size_t ref_id : ref_maps.back()) {
+	  n_refs = std::max(n_refs, ref_id + 1);
+	}
+      }
+      if (n_refs_given) {
+	n_refs = args.value<size_t>('n');
+      }
+      alignment_writer::MergeReferences(inputs, ref_maps, n_refs, out, compression);
+    } else {
+      throw std::runtime_error("unrecognized merge mode " + args.value<std::string>("mode"));
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Merging the alignments failed: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+std::vector<size_t> ParseIdList(const std::string &list) {
+  // Parse a comma-separated list of ids
+  std::vector<size_t> ids;
+  std::stringstream stream(list);
+  std::string id;
+  while (std::getline(stream, id, ',')) {
+    ids.emplace_back(std::stoull(id));
+  }
+  return ids;
+}
+
 void parse_args(int argc, char* argv[], cxxargs::Arguments &args) {
   args.add_short_argument<std::string>('f', "Pseudoalignment file, packed or unpacked, read from cin if not supplied.", "");
   args.add_short_argument<bool>('d', "Unpack pseudoalignment.", false);
-  args.add_short_argument<size_t>('n', "Number of reference sequences in the pseudoalignment (required for packing).");
-  args.add_short_argument<size_t>('r', "Number of reads in the pseudoalignment (required for packing).");
+  args.add_short_argument<size_t>('n', "Number of reference sequences in the pseudoalignment (default: largest reference id + 1, packing is about 2x slower without -n).");
+  args.add_short_argument<size_t>('r', "Number of reads in the pseudoalignment (default: largest read id + 1).");
   args.add_long_argument<size_t>("buffer-size", "Buffer size for buffered packing (default: 100000", (size_t)100000);
-  args.add_long_argument<std::string>("format", "Input file format (one of `themisto` (default), `fulgor`)", "themisto");
-  if (CmdOptionPresent(argv, argv+argc, "-d")) {
-      args.set_not_required('r');
-      args.set_not_required('n');
-  }
+  args.add_long_argument<size_t>("chunk-reads", "Close chunks after this many reads instead of --buffer-size pseudoalignments.", (size_t)0);
+  args.add_long_argument<size_t>("chunk-bytes", "Close chunks at about this many compressed bytes instead of --buffer-size pseudoalignments.", (size_t)0);
+  args.add_long_argument<bool>("chunk-relative", "Store bit positions relative to the first read of each chunk, required if reads x references > 2^47 (default: false).", false);
+  args.add_long_argument<bool>("unsorted", "Sort input that is not sorted by read id before packing (default: false).", false);
+  args.add_long_argument<size_t>("memory-budget", "Megabytes of input held in memory by --unsorted before using temporary files (default: 1024).", (size_t)1024);
+  args.add_long_argument<std::string>("temp-dir", "Directory for the temporary files of --unsorted (default: system temporary directory).", "");
+  args.add_long_argument<std::string>("format", "Input file format, or output format with -d (one of `themisto` (default), `fulgor`)", "themisto");
+  args.add_long_argument<size_t>("threads", "Number of threads to use (default: 1).", (size_t)1);
+  args.add_long_argument<bool>("reference-major", "Pack in the reference-major layout for extracting the reads of references (default: false).", false);
+  args.add_long_argument<bool>("equivalence-classes", "Pack each distinct set of references once and store a class id for each read (default: false).", false);
+  args.add_long_argument<bool>("class-counts", "Unpack the number of reads in each equivalence class (default: false).", false);
+  args.add_long_argument<std::string>("references", "Unpack the reads aligned to these comma-separated reference ids.", "");
+  args.add_long_argument<std::string>("any-of", "Select the reads aligned to any of these comma-separated reference ids.", "");
+  args.add_long_argument<std::string>("all-of", "Select the reads aligned to all of these comma-separated reference ids.", "");
+  args.add_long_argument<std::string>("none-of", "Select the reads aligned to none of these comma-separated reference ids.", "");
+  args.add_long_argument<std::string>("query-output", "Output of --any-of/--all-of/--none-of (one of `ids` (default), `packed`).", "ids");
+  args.add_long_argument<std::string>("inputs", "Comma-separated packed files to merge.", "");
+  args.add_long_argument<std::string>("mode", "Merge mode (one of `reads` (default), `references`).", "reads");
+  args.add_long_argument<std::string>("ref-maps", "Comma-separated files with the global id of each reference in the inputs to merge, one per line.", "");
+  args.add_long_argument<bool>("streaming", "Unpack in bounded memory, requires input that was sorted by read id when packing (default: false).", false);
+  args.add_long_argument<size_t>("first-read", "Unpack only reads starting from this read id (default: 0).", (size_t)0);
+  args.add_long_argument<size_t>("last-read", "Unpack only reads up to and including this read id (default: last read).", std::numeric_limits<size_t>::max());
+  args.set_not_required('r');
+  args.set_not_required('n');
+  args.add_long_argument<std::string>("export", "Convert a packed file to a binary sparse matrix (one of `csr`, `csc`).", "");
+  args.add_long_argument<std::string>("index-type", "Integer type of the arrays written by --export (one of `uint32`, `uint64` (default)).", "uint64");
+  args.add_long_argument<std::string>("compression", "Compression profile for packing (one of `fast`, `default` (default), `max`), `max` only changes --equivalence-classes output.", "default");
+  args.add_long_argument<bool>("bgzf", "Compress the output in BGZF blocks using --threads threads (default: false).", false);
+  args.add_long_argument<bool>("stats", "Print the time spent in each stage and the amount of data processed to cerr (default: false).", false);
+  args.add_long_argument<std::string>("stats-format", "Format of --stats (one of `text` (default), `json`).", "text");
   args.add_long_argument<bool>("help", "Print the help message.", false);
   if (CmdOptionPresent(argv, argv+argc, "--help")) {
       std::cerr << "\n" + args.help() << '\n' << '\n';
@@ -69,7 +205,15 @@ void parse_args(int argc, char* argv[], cxxargs::Arguments &args) {
 }
 
 int main(int argc, char* argv[]) {
-    cxxargs::Arguments args("alignment-writer-" + std::string(ALIGNMENT_WRITER_BUILD_VERSION), "Usage: alignment-writer -f <input-file>");
+    // Subcommands are given as the first argument
+    std::string command;
+    if (argc > 1 && (std::string(argv[1]) == "stats" || std::string(argv[1]) == "merge")) {
+	command = argv[1];
+	--argc;
+	++argv;
+    }
+
+    cxxargs::Arguments args("alignment-writer-" + std::string(ALIGNMENT_WRITER_BUILD_VERSION), "Usage: alignment-writer [stats|merge] -f <input-file>");
     try {
 	parse_args(argc, argv, args);
     } catch (std::exception &e) {
@@ -89,29 +233,239 @@ int main(int argc, char* argv[]) {
 	throw std::runtime_error("Unrecognized input format.");
     }
 
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    omp_set_num_threads(args.value<size_t>("threads"));
+#endif
+    alignment_writer::CompressionProfile compression;
+    try {
+	compression = alignment_writer::NamedCompressionProfile(args.value<std::string>("compression"));
+    } catch (const std::exception &e) {
+	std::cerr << "Parsing arguments failed: " << e.what() << std::endl;
+	return 1;
+    }
+
+    // Instrument the run if requested, the stats are written when main returns
+    std::unique_ptr<alignment_writer::StatsCollector> collector;
+    if (args.value<bool>("stats")) {
+	collector.reset(new alignment_writer::StatsCollector());
+    }
+    // Compress the output if requested
+    std::ostream *out = &std::cout;
+    std::unique_ptr<alignment_writer::BgzfOutputStream> compressed_out;
+    if (args.value<bool>("bgzf")) {
+	try {
+	    compressed_out.reset(new alignment_writer::BgzfOutputStream(&std::cout));
+	    out = compressed_out.get();
+	} catch (const std::exception &e) {
+	    std::cerr << "Compressing the output failed: " << e.what() << std::endl;
+	    return 1;
+	}
+    }
+
+    auto finish = [&](int exit_code) {
+	if (compressed_out) {
+	    try {
+		compressed_out->Finish();
+	    } catch (const std::exception &e) {
+		std::cerr << "Compressing the output failed: " << e.what() << std::endl;
+		exit_code = 1;
+	    }
+	}
+	if (collector) {
+	    const alignment_writer::RunStats &stats = collector->Stats();
+	    if (args.value<std::string>("stats-format") == "json") {
+		alignment_writer::WriteRunStatsJson(stats, &std::cerr);
+	    } else {
+		alignment_writer::PrintRunStats(stats, &std::cerr);
+	    }
+	}
+	return exit_code;
+    };
+
+    if (command == "merge") {
+	return finish(Merge(args, CmdOptionPresent(argv, argv+argc, "-n"), compression, out));
+    }
+
+    bool unpack_range = CmdOptionPresent(argv, argv+argc, "--first-read") || CmdOptionPresent(argv, argv+argc, "--last-read");
+    bool unpack_references = !args.value<std::string>("references").empty();
+    bool query = !args.value<std::string>("any-of").empty() || !args.value<std::string>("all-of").empty() || !args.value<std::string>("none-of").empty();
+
+    if (command == "stats" && !args.value<std::string>('f').empty() && !IsCompressed(args.value<std::string>('f'))) {
+	// Count directly from a memory mapping
+	try {
+	    const alignment_writer::MappedFile file(args.value<std::string>('f'));
+	    alignment_writer::PrintStats(alignment_writer::ComputeStats(file), out);
+	} catch (const std::exception &e) {
+	    std::cerr << "Reading the alignment failed: " << e.what() << std::endl;
+	    return finish(1);
+	}
+	return finish(0);
+    }
+
+    if (args.value<bool>('d') && !unpack_range && !unpack_references && !query && !args.value<bool>("class-counts") && !args.value<std::string>('f').empty() && !IsCompressed(args.value<std::string>('f'))) {
+	// Deserialize uncompressed files directly from a memory mapping
+	try {
+	    const alignment_writer::MappedFile file(args.value<std::string>('f'));
+	    alignment_writer::Print(file, out, format);
+	} catch (const std::exception &e) {
+	    std::cerr << "Reading the alignment failed: " << e.what() << std::endl;
+	    return finish(1);
+	}
+	return finish(0);
+    }
+
+    int exit_code = 0;
     std::unique_ptr<std::istream> in;
     if (args.value<std::string>('f').empty()) {
 	in = std::unique_ptr<std::istream>(&std::cin);
     } else {
 	const std::string &infile = args.value<std::string>('f');
-	in = std::unique_ptr<std::istream>(new bxz::ifstream(infile));
+	if (unpack_range || unpack_references || query) {
+	    // Read uncompressed files with a chunk index directly so the reader can seek to the chunks
+	    std::unique_ptr<std::istream> seekable(new std::ifstream(infile, std::ios::binary));
+	    std::vector<alignment_writer::ChunkInfo> index;
+	    try {
+		if (alignment_writer::ReadIndex(seekable.get(), &index)) {
+		    in = std::move(seekable);
+		}
+	    } catch (const std::exception &e) {
+		std::cerr << "Reading the alignment failed: " << e.what() << std::endl;
+		return finish(1);
+	    }
+	}
+	if (!in && IsCompressed(infile)) {
+	    in = OpenCompressed(infile);
+	}
+	if (!in) {
+	    in = std::unique_ptr<std::istream>(new bxz::ifstream(infile));
+	}
     }
 
-    if (args.value<bool>('d')) {
-	alignment_writer::Print(in.get(), &std::cout);
+    if (command == "stats") {
+	try {
+	    alignment_writer::PrintStats(alignment_writer::ComputeStats(in.get()), out);
+	} catch (const std::exception &e) {
+	    std::cerr << "Reading the alignment failed: " << e.what() << std::endl;
+	    exit_code = 1;
+	}
+    } else if (!args.value<std::string>("export").empty()) {
+	try {
+	    const std::string &layout = args.value<std::string>("export");
+	    const std::string &index_type = args.value<std::string>("index-type");
+	    if (layout != "csr" && layout != "csc") {
+		throw std::invalid_argument("--export must be `csr` or `csc`");
+	    }
+	    if (index_type != "uint32" && index_type != "uint64") {
+		throw std::invalid_argument("--index-type must be `uint32` or `uint64`");
+	    }
+	    size_t n_reads, n_refs;
+	    bm::bvector<> bits;
+	    const std::string &infile = args.value<std::string>('f');
+	    if (!infile.empty() && !IsCompressed(infile)) {
+		// Deserialize uncompressed files directly from a memory mapping
+		const alignment_writer::MappedFile file(infile);
+		bits = alignment_writer::ParallelUnpack(file, &n_reads, &n_refs);
+	    } else {
+		bits = alignment_writer::ParallelUnpack(in.get(), &n_reads, &n_refs);
+	    }
+	    alignment_writer::WriteSparseMatrix(bits, n_reads, n_refs, (layout == "csr" ? alignment_writer::csr : alignment_writer::csc), (index_type == "uint32" ? 4 : 8), out);
+	} catch (const std::exception &e) {
+	    std::cerr << "Exporting the alignment failed: " << e.what() << std::endl;
+	    exit_code = 1;
+	}
+    } else if (query) {
+	try {
+	    alignment_writer::ReferenceQuery reference_query;
+	    reference_query.any_of = ParseIdList(args.value<std::string>("any-of"));
+	    reference_query.all_of = ParseIdList(args.value<std::string>("all-of"));
+	    reference_query.none_of = ParseIdList(args.value<std::string>("none-of"));
+	    if (args.value<std::string>("query-output") == "packed") {
+		alignment_writer::QueryPack(in.get(), reference_query, out, compression);
+	    } else if (args.value<std::string>("query-output") == "ids") {
+		alignment_writer::PrintQuery(in.get(), reference_query, out);
+	    } else {
+		throw std::runtime_error("unrecognized query output " + args.value<std::string>("query-output"));
+	    }
+	} catch (const std::exception &e) {
+	    std::cerr << "Querying the alignment failed: " << e.what() << std::endl;
+	    exit_code = 1;
+	}
+    } else if (args.value<bool>('d') && args.value<bool>("class-counts")) {
+	try {
+	    alignment_writer::EquivalenceClasses classes;
+	    std::vector<size_t> counts;
+	    alignment_writer::CountClasses(in.get(), &classes, &counts);
+	    alignment_writer::PrintClassCounts(classes, counts, out);
+	} catch (const std::exception &e) {
+	    std::cerr << "Reading the alignment failed: " << e.what() << std::endl;
+	    exit_code = 1;
+	}
+    } else if (args.value<bool>('d') && unpack_references) {
+	try {
+	    alignment_writer::PrintReferences(in.get(), ParseIdList(args.value<std::string>("references")), out);
+	} catch (const std::exception &e) {
+	    std::cerr << "Reading the alignment failed: " << e.what() << std::endl;
+	    exit_code = 1;
+	}
+    } else if (args.value<bool>('d') && unpack_range) {
+	try {
+	    alignment_writer::PrintRange(in.get(), args.value<size_t>("first-read"), args.value<size_t>("last-read"), out, format);
+	} catch (const std::exception &e) {
+	    std::cerr << "Reading the alignment failed: " << e.what() << std::endl;
+	    exit_code = 1;
+	}
+    } else if (args.value<bool>('d') && args.value<bool>("streaming")) {
+	try {
+	    alignment_writer::StreamingPrint(in.get(), out, format);
+	} catch (const std::exception &e) {
+	    std::cerr << "Reading the alignment failed: " << e.what() << std::endl;
+	    exit_code = 1;
+	}
+    } else if (args.value<bool>('d')) {
+	try {
+	    alignment_writer::Print(in.get(), out, format);
+	} catch (const std::exception &e) {
+	    std::cerr << "Reading the alignment failed: " << e.what() << std::endl;
+	    exit_code = 1;
+	}
     } else {
 	try {
-	    alignment_writer::BufferedPack(format, args.value<size_t>('n'), args.value<size_t>('r'), args.value<size_t>("buffer-size"), in.get(), &std::cout);
+	    // Dimensions that are not given are taken from the input
+	    const size_t n_refs = (CmdOptionPresent(argv, argv+argc, "-n") ? args.value<size_t>('n') : alignment_writer::UNKNOWN_DIMENSION);
+	    const size_t n_reads = (CmdOptionPresent(argv, argv+argc, "-r") ? args.value<size_t>('r') : alignment_writer::UNKNOWN_DIMENSION);
+	    alignment_writer::ChunkPolicy policy;
+	    policy.size = args.value<size_t>("buffer-size");
+	    if (args.value<size_t>("chunk-reads") > 0) {
+		policy.unit = alignment_writer::ChunkPolicy::reads;
+		policy.size = args.value<size_t>("chunk-reads");
+	    } else if (args.value<size_t>("chunk-bytes") > 0) {
+		policy.unit = alignment_writer::ChunkPolicy::bytes;
+		policy.size = args.value<size_t>("chunk-bytes");
+	    }
+	    policy.relative = args.value<bool>("chunk-relative");
+	    policy.compression = compression;
+	    if (args.value<bool>("equivalence-classes")) {
+		alignment_writer::BufferedPackEquivalenceClasses(format, n_refs, n_reads, args.value<size_t>("buffer-size"), in.get(), out, compression);
+	    } else if (args.value<bool>("unsorted")) {
+		alignment_writer::BucketedPack(format, n_refs, n_reads, policy, args.value<size_t>("memory-budget")*1048576, args.value<std::string>("temp-dir"), in.get(), out);
+	    } else if (args.value<bool>("reference-major")) {
+		alignment_writer::BufferedPackReferenceMajor(format, n_refs, n_reads, args.value<size_t>("buffer-size"), in.get(), out, compression);
+	    } else if (args.value<size_t>("threads") > 1) {
+		alignment_writer::ParallelBufferedPack(format, n_refs, n_reads, policy, in.get(), out);
+	    } else {
+		alignment_writer::BufferedPack(format, n_refs, n_reads, policy, in.get(), out);
+	    }
 	} catch (const std::invalid_argument &e) {
 	    std::cerr << "Reading the alignment failed: " << e.what() << " (is `--format " << args.value<std::string>("format") << "` correct?)" << std::endl;
-	    return 1;
+	    exit_code = 1;
 	} catch (const std::exception &e) {
 	    std::cerr << "Reading the alignment failed: " << e.what() << '.' << std::endl;
+	    exit_code = 1;
 	}
     }
     if (args.value<std::string>('f').empty()) {
 	in.release(); // Release ownership of std::cout so we don't try to free it
     }
 
-    return 0;
+    return finish(exit_code);
 }
@@ -0,0 +1,63 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "block_pool.hpp"
+
+namespace alignment_writer {
+namespace {
+struct LimitedBlockPool : public BlockPool {
+    LimitedBlockPool() { this->set_block_limit(BLOCK_POOL_LIMIT); }
+};
+}
+
+BlockPool& ThreadBlockPool() {
+    thread_local LimitedBlockPool pool;
+    return pool;
+}
+
+void DeserializeChunk(const unsigned char *chunk, bm::bvector<> *bits) {
+    // Chunks written with ConfigureSerializer have no byte order mark and are in the byte order of
+    // this machine. Others in a different byte order need the decoder of bm::deserialize.
+    const bool native_order = (chunk[0] & bm::BM_HM_NO_BO) || (bm::ByteOrder)chunk[1] == bm::globals<true>::byte_order();
+    if (!native_order) {
+	bm::deserialize(*bits, chunk);
+	return;
+    }
+    // Constructing a deserializer allocates a temporary block and ~400 KiB of index arrays
+    thread_local bm::deserializer<bm::bvector<>, bm::decoder> deserializer;
+    bm::bvector<>::mem_pool_guard guard;
+    guard.assign_if_not_set(ThreadBlockPool(), *bits);
+    deserializer.deserialize(*bits, chunk);
+}
+}
@@ -0,0 +1,159 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "chunk_index.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include "file_format.hpp"
+
+namespace alignment_writer {
+// The binary footer ends in the offset of the footer followed by these bytes
+constexpr unsigned char INDEX_MAGIC[4] = { 'A', 'L', 'N', 'I' };
+constexpr size_t INDEX_TRAILER_SIZE = 12;
+
+size_t WriteIndex(const std::vector<ChunkInfo> &index, const size_t index_offset, std::ostream *out) {
+    // Footer layout (little-endian):
+    //   8 bytes   number of chunks
+    //   32 bytes  offset, size, first read and last read of each chunk
+    //   16 bytes  first bit and last bit of each chunk
+    //   8 bytes   offset of the footer in the file
+    //   4 bytes   INDEX_MAGIC
+    WriteLittleEndian(index.size(), 8, out);
+    for (const ChunkInfo &chunk : index) {
+	WriteLittleEndian(chunk.offset, 8, out);
+	WriteLittleEndian(chunk.size, 8, out);
+	WriteLittleEndian(chunk.first_read, 8, out);
+	WriteLittleEndian(chunk.last_read, 8, out);
+    }
+    for (const ChunkInfo &chunk : index) {
+	WriteLittleEndian(chunk.first_bit, 8, out);
+	WriteLittleEndian(chunk.last_bit, 8, out);
+    }
+    WriteLittleEndian(index_offset, 8, out);
+    out->write(reinterpret_cast<const char*>(INDEX_MAGIC), 4);
+    return 8 + 48*index.size() + INDEX_TRAILER_SIZE;
+}
+
+void ParseBinaryIndex(std::istream *in, const size_t index_offset, const size_t file_size, std::vector<ChunkInfo> *index) {
+    // Reads the binary footer starting from `index_offset`, the footer must contain exactly the entries of its chunks
+    const size_t footer_size = file_size - index_offset;
+    if (footer_size < 8 + INDEX_TRAILER_SIZE || (footer_size - 8 - INDEX_TRAILER_SIZE) % 48 != 0) {
+	throw std::runtime_error("Packed file contains an invalid chunk index.");
+    }
+    unsigned char buf[8];
+    in->seekg(index_offset);
+    in->read(reinterpret_cast<char*>(buf), 8);
+    if ((size_t)in->gcount() != 8) {
+	throw std::runtime_error("Packed file is truncated.");
+    }
+    const size_t n_chunks = DecodeLittleEndian(buf, 8);
+    if (n_chunks != (footer_size - 8 - INDEX_TRAILER_SIZE)/48) {
+	throw std::runtime_error("Packed file contains an invalid chunk index.");
+    }
+
+    std::vector<unsigned char> entries(48*n_chunks);
+    in->read(reinterpret_cast<char*>(entries.data()), entries.size());
+    if ((size_t)in->gcount() != entries.size()) {
+	throw std::runtime_error("Packed file is truncated.");
+    }
+    const unsigned char *bit_ranges = entries.data() + 32*n_chunks;
+    index->resize(n_chunks);
+    for (size_t i = 0; i < n_chunks; ++i) {
+	(*index)[i].offset = DecodeLittleEndian(&entries[32*i], 8);
+	(*index)[i].size = DecodeLittleEndian(&entries[32*i + 8], 8);
+	(*index)[i].first_read = DecodeLittleEndian(&entries[32*i + 16], 8);
+	(*index)[i].last_read = DecodeLittleEndian(&entries[32*i + 24], 8);
+	(*index)[i].first_bit = DecodeLittleEndian(bit_ranges + 16*i, 8);
+	(*index)[i].last_bit = DecodeLittleEndian(bit_ranges + 16*i + 8, 8);
+	// The chunks are stored before the footer
+	if ((*index)[i].size > index_offset || (*index)[i].offset > index_offset - (*index)[i].size) {
+	    throw std::runtime_error("Packed file is truncated.");
+	}
+    }
+}
+
+bool ReadIndex(std::istream *in, std::vector<ChunkInfo> *index) {
+    size_t index_offset;
+    if (!FindIndexOffset(in, &index_offset)) {
+	return false;
+    }
+
+    // Remember the current position so the caller can continue reading from it
+    std::streampos start = in->tellg();
+    in->seekg(0, std::ios::end);
+    std::streamoff file_size = in->tellg();
+    const bool found = in->good();
+    if (found) {
+	ParseBinaryIndex(in, index_offset, file_size, index);
+    }
+    in->clear();
+    in->seekg(start);
+    return found;
+}
+
+bool FindIndexOffset(std::istream *in, size_t *index_offset) {
+    std::streampos start = in->tellg();
+    if (start == std::streampos(-1)) {
+	in->clear();
+	return false;
+    }
+
+    bool found = false;
+    in->seekg(0, std::ios::end);
+    std::streamoff file_size = in->tellg();
+    if (in->good() && file_size >= (std::streamoff)INDEX_TRAILER_SIZE) {
+	unsigned char trailer[INDEX_TRAILER_SIZE];
+	in->seekg(file_size - (std::streamoff)INDEX_TRAILER_SIZE);
+	in->read(reinterpret_cast<char*>(trailer), INDEX_TRAILER_SIZE);
+	if (in->good() && std::memcmp(trailer + 8, INDEX_MAGIC, 4) == 0) {
+	    (*index_offset) = DecodeLittleEndian(trailer, 8);
+	    found = (*index_offset) < (size_t)file_size;
+	}
+    }
+
+    in->clear();
+    in->seekg(start);
+    return found;
+}
+
+bool FindIndexOffset(const unsigned char *data, const size_t size, size_t *index_offset) {
+    if (size < INDEX_TRAILER_SIZE || std::memcmp(data + size - 4, INDEX_MAGIC, 4) != 0) {
+	return false;
+    }
+    (*index_offset) = DecodeLittleEndian(data + size - INDEX_TRAILER_SIZE, 8);
+    return (*index_offset) < size;
+}
+}
@@ -0,0 +1,137 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "chunk_writer.hpp"
+
+#include <limits>
+#include <stdexcept>
+
+#include "run_stats.hpp"
+
+namespace alignment_writer {
+CompressionProfile NamedCompressionProfile(const std::string &name) {
+    CompressionProfile profile;
+    if (name == "fast") {
+	// Run-length, GAP and interval encodings without the delta or interpolative coding of the higher levels
+	profile.level = 3;
+    } else if (name == "max") {
+	profile.level = bm::set_compression_max;
+	profile.xor_planes = true;
+    } else if (name != "default") {
+	throw std::invalid_argument("unknown compression profile `" + name + "` (one of `fast`, `default`, `max`)");
+    }
+    return profile;
+}
+
+void ConfigureSerializer(bm::serializer<bm::bvector<>> *bvs, const CompressionProfile &profile) {
+    // Next settings provide the lowest size (see BitMagic documentation/examples)
+    bvs->byte_order_serialization(false);
+    bvs->gap_length_serialization(false);
+    bvs->set_compression_level(profile.level);
+}
+
+ChunkWriter::ChunkWriter(const size_t n_refs, const size_t n_reads, std::ostream *_out, const uint16_t flags) : out(_out) {
+    this->row_size = (flags & REFERENCE_MAJOR_FLAG ? n_reads : n_refs);
+    if (this->row_size == UNKNOWN_DIMENSION) {
+	throw std::invalid_argument("the length of the rows must be known before writing the chunks");
+    }
+    this->header.version = BINARY_FORMAT_VERSION;
+    this->header.flags = flags | (n_reads == UNKNOWN_DIMENSION ? DIMENSIONS_IN_TRAILER_FLAG : 0);
+    this->header.n_reads = n_reads;
+    this->header.n_refs = n_refs;
+    this->header_pos = this->out->tellp();
+    this->bytes_written = WriteFileHeader(this->header, this->out);
+}
+
+void ChunkWriter::WriteBuffer(const SerializedChunk &chunk) {
+    // Chunks without reads have an empty bit range
+    size_t first_bit = std::numeric_limits<size_t>::max();
+    size_t last_bit = 0;
+    if (chunk.first_read <= chunk.last_read && this->row_size > 0) {
+	first_bit = chunk.first_read*this->row_size;
+	last_bit = (chunk.last_read + 1)*this->row_size - 1;
+    }
+
+    //  Write to *out
+    std::vector<uint64_t> metadata(N_METADATA_SLOTS);
+    metadata[FIRST_READ_SLOT] = chunk.first_read;
+    metadata[LAST_READ_SLOT] = chunk.last_read;
+    metadata[FIRST_BIT_SLOT] = first_bit;
+    metadata[LAST_BIT_SLOT] = last_bit;
+    size_t frame_size;
+    {
+	run_stats::StageTimer timer(RunStats::write);
+	frame_size = WriteChunk(chunk.data.buf(), chunk.data.size(), metadata, this->out);
+    }
+    run_stats::Chunk(chunk.data.size());
+
+    // Store the location of the chunk for the footer
+    ChunkInfo info;
+    info.offset = this->bytes_written + frame_size;
+    info.size = chunk.data.size();
+    info.first_read = chunk.first_read;
+    info.last_read = chunk.last_read;
+    info.first_bit = first_bit;
+    info.last_bit = last_bit;
+    this->index.emplace_back(info);
+    this->bytes_written = info.offset + info.size;
+}
+
+void ChunkWriter::Finish(const size_t n_reads) {
+    this->header.n_reads = n_reads;
+    this->Finish();
+}
+
+void ChunkWriter::Finish() {
+    this->bytes_written += WriteChunksEnd(this->out);
+    if (this->header.flags & DIMENSIONS_IN_TRAILER_FLAG) {
+	std::streampos end = this->out->tellp();
+	if (this->header_pos != std::streampos(-1) && end != std::streampos(-1)) {
+	    // Fill in the number of reads so the file is the same as if it had been known from the start
+	    this->header.flags &= ~DIMENSIONS_IN_TRAILER_FLAG;
+	    this->out->seekp(this->header_pos);
+	    WriteFileHeader(this->header, this->out);
+	    this->out->seekp(end);
+	} else {
+	    this->bytes_written += WriteDimensions(this->header, this->out);
+	}
+    }
+
+    // Write the footer for random access
+    run_stats::StageTimer timer(RunStats::write);
+    const size_t index_size = WriteIndex(this->index, this->bytes_written, this->out);
+    this->out->flush(); // Flush
+    run_stats::Count(run_stats::bytes_out, this->bytes_written + index_size);
+}
+}
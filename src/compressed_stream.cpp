@@ -0,0 +1,396 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "compressed_stream.hpp"
+
+#include <cstdint>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "file_format.hpp"
+#include "alignment-writer_openmp_config.hpp"
+#include "alignment-writer_zlib_config.hpp"
+
+namespace alignment_writer {
+// Largest number of uncompressed bytes in a BGZF block, leaves room for incompressible data in the 64 KiB limit
+constexpr size_t BGZF_BLOCK_INPUT = 65280;
+// Gzip header with the BGZF extra field, and the CRC32 and uncompressed size after the data
+constexpr size_t BGZF_HEADER_SIZE = 18;
+constexpr size_t BGZF_FOOTER_SIZE = 8;
+// Empty block that ends a BGZF file
+constexpr unsigned char BGZF_EOF[28] = { 0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+					 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+size_t DefaultThreads() {
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Serves the bytes produced by `fill(buffer)`, which replaces the contents of `buffer` with the next
+// bytes of the input and leaves it empty at the end. The next call to `fill` runs on a background
+// thread while the bytes from the previous call are read.
+class ReadAheadBuffer : public std::streambuf {
+public:
+    ReadAheadBuffer(std::function<void(std::vector<char>*)> _fill) : fill(std::move(_fill)) {}
+    ~ReadAheadBuffer() {
+	if (this->pending.valid()) {
+	    this->pending.wait();
+	}
+    }
+
+protected:
+    int_type underflow() override {
+	if (this->gptr() < this->egptr()) {
+	    return traits_type::to_int_type(*this->gptr());
+	}
+	if (this->at_end) {
+	    return traits_type::eof();
+	}
+	if (!this->pending.valid()) {
+	    this->Start();
+	}
+	// The input ends here if `fill` throws
+	this->at_end = true;
+	this->pending.get();
+	this->current.swap(this->next);
+	if (this->current.empty()) {
+	    return traits_type::eof();
+	}
+	this->at_end = false;
+	this->Start();
+	this->setg(this->current.data(), this->current.data(), this->current.data() + this->current.size());
+	return traits_type::to_int_type(*this->gptr());
+    }
+
+private:
+    void Start() {
+	this->pending = std::async(std::launch::async, [this]() { this->fill(&this->next); });
+    }
+
+    std::function<void(std::vector<char>*)> fill;
+    std::vector<char> current;
+    std::vector<char> next;
+    std::future<void> pending;
+    bool at_end = false;
+};
+
+ReadAheadStream::ReadAheadStream(std::unique_ptr<std::istream> _source, const size_t block_size) : std::istream(nullptr), source(std::move(_source)) {
+    // Errors in the source are rethrown instead of ending the input early
+    std::istream *in = this->source.get();
+    in->exceptions(std::ios::badbit);
+    this->buffer.reset(new ReadAheadBuffer([in, block_size](std::vector<char> *block) {
+	block->resize(block_size);
+	in->read(block->data(), block_size);
+	block->resize(in->gcount());
+    }));
+    this->rdbuf(this->buffer.get());
+    this->exceptions(std::ios::badbit);
+}
+
+ReadAheadStream::~ReadAheadStream() = default;
+
+bool IsBgzfHeader(const unsigned char *header) {
+    // Gzip magic, deflate, FEXTRA set and a `BC` subfield with the block size first in the extra field
+    return header[0] == 0x1f && header[1] == 0x8b && header[2] == 0x08 && (header[3] & 0x04) &&
+	DecodeLittleEndian(header + 10, 2) >= 6 && header[12] == 'B' && header[13] == 'C' && header[14] == 2 && header[15] == 0;
+}
+
+bool IsBgzf(const std::string &path) {
+#if defined(ALIGNMENTWRITER_ZLIB_SUPPORT) && (ALIGNMENTWRITER_ZLIB_SUPPORT) == 1
+    std::ifstream in(path, std::ios::binary);
+    unsigned char header[BGZF_HEADER_SIZE] = { 0 };
+    in.read(reinterpret_cast<char*>(header), BGZF_HEADER_SIZE);
+    return (size_t)in.gcount() == BGZF_HEADER_SIZE && IsBgzfHeader(header);
+#else
+    // Read as any other gzip file
+    return false;
+#endif
+}
+
+#if defined(ALIGNMENTWRITER_ZLIB_SUPPORT) && (ALIGNMENTWRITER_ZLIB_SUPPORT) == 1
+bool ReadBgzfBlock(std::istream *in, std::vector<unsigned char> *block) {
+    // Read the next compressed block into `block`, returns false at the end of the file
+    block->resize(BGZF_HEADER_SIZE);
+    in->read(reinterpret_cast<char*>(block->data()), BGZF_HEADER_SIZE);
+    if (in->gcount() == 0) {
+	return false;
+    }
+    if ((size_t)in->gcount() != BGZF_HEADER_SIZE || !IsBgzfHeader(block->data())) {
+	throw std::runtime_error("invalid BGZF block header");
+    }
+    const size_t block_size = DecodeLittleEndian(block->data() + 16, 2) + 1;
+    if (block_size < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE) {
+	throw std::runtime_error("invalid BGZF block size");
+    }
+    block->resize(block_size);
+    in->read(reinterpret_cast<char*>(block->data() + BGZF_HEADER_SIZE), block_size - BGZF_HEADER_SIZE);
+    if ((size_t)in->gcount() != block_size - BGZF_HEADER_SIZE) {
+	throw std::runtime_error("BGZF file is truncated");
+    }
+    return true;
+}
+
+size_t BgzfBlockInputSize(const std::vector<unsigned char> &block) {
+    return DecodeLittleEndian(block.data() + block.size() - 4, 4);
+}
+
+void InflateBgzfBlock(const std::vector<unsigned char> &block, char *out) {
+    // Decompress the raw deflate data between the extra field and the footer
+    const size_t data_start = 12 + DecodeLittleEndian(block.data() + 10, 2);
+    const size_t out_size = BgzfBlockInputSize(block);
+    z_stream strm = {};
+    if (data_start + BGZF_FOOTER_SIZE > block.size() || inflateInit2(&strm, -15) != Z_OK) {
+	throw std::runtime_error("invalid BGZF block");
+    }
+    strm.next_in = const_cast<unsigned char*>(block.data() + data_start);
+    strm.avail_in = block.size() - data_start - BGZF_FOOTER_SIZE;
+    strm.next_out = reinterpret_cast<unsigned char*>(out);
+    strm.avail_out = out_size;
+    const int ret = inflate(&strm, Z_FINISH);
+    const size_t n_out = strm.total_out;
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END || n_out != out_size ||
+	crc32(0, reinterpret_cast<const unsigned char*>(out), out_size) != DecodeLittleEndian(block.data() + block.size() - 8, 4)) {
+	throw std::runtime_error("corrupted BGZF block");
+    }
+}
+
+void DeflateBgzfBlock(const char *data, const size_t size, const int level, std::vector<unsigned char> *block) {
+    // Compress at most BGZF_BLOCK_INPUT bytes from `data` into one block
+    z_stream strm = {};
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	throw std::runtime_error("could not initialize the gzip compressor with level " + std::to_string(level));
+    }
+    block->resize(BGZF_HEADER_SIZE + deflateBound(&strm, size) + BGZF_FOOTER_SIZE);
+    strm.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(data));
+    strm.avail_in = size;
+    strm.next_out = block->data() + BGZF_HEADER_SIZE;
+    strm.avail_out = block->size() - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    const int ret = deflate(&strm, Z_FINISH);
+    const size_t n_compressed = strm.total_out;
+    deflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+	throw std::runtime_error("compressing a BGZF block failed");
+    }
+
+    const size_t block_size = BGZF_HEADER_SIZE + n_compressed + BGZF_FOOTER_SIZE;
+    const unsigned char header[16] = { 0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 'B', 'C', 0x02, 0x00 };
+    std::copy(header, header + 16, block->begin());
+    (*block)[16] = (block_size - 1) & 0xff;
+    (*block)[17] = (block_size - 1) >> 8;
+    const uint32_t crc = crc32(0, reinterpret_cast<const unsigned char*>(data), size);
+    for (size_t i = 0; i < 4; ++i) {
+	(*block)[BGZF_HEADER_SIZE + n_compressed + i] = (crc >> (8*i)) & 0xff;
+	(*block)[BGZF_HEADER_SIZE + n_compressed + 4 + i] = (size >> (8*i)) & 0xff;
+    }
+    block->resize(block_size);
+}
+
+// Runs `func(i)` for i in [0, n) on `n_threads` threads and rethrows the first error
+template <typename Func>
+void ParallelForBlocks(const size_t n, const size_t n_threads, Func &&func) {
+    std::exception_ptr error;
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+#pragma omp parallel for schedule(dynamic) num_threads(n_threads)
+#endif
+    for (size_t i = 0; i < n; ++i) {
+	try {
+	    func(i);
+	} catch (...) {
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+#pragma omp critical
+#endif
+	    error = std::current_exception();
+	}
+    }
+    if (error) {
+	std::rethrow_exception(error);
+    }
+}
+
+// Compresses the bytes put into it in batches of BGZF blocks. A full batch is compressed and
+// written on a background thread while the next batch is filled.
+class BgzfBuffer : public std::streambuf {
+public:
+    BgzfBuffer(std::ostream *_out, const int _level, const size_t batch_blocks) : out(_out), level(_level), n_threads(DefaultThreads()),
+	filling(std::max(batch_blocks, (size_t)1)*BGZF_BLOCK_INPUT), writing(filling.size()) {
+	this->setp(this->filling.data(), this->filling.data() + this->filling.size());
+    }
+    ~BgzfBuffer() {
+	if (this->pending.valid()) {
+	    this->pending.wait();
+	}
+    }
+
+    void Finish() {
+	this->Flush();
+	this->Wait();
+	this->out->write(reinterpret_cast<const char*>(BGZF_EOF), sizeof(BGZF_EOF));
+	this->out->flush();
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+	this->Flush();
+	if (!traits_type::eq_int_type(c, traits_type::eof())) {
+	    *this->pptr() = traits_type::to_char_type(c);
+	    this->pbump(1);
+	}
+	return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+	// The bytes so far are written in possibly smaller blocks
+	this->Flush();
+	this->Wait();
+	this->out->flush();
+	return 0;
+    }
+
+private:
+    void Flush() {
+	// Hand the filled part of the buffer to the background thread
+	const size_t n_bytes = this->pptr() - this->pbase();
+	if (n_bytes == 0) {
+	    return;
+	}
+	this->Wait();
+	this->filling.swap(this->writing);
+	this->n_writing = n_bytes;
+	this->pending = std::async(std::launch::async, [this]() { this->Compress(); });
+	this->setp(this->filling.data(), this->filling.data() + this->filling.size());
+    }
+
+    void Wait() {
+	if (this->pending.valid()) {
+	    this->pending.get();
+	}
+    }
+
+    void Compress() {
+	const size_t n_blocks = (this->n_writing + BGZF_BLOCK_INPUT - 1)/BGZF_BLOCK_INPUT;
+	this->blocks.resize(std::max(this->blocks.size(), n_blocks));
+	ParallelForBlocks(n_blocks, this->n_threads, [&](const size_t i) {
+	    const size_t start = i*BGZF_BLOCK_INPUT;
+	    DeflateBgzfBlock(this->writing.data() + start, std::min(BGZF_BLOCK_INPUT, this->n_writing - start), this->level, &this->blocks[i]);
+	});
+	for (size_t i = 0; i < n_blocks; ++i) {
+	    this->out->write(reinterpret_cast<const char*>(this->blocks[i].data()), this->blocks[i].size());
+	}
+	if (!*this->out) {
+	    throw std::runtime_error("could not write the compressed output");
+	}
+    }
+
+    std::ostream *out;
+    int level;
+    size_t n_threads;
+    std::vector<char> filling;
+    std::vector<char> writing;
+    size_t n_writing = 0;
+    std::vector<std::vector<unsigned char>> blocks;
+    std::future<void> pending;
+};
+#endif
+
+BgzfInputStream::BgzfInputStream(const std::string &path, const size_t batch_blocks) : std::istream(nullptr), file(path, std::ios::binary) {
+#if defined(ALIGNMENTWRITER_ZLIB_SUPPORT) && (ALIGNMENTWRITER_ZLIB_SUPPORT) == 1
+    if (!this->file) {
+	throw std::runtime_error("could not open " + path);
+    }
+    std::istream *in = &this->file;
+    const size_t n_threads = DefaultThreads();
+    std::vector<std::vector<unsigned char>> blocks(std::max(batch_blocks, (size_t)1));
+    this->buffer.reset(new ReadAheadBuffer([in, n_threads, blocks](std::vector<char> *out) mutable {
+	// Empty blocks mark the end of a file but more files may follow
+	size_t n_blocks;
+	do {
+	    n_blocks = 0;
+	    while (n_blocks < blocks.size() && ReadBgzfBlock(in, &blocks[n_blocks])) {
+		++n_blocks;
+	    }
+	    std::vector<size_t> offsets(n_blocks + 1, 0);
+	    for (size_t i = 0; i < n_blocks; ++i) {
+		offsets[i + 1] = offsets[i] + BgzfBlockInputSize(blocks[i]);
+	    }
+	    out->resize(offsets.back());
+	    ParallelForBlocks(n_blocks, n_threads, [&](const size_t i) {
+		InflateBgzfBlock(blocks[i], out->data() + offsets[i]);
+	    });
+	} while (out->empty() && n_blocks > 0);
+    }));
+    this->rdbuf(this->buffer.get());
+    this->exceptions(std::ios::badbit);
+#else
+    throw std::runtime_error("Error in alignment-writer::BgzfInputStream: Alignment-writer was not compiled with zlib support.");
+#endif
+}
+
+BgzfInputStream::~BgzfInputStream() = default;
+
+BgzfOutputStream::BgzfOutputStream(std::ostream *out, const int level, const size_t batch_blocks) : std::ostream(nullptr) {
+#if defined(ALIGNMENTWRITER_ZLIB_SUPPORT) && (ALIGNMENTWRITER_ZLIB_SUPPORT) == 1
+    this->buffer.reset(new BgzfBuffer(out, level, batch_blocks));
+    this->rdbuf(this->buffer.get());
+    this->exceptions(std::ios::badbit);
+#else
+    throw std::runtime_error("Error in alignment-writer::BgzfOutputStream: Alignment-writer was not compiled with zlib support.");
+#endif
+}
+
+BgzfOutputStream::~BgzfOutputStream() {
+    if (!this->finished) {
+	try {
+	    this->Finish();
+	} catch (...) {
+	    // Destructors do not throw, call Finish to see the error
+	}
+    }
+}
+
+void BgzfOutputStream::Finish() {
+    this->finished = true;
+#if defined(ALIGNMENTWRITER_ZLIB_SUPPORT) && (ALIGNMENTWRITER_ZLIB_SUPPORT) == 1
+    static_cast<BgzfBuffer*>(this->buffer.get())->Finish();
+#endif
+}
+}
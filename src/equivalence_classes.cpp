@@ -0,0 +1,250 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "equivalence_classes.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include "bmserial.h"
+#include "bmsparsevec_serial.h"
+
+#include "block_pool.hpp"
+#include "chunk_source.hpp"
+#include "run_stats.hpp"
+#include "text_writer.hpp"
+#include "unpack.hpp"
+
+namespace alignment_writer {
+size_t EquivalenceClasses::RefsHash::operator()(const std::vector<uint32_t> &refs) const {
+    // FNV-1a over the reference ids
+    size_t hash = 14695981039346656037ULL;
+    for (const uint32_t ref_id : refs) {
+	hash = (hash ^ ref_id)*1099511628211ULL;
+    }
+    return hash;
+}
+
+uint32_t EquivalenceClasses::Insert(const std::vector<uint32_t> &class_refs) {
+    const auto &inserted = this->ids.emplace(class_refs, (uint32_t)this->size());
+    if (inserted.second) {
+	this->refs.insert(this->refs.end(), class_refs.begin(), class_refs.end());
+	this->offsets.emplace_back(this->refs.size());
+    }
+    return inserted.first->second;
+}
+
+void EquivalenceClasses::Serialize(const size_t n_refs, const CompressionProfile &compression, SerializedChunk *chunk) const {
+    bm::bvector<> bits(this->size()*n_refs, bm::BM_GAP);
+    {
+	bm::bvector<>::bulk_insert_iterator it(bits);
+	for (size_t class_id = 0; class_id < this->size(); ++class_id) {
+	    for (const uint32_t *ref = this->begin(class_id); ref != this->end(class_id); ++ref) {
+		it = class_id*n_refs + (*ref);
+	    }
+	}
+	it.flush();
+    }
+    bm::serializer<bm::bvector<>> bvs;
+    ConfigureSerializer(&bvs, compression);
+    bvs.serialize(bits, chunk->data);
+
+    // The dictionary does not contain reads
+    chunk->first_read = std::numeric_limits<size_t>::max();
+    chunk->last_read = 0;
+}
+
+void EquivalenceClasses::Deserialize(const unsigned char *chunk, const size_t n_refs) {
+    bm::bvector<> bits;
+    bm::deserialize(bits, chunk);
+
+    // The set bits are in class order
+    this->offsets.assign(1, 0);
+    this->refs.clear();
+    this->ids.clear();
+    for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+	const size_t class_id = (*en)/n_refs;
+	while (this->size() < class_id + 1) {
+	    this->offsets.emplace_back(this->refs.size());
+	}
+	this->refs.emplace_back((*en) - class_id*n_refs);
+	this->offsets.back() = this->refs.size();
+    }
+}
+
+void SerializeClassIds(const ClassIds &ids, const size_t first_read, const size_t last_read, const CompressionProfile &compression, SerializedChunk *chunk) {
+    bm::sparse_vector_serializer<ClassIds> serializer;
+    serializer.get_bv_serializer().set_compression_level(compression.level);
+    if (compression.xor_planes) {
+	serializer.enable_xor_compression();
+    } else {
+	serializer.disable_xor_compression();
+    }
+    bm::sparse_vector_serial_layout<ClassIds> layout;
+    serializer.serialize(ids, layout);
+    chunk->data.copy_from(layout.buf(), layout.size());
+    chunk->first_read = first_read;
+    chunk->last_read = last_read;
+}
+
+void DeserializeClassIds(const unsigned char *chunk, ClassIds *ids) {
+    bm::sparse_vector_deserialize(*ids, chunk);
+}
+
+void ChunkDecoder::ExpandClasses(const unsigned char *chunk, const size_t first_row, bm::bvector<> *bits) const {
+    // Expand the class of each read to its row in the read-major layout
+    ClassIds ids;
+    DeserializeClassIds(chunk, &ids);
+    const size_t n_refs = this->header.n_refs;
+    PooledBitVector expanded(bits->size(), bm::BM_GAP);
+    {
+	bm::bvector<>::bulk_insert_iterator it(expanded);
+	ForEachClassId(ids, [&](const size_t read_id, const uint32_t class_id) {
+	    for (const uint32_t *ref = this->dictionary.begin(class_id); ref != this->dictionary.end(class_id); ++ref) {
+		it = (read_id - first_row)*n_refs + (*ref);
+	    }
+	});
+	it.flush();
+    }
+    bits->merge(expanded);
+}
+
+size_t ChunkDecoder::DeserializeLocal(const ChunkInfo &info, const unsigned char *chunk, bm::bvector<> *bits) const {
+    run_stats::StageTimer timer(RunStats::deserialize);
+    run_stats::Chunk(info.size);
+    if (this->HasClasses()) {
+	this->ExpandClasses(chunk, ChunkFirstRow(info), bits);
+	return ChunkFirstRow(info);
+    }
+    DeserializeChunk(chunk, bits);
+    return (this->ChunkRelative() ? ChunkFirstRow(info) : 0);
+}
+
+void ChunkDecoder::Deserialize(const ChunkInfo &info, const unsigned char *chunk, bm::bvector<> *bits) const {
+    run_stats::StageTimer timer(RunStats::deserialize);
+    run_stats::Chunk(info.size);
+    if (this->HasClasses()) {
+	this->ExpandClasses(chunk, 0, bits);
+	return;
+    }
+    if (!this->ChunkRelative() || ChunkFirstRow(info) == 0) {
+	DeserializeChunk(chunk, bits);
+	return;
+    }
+
+    // Move the rows of the chunk to the rows of its reads
+    PooledBitVector local;
+    DeserializeChunk(chunk, &local);
+    const size_t offset = ChunkFirstRow(info)*this->header.n_refs;
+    PooledBitVector moved(bits->size(), bm::BM_GAP);
+    {
+	bm::bvector<>::bulk_insert_iterator it(moved);
+	for (bm::bvector<>::enumerator en = local.first(); en.valid(); ++en) {
+	    it = offset + (*en);
+	}
+	it.flush();
+    }
+    bits->merge(moved);
+}
+
+void CountClasses(std::istream *in, EquivalenceClasses *classes, std::vector<size_t> *counts) {
+    const FileHeader &header = ReadFileHeader(in);
+    CheckDimensions(header);
+    if (header.flags & EQUIVALENCE_CLASS_FLAG) {
+	// Count the class ids directly
+	StreamChunks chunks(in, header);
+	ChunkDecoder decoder(header);
+	decoder.ReadDictionary(chunks);
+	(*classes) = decoder.classes();
+	counts->assign(classes->size(), 0);
+
+	std::vector<unsigned char> storage;
+	ChunkInfo info;
+	const unsigned char *chunk;
+	ClassIds ids;
+	while (chunks.Next(&info, &chunk, &storage)) {
+	    DeserializeClassIds(chunk, &ids);
+	    ForEachClassId(ids, [&](const size_t, const uint32_t class_id) {
+		++(*counts)[class_id];
+	    });
+	}
+	return;
+    }
+
+    // Find the classes from the rows of the unpacked alignment
+    bm::bvector<> bits(header.n_reads*header.n_refs);
+    UnpackData(in, header, bits);
+    if (header.flags & REFERENCE_MAJOR_FLAG) {
+	bits = Transpose(bits, header.n_refs, header.n_reads);
+    }
+    (*classes) = EquivalenceClasses();
+    counts->clear();
+    std::vector<uint32_t> refs;
+    auto add_read = [&]() {
+	if (!refs.empty()) {
+	    const uint32_t class_id = classes->Insert(refs);
+	    counts->resize(classes->size(), 0);
+	    ++(*counts)[class_id];
+	    refs.clear();
+	}
+    };
+    size_t read_id = 0;
+    for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+	if ((*en)/header.n_refs != read_id) {
+	    add_read();
+	    read_id = (*en)/header.n_refs;
+	}
+	refs.emplace_back((*en) - read_id*header.n_refs);
+    }
+    add_read();
+}
+
+void PrintClassCounts(const EquivalenceClasses &classes, const std::vector<size_t> &counts, std::ostream *out) {
+    std::vector<char> buffer;
+    for (size_t class_id = 0; class_id < classes.size(); ++class_id) {
+	buffer.resize(MAX_NUMBER_DIGITS + 1);
+	char *line = FormatNumber(counts[class_id], buffer.data());
+	for (const uint32_t *ref = classes.begin(class_id); ref != classes.end(class_id); ++ref) {
+	    const size_t pos = line - buffer.data();
+	    buffer.resize(pos + MAX_NUMBER_DIGITS + 2);
+	    line = buffer.data() + pos;
+	    *(line++) = ' ';
+	    line = FormatNumber(*ref, line);
+	}
+	*(line++) = '\n';
+	out->write(buffer.data(), line - buffer.data());
+    }
+    out->flush();
+}
+}
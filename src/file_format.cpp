@@ -0,0 +1,289 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "file_format.hpp"
+
+#include <cctype>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <charconv>
+#include <stdexcept>
+#include <system_error>
+
+namespace alignment_writer {
+void WriteLittleEndian(const uint64_t value, const size_t n_bytes, std::ostream *out) {
+    unsigned char bytes[8];
+    for (size_t i = 0; i < n_bytes; ++i) {
+	bytes[i] = (value >> (8*i)) & 0xFF;
+    }
+    out->write(reinterpret_cast<const char*>(bytes), n_bytes);
+}
+
+uint64_t DecodeLittleEndian(const unsigned char *data, const size_t n_bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < n_bytes; ++i) {
+	value |= (uint64_t)data[i] << (8*i);
+    }
+    return value;
+}
+
+uint64_t ReadLittleEndian(std::istream *in, const size_t n_bytes) {
+    unsigned char bytes[8];
+    in->read(reinterpret_cast<char*>(bytes), n_bytes);
+    if ((size_t)in->gcount() != n_bytes) {
+	throw std::runtime_error("Packed file is truncated.");
+    }
+    return DecodeLittleEndian(bytes, n_bytes);
+}
+
+size_t WriteFileHeader(const FileHeader &header, std::ostream *out) {
+    out->write(reinterpret_cast<const char*>(FILE_MAGIC), 4);
+    WriteLittleEndian(header.version, 2, out);
+    WriteLittleEndian(header.flags, 2, out);
+    WriteLittleEndian(header.n_reads, 8, out);
+    WriteLittleEndian(header.n_refs, 8, out);
+    return BINARY_HEADER_SIZE;
+}
+
+void ReadHeader(const std::string &header_line, size_t *n_reads, size_t *n_refs) {
+    std::stringstream header(header_line);
+    std::string line;
+    std::getline(header, line, ',');
+    (*n_reads) = std::stoul(line); // First value is number of reads
+    std::getline(header, line, ',');
+    (*n_refs) = std::stoul(line); // Second value is number of references
+}
+
+void CheckVersion(const FileHeader &header) {
+    if (header.version > BINARY_FORMAT_VERSION) {
+	throw std::runtime_error("Packed file format version " + std::to_string(header.version) + " is not supported by this version of alignment-writer.");
+    }
+}
+
+FileHeader ReadFileHeader(std::istream *in) {
+    FileHeader header;
+    header.flags = 0;
+    if (std::isdigit(in->peek())) {
+	// Legacy text header
+	std::string line;
+	std::getline(*in, line);
+	header.version = LEGACY_TEXT_VERSION;
+	ReadHeader(line, &header.n_reads, &header.n_refs);
+	return header;
+    }
+
+    unsigned char magic[4];
+    in->read(reinterpret_cast<char*>(magic), 4);
+    if (in->gcount() != 4 || std::memcmp(magic, FILE_MAGIC, 4) != 0) {
+	throw std::runtime_error("Input is not a packed alignment file.");
+    }
+    header.version = ReadLittleEndian(in, 2);
+    header.flags = ReadLittleEndian(in, 2);
+    header.n_reads = ReadLittleEndian(in, 8);
+    header.n_refs = ReadLittleEndian(in, 8);
+    CheckVersion(header);
+
+    size_t index_offset;
+    if ((header.flags & DIMENSIONS_IN_TRAILER_FLAG) && FindIndexOffset(in, &index_offset) && index_offset >= DIMENSIONS_RECORD_SIZE) {
+	// The dimensions record is right before the index
+	std::streampos start = in->tellg();
+	in->seekg(index_offset - DIMENSIONS_RECORD_SIZE);
+	ReadDimensions(in, &header);
+	in->seekg(start);
+    }
+    return header;
+}
+
+FileHeader ParseFileHeader(const unsigned char *data, const size_t size, size_t *header_size) {
+    FileHeader header;
+    header.flags = 0;
+    if (size > 0 && std::isdigit(data[0])) {
+	// Legacy text header
+	const unsigned char *newline = static_cast<const unsigned char*>(std::memchr(data, '\n', size));
+	if (newline == nullptr) {
+	    throw std::runtime_error("Packed file is missing the header line.");
+	}
+	header.version = LEGACY_TEXT_VERSION;
+	ReadHeader(std::string(reinterpret_cast<const char*>(data), newline - data), &header.n_reads, &header.n_refs);
+	(*header_size) = (newline - data) + 1;
+	return header;
+    }
+
+    if (size < BINARY_HEADER_SIZE || std::memcmp(data, FILE_MAGIC, 4) != 0) {
+	throw std::runtime_error("Input is not a packed alignment file.");
+    }
+    header.version = DecodeLittleEndian(data + 4, 2);
+    header.flags = DecodeLittleEndian(data + 6, 2);
+    header.n_reads = DecodeLittleEndian(data + 8, 8);
+    header.n_refs = DecodeLittleEndian(data + 16, 8);
+    CheckVersion(header);
+    (*header_size) = BINARY_HEADER_SIZE;
+
+    if (header.flags & DIMENSIONS_IN_TRAILER_FLAG) {
+	size_t index_offset;
+	if (!FindIndexOffset(data, size, &index_offset) || index_offset < DIMENSIONS_RECORD_SIZE) {
+	    throw std::runtime_error("Packed file is truncated.");
+	}
+	header.n_reads = DecodeLittleEndian(data + index_offset - DIMENSIONS_RECORD_SIZE, 8);
+	header.n_refs = DecodeLittleEndian(data + index_offset - DIMENSIONS_RECORD_SIZE + 8, 8);
+	header.flags &= ~DIMENSIONS_IN_TRAILER_FLAG;
+    }
+    return header;
+}
+
+size_t WriteDimensions(const FileHeader &header, std::ostream *out) {
+    WriteLittleEndian(header.n_reads, 8, out);
+    WriteLittleEndian(header.n_refs, 8, out);
+    return DIMENSIONS_RECORD_SIZE;
+}
+
+void ReadDimensions(std::istream *in, FileHeader *header) {
+    header->n_reads = ReadLittleEndian(in, 8);
+    header->n_refs = ReadLittleEndian(in, 8);
+    header->flags &= ~DIMENSIONS_IN_TRAILER_FLAG;
+}
+
+void CheckDimensions(const FileHeader &header) {
+    if (header.flags & DIMENSIONS_IN_TRAILER_FLAG) {
+	throw std::runtime_error("Packed file stores its dimensions at the end, read it from a file instead of a pipe.");
+    }
+}
+
+size_t WriteChunk(const unsigned char *chunk, const size_t chunk_size, const std::vector<uint64_t> &metadata, std::ostream *out) {
+    // Chunk layout: 8 byte size, 4 byte number of metadata slots, 8 bytes per slot, serialized chunk
+    WriteLittleEndian(chunk_size, 8, out);
+    WriteLittleEndian(metadata.size(), 4, out);
+    for (const uint64_t value : metadata) {
+	WriteLittleEndian(value, 8, out);
+    }
+    out->write(reinterpret_cast<const char*>(chunk), chunk_size);
+    return 12 + 8*metadata.size();
+}
+
+size_t WriteChunksEnd(std::ostream *out) {
+    WriteLittleEndian(CHUNKS_END, 8, out);
+    return 8;
+}
+
+void FillMetadata(const uint64_t n_slots, const unsigned char *slots, ChunkInfo *chunk) {
+    // Chunks without the metadata may contain any read
+    chunk->first_read = (n_slots > FIRST_READ_SLOT ? DecodeLittleEndian(slots + 8*FIRST_READ_SLOT, 8) : 0);
+    chunk->last_read = (n_slots > LAST_READ_SLOT ? DecodeLittleEndian(slots + 8*LAST_READ_SLOT, 8) : std::numeric_limits<size_t>::max());
+    chunk->first_bit = (n_slots > FIRST_BIT_SLOT ? DecodeLittleEndian(slots + 8*FIRST_BIT_SLOT, 8) : 0);
+    chunk->last_bit = (n_slots > LAST_BIT_SLOT ? DecodeLittleEndian(slots + 8*LAST_BIT_SLOT, 8) : std::numeric_limits<size_t>::max());
+}
+
+bool ReadChunk(std::istream *in, const uint16_t version, ChunkInfo *chunk, std::vector<unsigned char> *payload) {
+    chunk->offset = 0;
+    if (version == LEGACY_TEXT_VERSION) {
+	// Size line followed by the chunk, the chunks end at the end of the file
+	std::string line;
+	if (!std::getline(*in, line)) {
+	    return false;
+	}
+	chunk->size = std::stoul(line);
+	FillMetadata(0, nullptr, chunk);
+    } else {
+	if (in->peek() == std::char_traits<char>::eof()) {
+	    return false;
+	}
+	chunk->size = ReadLittleEndian(in, 8);
+	if (chunk->size == CHUNKS_END) {
+	    return false;
+	}
+	const uint64_t n_slots = ReadLittleEndian(in, 4);
+	if (n_slots > MAX_METADATA_SLOTS) {
+	    throw std::runtime_error("Packed file contains an invalid number of chunk metadata slots.");
+	}
+	std::vector<unsigned char> slots(8*n_slots);
+	in->read(reinterpret_cast<char*>(slots.data()), slots.size());
+	if ((size_t)in->gcount() != slots.size()) {
+	    throw std::runtime_error("Packed file is truncated.");
+	}
+	FillMetadata(n_slots, slots.data(), chunk);
+    }
+
+    payload->resize(chunk->size);
+    in->read(reinterpret_cast<char*>(payload->data()), chunk->size);
+    if ((size_t)in->gcount() != chunk->size) {
+	throw std::runtime_error("Packed file is truncated.");
+    }
+    return true;
+}
+
+bool ParseChunk(const unsigned char *data, const size_t size, const uint16_t version, size_t *pos, ChunkInfo *chunk) {
+    if (version == LEGACY_TEXT_VERSION) {
+	if ((*pos) >= size || data[*pos] == '#') { // Chunks end at the index footer or the end of the file
+	    return false;
+	}
+	const char *begin = reinterpret_cast<const char*>(data);
+	const std::from_chars_result &res = std::from_chars(begin + (*pos), begin + size, chunk->size);
+	if (res.ec != std::errc() || res.ptr == begin + size || *res.ptr != '\n') {
+	    throw std::runtime_error("Packed file contains an invalid chunk size.");
+	}
+	chunk->offset = (res.ptr + 1) - begin;
+	FillMetadata(0, nullptr, chunk);
+    } else {
+	if ((*pos) == size) {
+	    return false;
+	}
+	if (size - (*pos) < 8) {
+	    throw std::runtime_error("Packed file is truncated.");
+	}
+	chunk->size = DecodeLittleEndian(data + (*pos), 8);
+	if (chunk->size == CHUNKS_END) {
+	    return false;
+	}
+	if (size - (*pos) < 12) {
+	    throw std::runtime_error("Packed file is truncated.");
+	}
+	const uint64_t n_slots = DecodeLittleEndian(data + (*pos) + 8, 4);
+	if (n_slots > MAX_METADATA_SLOTS) {
+	    throw std::runtime_error("Packed file contains an invalid number of chunk metadata slots.");
+	}
+	if (n_slots > (size - (*pos) - 12)/8) {
+	    throw std::runtime_error("Packed file is truncated.");
+	}
+	FillMetadata(n_slots, data + (*pos) + 12, chunk);
+	chunk->offset = (*pos) + 12 + 8*n_slots;
+    }
+
+    if (chunk->size > size - chunk->offset) {
+	throw std::runtime_error("Packed file is truncated.");
+    }
+    (*pos) = chunk->offset + chunk->size;
+    return true;
+}
+}
@@ -0,0 +1,284 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "merge.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+#include "bm64.h"
+#include "bmserial.h"
+
+#include "chunk_source.hpp"
+#include "chunk_writer.hpp"
+#include "equivalence_classes.hpp"
+#include "file_format.hpp"
+#include "alignment-writer_openmp_config.hpp"
+
+namespace alignment_writer {
+void CheckMergeInput(const size_t n_refs, const size_t n_reads) {
+    if (n_reads != 0 && n_refs > (size_t)140737488355328/n_reads) {
+	throw std::length_error("Merged size exceeds maximum capacity (number of reads x number of references > 2^(48 - 1)).");
+    }
+}
+
+void RemapChunk(const bm::bvector<> &bits, const FileHeader &header, const size_t read_offset, const std::vector<size_t> *ref_map, const size_t n_refs, bm::bvector<> *out) {
+    // Move the bit of each (read, ref) pair of an input chunk to its position in the merged alignment
+    const bool reference_major = header.flags & REFERENCE_MAJOR_FLAG;
+    bm::bvector<>::bulk_insert_iterator it(*out);
+    for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+	size_t read_id, ref_id;
+	if (reference_major) {
+	    ref_id = (*en)/header.n_reads;
+	    read_id = (*en) - ref_id*header.n_reads;
+	} else {
+	    read_id = (*en)/header.n_refs;
+	    ref_id = (*en) - read_id*header.n_refs;
+	}
+	if (ref_map != nullptr) {
+	    ref_id = (*ref_map)[ref_id];
+	}
+	it = (read_id + read_offset)*n_refs + ref_id;
+    }
+    it.flush();
+}
+
+void MergeChunks(std::istream *in, const FileHeader &header, const size_t read_offset, const std::vector<size_t> *ref_map, const size_t n_refs, const CompressionProfile &compression, ChunkWriter *writer) {
+    // Remap and reserialize the chunks of one input in parallel, writing them in input order
+    std::vector<SerializedChunk> chunks(ChunkSlots());
+    std::vector<char> has_reads(ChunkSlots());
+
+    StreamChunks source(in, header);
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(source);
+    ForEachChunkInParallel(source, [&](const size_t slot, const ChunkInfo &info, const unsigned char *chunk) {
+	bm::bvector<> bits;
+	decoder.Deserialize(info, chunk, &bits);
+	bm::bvector<> merged;
+	merged.set_new_blocks_strat(bm::BM_GAP);
+	RemapChunk(bits, header, read_offset, ref_map, n_refs, &merged);
+
+	bm::bvector<>::size_type first_bit, last_bit;
+	has_reads[slot] = merged.find(first_bit) && merged.find_reverse(last_bit);
+	if (has_reads[slot]) {
+	    bm::serializer<bm::bvector<>> bvs;
+	    ConfigureSerializer(&bvs, compression);
+	    bvs.serialize(merged, chunks[slot].data);
+	    chunks[slot].first_read = first_bit/n_refs;
+	    chunks[slot].last_read = last_bit/n_refs;
+	}
+    }, [&](const size_t slot, const ChunkInfo &) {
+	if (has_reads[slot]) {
+	    writer->WriteBuffer(chunks[slot]);
+	}
+    });
+}
+
+std::vector<FileHeader> ReadHeaders(const std::vector<std::istream*> &inputs) {
+    std::vector<FileHeader> headers;
+    for (std::istream *in : inputs) {
+	headers.emplace_back(ReadFileHeader(in));
+	CheckDimensions(headers.back());
+    }
+    return headers;
+}
+
+void MergeReads(const std::vector<std::istream*> &inputs, std::ostream *out, const CompressionProfile &compression) {
+    const std::vector<FileHeader> &headers = ReadHeaders(inputs);
+    size_t n_reads = 0;
+    const size_t n_refs = (headers.empty() ? 0 : headers[0].n_refs);
+    for (size_t i = 0; i < headers.size(); ++i) {
+	if (headers[i].n_refs != n_refs) {
+	    throw std::invalid_argument("input " + std::to_string(i) + " has " + std::to_string(headers[i].n_refs) + " references instead of " + std::to_string(n_refs));
+	}
+	n_reads += headers[i].n_reads;
+    }
+    CheckMergeInput(n_refs, n_reads);
+
+    ChunkWriter writer(n_refs, n_reads, out);
+    size_t read_offset = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+	MergeChunks(inputs[i], headers[i], read_offset, nullptr, n_refs, compression, &writer);
+	read_offset += headers[i].n_reads;
+    }
+    writer.Finish();
+}
+
+void MergeReferences(const std::vector<std::istream*> &inputs, const std::vector<FileHeader> &headers, const std::vector<std::vector<size_t>> &ref_maps, const size_t n_refs, const CompressionProfile &compression, std::ostream *out) {
+    if (ref_maps.size() != inputs.size()) {
+	throw std::invalid_argument("expected one reference map for each input");
+    }
+    const size_t n_reads = (headers.empty() ? 0 : headers[0].n_reads);
+    for (size_t i = 0; i < headers.size(); ++i) {
+	if (headers[i].n_reads != n_reads) {
+	    throw std::invalid_argument("input " + std::to_string(i) + " has " + std::to_string(headers[i].n_reads) + " reads instead of " + std::to_string(n_reads));
+	}
+	if (headers[i].flags & REFERENCE_MAJOR_FLAG) {
+	    throw std::invalid_argument("input " + std::to_string(i) + " is in the reference-major layout");
+	}
+	if (ref_maps[i].size() != headers[i].n_refs) {
+	    throw std::invalid_argument("the reference map of input " + std::to_string(i) + " has " + std::to_string(ref_maps[i].size()) + " references instead of " + std::to_string(headers[i].n_refs));
+	}
+	for (const size_t ref_id : ref_maps[i]) {
+	    if (ref_id >= n_refs) {
+		throw std::out_of_range("reference id " + std::to_string(ref_id) + " in the reference map of input " + std::to_string(i) + " is not less than " + std::to_string(n_refs));
+	    }
+	}
+    }
+    CheckMergeInput(n_refs, n_reads);
+
+    // The inputs are read in lockstep so that the pseudoalignments of each read end up in the same
+    // output chunk. In each round, the inputs that are furthest behind read their next chunk and the
+    // chunks are remapped in parallel. Reads that all inputs have moved past are written out.
+    ChunkWriter writer(n_refs, n_reads, out);
+    bm::serializer<bm::bvector<>> bvs;
+    ConfigureSerializer(&bvs, compression);
+
+    std::vector<StreamChunks> sources;
+    std::vector<ChunkDecoder> decoders;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+	sources.emplace_back(StreamChunks(inputs[i], headers[i]));
+	decoders.emplace_back(ChunkDecoder(headers[i]));
+	decoders.back().ReadDictionary(sources.back());
+    }
+    std::vector<std::vector<unsigned char>> storage(inputs.size());
+    std::vector<const unsigned char*> chunks(inputs.size());
+    std::vector<ChunkInfo> infos(inputs.size());
+    std::vector<bm::bvector<>> remapped(inputs.size());
+    std::vector<char> has_chunk(inputs.size());
+    std::vector<char> exhausted(inputs.size(), false);
+    std::vector<size_t> last_seen(inputs.size(), 0); // Largest read id read from each input
+    std::vector<std::exception_ptr> errors(inputs.size()); // Exception thrown while remapping each input
+
+    bm::bvector<> pending(n_reads*n_refs, bm::BM_GAP);
+    size_t next_read = 0; // First read that has not been written
+    auto write_reads = [&](const size_t end_read) {
+	// Write the reads in [next_read, end_read) as one chunk
+	bm::bvector<>::size_type first_bit, last_bit;
+	if (end_read > next_read && pending.find(first_bit) && first_bit < end_read*n_refs) {
+	    bm::bvector<> part;
+	    part.copy_range(pending, next_read*n_refs, end_read*n_refs - 1);
+	    part.find_reverse(last_bit);
+	    SerializedChunk chunk;
+	    bvs.serialize(part, chunk.data);
+	    chunk.first_read = first_bit/n_refs;
+	    chunk.last_read = last_bit/n_refs;
+	    writer.WriteBuffer(chunk);
+	    pending.keep_range(end_read*n_refs, n_reads*n_refs - 1);
+	}
+	next_read = std::max(next_read, end_read);
+    };
+
+    while (std::find(exhausted.begin(), exhausted.end(), false) != exhausted.end()) {
+	size_t behind = n_reads;
+	for (size_t i = 0; i < inputs.size(); ++i) {
+	    if (!exhausted[i]) {
+		behind = std::min(behind, last_seen[i]);
+	    }
+	}
+
+	// Read the next chunk from the inputs that are furthest behind
+	for (size_t i = 0; i < inputs.size(); ++i) {
+	    has_chunk[i] = !exhausted[i] && last_seen[i] == behind && sources[i].Next(&infos[i], &chunks[i], &storage[i]);
+	    exhausted[i] = exhausted[i] || (last_seen[i] == behind && !has_chunk[i]);
+	}
+
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+	for (size_t i = 0; i < inputs.size(); ++i) {
+	    if (has_chunk[i]) {
+		try {
+		    bm::bvector<> bits;
+		    decoders[i].Deserialize(infos[i], chunks[i], &bits);
+		    remapped[i].clear(true);
+		    remapped[i].set_new_blocks_strat(bm::BM_GAP);
+		    RemapChunk(bits, headers[i], 0, &ref_maps[i], n_refs, &remapped[i]);
+		} catch (...) {
+		    errors[i] = std::current_exception();
+		}
+	    }
+	}
+	// Exceptions can not leave the parallel loop, rethrow the first one from the inputs here
+	for (size_t i = 0; i < inputs.size(); ++i) {
+	    if (errors[i]) {
+		std::rethrow_exception(errors[i]);
+	    }
+	}
+
+	for (size_t i = 0; i < inputs.size(); ++i) {
+	    bm::bvector<>::size_type first_bit, last_bit;
+	    if (has_chunk[i] && remapped[i].find(first_bit) && remapped[i].find_reverse(last_bit)) {
+		if (first_bit/n_refs < next_read) {
+		    throw std::runtime_error("the chunks of input " + std::to_string(i) + " are not in read order (was the input sorted by read id?)");
+		}
+		last_seen[i] = std::max(last_seen[i], (size_t)(last_bit/n_refs));
+		pending.merge(remapped[i]);
+	    }
+	}
+
+	// All inputs have written every read before the smallest last read id, except exhausted inputs
+	size_t complete = n_reads;
+	for (size_t i = 0; i < inputs.size(); ++i) {
+	    if (!exhausted[i]) {
+		complete = std::min(complete, last_seen[i]);
+	    }
+	}
+	write_reads(complete);
+    }
+    write_reads(n_reads);
+    writer.Finish();
+}
+
+void MergeReferences(const std::vector<std::istream*> &inputs, const std::vector<std::vector<size_t>> &ref_maps, const size_t n_refs, std::ostream *out, const CompressionProfile &compression) {
+    MergeReferences(inputs, ReadHeaders(inputs), ref_maps, n_refs, compression, out);
+}
+
+void MergeReferences(const std::vector<std::istream*> &inputs, std::ostream *out, const CompressionProfile &compression) {
+    const std::vector<FileHeader> &headers = ReadHeaders(inputs);
+
+    // Place the references of each input after the references of the previous inputs
+    std::vector<std::vector<size_t>> ref_maps(headers.size());
+    size_t n_refs = 0;
+    for (size_t i = 0; i < headers.size(); ++i) {
+	for (size_t k = 0; k < headers[i].n_refs; ++k) {
+	    ref_maps[i].emplace_back(n_refs + k);
+	}
+	n_refs += headers[i].n_refs;
+    }
+    MergeReferences(inputs, headers, ref_maps, n_refs, compression, out);
+}
+}
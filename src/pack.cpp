@@ -34,132 +34,1096 @@
 //
 #include "pack.hpp"
 
-#include <sstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <limits>
+#include <algorithm>
 #include <exception>
-#include <functional>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <tuple>
+#include <cerrno>
+#include <cstdlib>
 
 #include "bm64.h"
 #include "bmserial.h"
 
+#include "block_pool.hpp"
+#include "chunk_index.hpp"
+#include "chunk_writer.hpp"
+#include "equivalence_classes.hpp"
+#include "file_format.hpp"
+#include "line_parser.hpp"
+#include "run_stats.hpp"
+#include "alignment-writer_openmp_config.hpp"
+
 namespace alignment_writer {
-void CheckInput(const size_t n_refs, const size_t n_reads) {
+// Size of the blocks of input lines that are packed in parallel
+constexpr size_t PARALLEL_PACK_BLOCK_SIZE = 8388608;
+// Number of read id ranges that unsorted input is split into in BucketedPack
+constexpr size_t PACK_BUCKETS = 1024;
+// Bytes of packed chunks that PackOutput holds in memory before moving them to a temporary file
+constexpr size_t PACK_OUTPUT_MEMORY_BUDGET = 67108864;
+
+// Largest number of bits addressed in one bit vector
+constexpr size_t MAX_ALIGNMENT_SIZE = 140737488355328;
+
+void CheckInput(const size_t n_refs, const size_t n_reads, const bool relative = false) {
+    if (relative) {
+	// Each chunk must have room for at least one read
+	if (n_refs > MAX_ALIGNMENT_SIZE) {
+	    throw std::length_error("Input size exceeds maximum capacity (number of references > 2^(48 - 1)).");
+	}
+	return;
+    }
     size_t aln_size = (size_t)(n_reads * n_refs);
-    if (aln_size > (size_t)140737488355328) {
-	throw std::length_error("Input size exceeds maximum capacity (number of reads x number of references > 2^(48 - 1)).");
+    if (aln_size > MAX_ALIGNMENT_SIZE) {
+	throw std::length_error("Input size exceeds maximum capacity (number of reads x number of references > 2^(48 - 1)), pack with chunk-relative addressing");
     }
 }
 
-void WriteHeader(const size_t n_refs, const size_t n_reads, std::ostream *out) {
-    // Write the header line of the packed format
-    *out << n_reads << ',' << n_refs << '\n';
+ChunkPolicy ResolvePolicy(const ChunkPolicy &policy, const size_t n_refs, const size_t n_reads) {
+    // Switch to chunk-relative addressing if the bit positions of the whole alignment would not fit
+    ChunkPolicy resolved = policy;
+    if (n_refs != UNKNOWN_DIMENSION && n_reads != UNKNOWN_DIMENSION && n_reads != 0 && n_refs > MAX_ALIGNMENT_SIZE/n_reads) {
+	resolved.relative = true;
+    }
+    return resolved;
 }
 
-void WriteBuffer(const bm::bvector<> &bits, bm::serializer<bm::bvector<>> &bvs, std::ostream *out) {
-    // Use serialization buffer class (automatic RAI, freed on destruction)
-    bm::serializer<bm::bvector<>>::buffer sbuf;
-    bvs.serialize(bits, sbuf);
+// Number of bits per read in the chunks packed before the number of references is known,
+// the rows are doubled in length when a larger reference id is found
+constexpr size_t INITIAL_ROW_SIZE = 64;
 
-    //  Write to *out
-    auto sz = sbuf.size();
-    *out << sz << '\n';
-    unsigned char* buf = sbuf.data();
-    for (size_t i = 0; i < sz; ++i) {
-	*out << buf[i];
+void Restride(const bm::bvector<> &bits, const size_t from, const size_t to, bm::bvector<> *out) {
+    // Move the bit at `read*from + ref` to `read*to + ref`
+    out->clear(true);
+    out->set_new_blocks_strat(bm::BM_GAP);
+    bm::bvector<>::bulk_insert_iterator it(*out);
+    for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+	const size_t read_id = (*en)/from;
+	it = read_id*to + ((*en) - read_id*from);
     }
+    it.flush();
 }
 
-size_t ThemistoParser(const std::string &line, const size_t n_refs, bm::bvector<>::bulk_insert_iterator *it, size_t read_id=0) {
-    // Reads a pseudoalignment line stored in the *Themisto* format and returns the number of pseudoalignments on the line
-    char separator = ' ';
-    std::stringstream stream(line);
-    std::string part;
-    std::getline(stream, part, separator);
-    read_id = std::stoul(part); // First column is a numerical ID for the read
-    size_t n_alignments = 0;
-    while(std::getline(stream, part, separator)) {
+// A serialized chunk, the number of bits per read it was built with,
+// and the number of references seen by its builder
+struct BuiltChunk {
+    SerializedChunk chunk;
+    size_t row_size;
+    size_t n_refs;
+};
+
+// Collects pseudoalignments parsed from input lines into a bit vector.
+// If `n_refs` is UNKNOWN_DIMENSION the rows grow to fit the largest reference id.
+// With `relative` set, the rows start from the first read of the chunk.
+// The blocks of a serialized chunk are kept in a pool and reused for the next chunk.
+class ChunkBuilder {
+public:
+    ChunkBuilder(const size_t n_refs, const bool _relative = false) : row_size(n_refs == UNKNOWN_DIMENSION ? INITIAL_ROW_SIZE : n_refs), max_rows(MAX_ALIGNMENT_SIZE/std::max(row_size, (size_t)1)), grow_rows(n_refs == UNKNOWN_DIMENSION), relative(_relative), it(bits) {
+	this->pool.set_block_limit(BLOCK_POOL_LIMIT);
+	this->bits.set_allocator_pool(&this->pool);
+	this->bits.set_new_blocks_strat(bm::BM_GAP);
+    }
+
+    // Parse a line in format `F`, `line_number` is used as the read id for formats that do not store it
+    template <Format F>
+    void AddLine(const char *begin, const char *end, const size_t line_number) {
+	if (this->relative && this->n_reads_in_buffer == 0) {
+	    this->first_row = LineReadId<F>(begin, end, line_number);
+	}
+	size_t read_id = line_number;
+	this->n_in_buffer += ParseLine<F>(begin, end, read_id, [&](const size_t ref_id) {
+	    this->Insert(read_id, ref_id);
+	});
+	this->EndRead(read_id);
+	this->n_text_bytes += end - begin + 1;
+    }
+
+    // Add the pseudoalignments of read `read_id` against the `n` references in `refs`
+    void AddRead(const size_t read_id, const uint32_t *refs, const size_t n) {
+	if (this->relative && this->n_reads_in_buffer == 0) {
+	    this->first_row = read_id;
+	}
+	for (size_t i = 0; i < n; ++i) {
+	    this->Insert(read_id, refs[i]);
+	}
+	this->n_in_buffer += n;
+	this->EndRead(read_id);
+    }
+
+    // Number of pseudoalignments in the chunk
+    size_t size() const { return this->n_in_buffer; }
+    // Check if no reads have been added to the chunk
+    bool empty() const { return this->n_reads_in_buffer == 0; }
+
+    // Check if the chunk has reached the target size of `policy`
+    bool Full(const ChunkPolicy &policy) const {
+	if (policy.unit == ChunkPolicy::reads) {
+	    return this->n_reads_in_buffer >= policy.size;
+	} else if (policy.unit == ChunkPolicy::bytes) {
+	    return this->n_in_buffer*this->bytes_per_alignment >= policy.size;
+	}
+	return this->n_in_buffer > policy.size;
+    }
+
+    // Check if the line with `read_id` continues the last read in the chunk
+    bool Continues(const size_t read_id) const { return this->n_reads_in_buffer > 0 && read_id == this->prev_read; }
+
+    // Close the chunk before the line in [begin, end) if it is full and the line starts a new read
+    template <Format F>
+    bool CloseBefore(const char *begin, const char *end, const size_t line_number, const ChunkPolicy &policy) const {
+	return this->Full(policy) && !this->Continues(LineReadId<F>(begin, end, line_number));
+    }
+    bool CloseBefore(const size_t read_id, const ChunkPolicy &policy) const {
+	return this->Full(policy) && !this->Continues(read_id);
+    }
+
+    // Serialize the chunk into `built` and start a new one
+    void Serialize(bm::serializer<bm::bvector<>> &bvs, BuiltChunk *built) {
+	// Force flush on the inserter to ensure everything is saved
+	{
+	    run_stats::StageTimer timer(RunStats::flush);
+	    this->it.flush();
+	}
+	{
+	    run_stats::StageTimer timer(RunStats::serialize);
+	    bvs.serialize(this->bits, built->chunk.data);
+	}
+	run_stats::Count(run_stats::lines, this->n_lines_in_buffer);
+	run_stats::Count(run_stats::alignments, this->n_in_buffer);
+	run_stats::Count(run_stats::text_bytes, this->n_text_bytes);
+	built->chunk.first_read = this->first_read;
+	built->chunk.last_read = this->last_read;
+	built->row_size = this->row_size;
+	built->n_refs = this->n_refs;
+
+	// Update the estimate of the compressed size
+	this->total_alignments += this->n_in_buffer;
+	this->total_bytes += built->chunk.data.size();
+	if (this->total_alignments > 0) {
+	    this->bytes_per_alignment = (double)this->total_bytes/this->total_alignments;
+	}
+
+	this->bits.clear(true);
+	this->bits.set_new_blocks_strat(bm::BM_GAP);
+	this->n_in_buffer = 0;
+	this->n_reads_in_buffer = 0;
+	this->n_lines_in_buffer = 0;
+	this->n_text_bytes = 0;
+	this->first_read = std::numeric_limits<size_t>::max();
+	this->last_read = 0;
+    }
+
+private:
+    void Insert(const size_t read_id, const size_t ref_id) {
+	if (ref_id >= this->row_size) {
+	    this->GrowRows(ref_id);
+	}
+	this->n_refs = std::max(this->n_refs, ref_id + 1);
+	this->CheckRow(read_id);
 	// Buffered insertion to contiguously stored n_reads x n_refs pseudoalignment matrix
-	(*it) = read_id*n_refs + std::stoul(part);
-	++n_alignments;
+	this->it = (read_id - this->first_row)*this->row_size + ref_id;
+    }
+
+    void EndRead(const size_t read_id) {
+	// Reads without pseudoalignments also count towards the rows of the chunk
+	this->CheckRow(read_id);
+	++this->n_lines_in_buffer;
+	if (this->n_reads_in_buffer == 0 || read_id != this->prev_read) {
+	    ++this->n_reads_in_buffer;
+	}
+	this->prev_read = read_id;
+	this->first_read = std::min(this->first_read, read_id);
+	this->last_read = std::max(this->last_read, read_id);
+    }
+
+    void CheckRow(const size_t read_id) const {
+	// Check that the read has a row in the chunk
+	if (read_id < this->first_row) {
+	    throw std::runtime_error("chunk-relative packing requires input sorted by read id");
+	}
+	if (read_id - this->first_row >= this->max_rows) {
+	    if (this->relative) {
+		throw std::length_error("Chunk size exceeds maximum capacity (reads in the chunk x number of references > 2^(48 - 1)), use smaller chunks");
+	    }
+	    throw std::length_error("Input size exceeds maximum capacity (number of reads x number of references > 2^(48 - 1)), pack with chunk-relative addressing");
+	}
+    }
+
+    void GrowRows(const size_t ref_id) {
+	if (!this->grow_rows) {
+	    throw std::out_of_range("reference id " + std::to_string(ref_id) + " is not less than the number of references");
+	}
+	size_t row_size = this->row_size;
+	while (row_size <= ref_id) {
+	    row_size *= 2;
+	}
+	// The inserter keeps pointing to `bits` after the swap
+	this->it.flush();
+	bm::bvector<> restrided;
+	restrided.set_allocator_pool(&this->pool);
+	Restride(this->bits, this->row_size, row_size, &restrided);
+	this->bits.swap(restrided);
+	this->row_size = row_size;
+	this->max_rows = MAX_ALIGNMENT_SIZE/row_size;
+    }
+
+    size_t row_size; // Number of bits per read
+    size_t max_rows; // Number of reads that fit in the bit vector
+    bool grow_rows;
+    bool relative;
+    size_t first_row = 0; // Read id of the first row
+    size_t n_refs = 0; // Largest reference id seen + 1
+    BlockPool pool; // Outlives `bits`
+    bm::bvector<> bits;
+    bm::bvector<>::bulk_insert_iterator it;
+    size_t n_in_buffer = 0;
+    size_t n_reads_in_buffer = 0;
+    size_t n_lines_in_buffer = 0; // Lines or AddRead calls, for RunStats
+    size_t n_text_bytes = 0; // Bytes in the lines, for RunStats
+    size_t prev_read = 0; // Read id of the last line
+    size_t first_read = std::numeric_limits<size_t>::max();
+    size_t last_read = 0;
+
+    // Compressed bytes per pseudoalignment in the chunks serialized so far,
+    // the first chunk assumes one byte per pseudoalignment.
+    size_t total_alignments = 0;
+    size_t total_bytes = 0;
+    double bytes_per_alignment = 1.0;
+};
+
+// Temporary directory for the buckets of BucketedPack and the chunks held by PackOutput,
+// removed with its contents when destroyed
+class BucketFiles {
+public:
+    BucketFiles(const std::string &temp_dir) {
+	const std::filesystem::path &parent = (temp_dir.empty() ? std::filesystem::temp_directory_path() : std::filesystem::path(temp_dir));
+	std::string name = (parent / "alignment-writer-XXXXXX").string();
+	if (mkdtemp(name.data()) == nullptr) {
+	    throw std::system_error(errno, std::generic_category(), "could not create a temporary directory in " + parent.string());
+	}
+	this->dir = name;
+    }
+    ~BucketFiles() {
+	std::error_code err;
+	std::filesystem::remove_all(this->dir, err);
+    }
+
+    // Append `lines` to the file of bucket `bucket`
+    void Append(const size_t bucket, const std::vector<char> &lines) {
+	std::ofstream file(this->Path(bucket), std::ios::binary | std::ios::app);
+	file.write(lines.data(), lines.size());
+	if (!file) {
+	    throw std::runtime_error("could not write to " + this->Path(bucket).string());
+	}
+    }
+
+    // Read the file of bucket `bucket` into `lines`
+    void Read(const size_t bucket, std::vector<char> *lines) const {
+	std::ifstream file(this->Path(bucket), std::ios::binary);
+	lines->resize(std::filesystem::file_size(this->Path(bucket)));
+	file.read(lines->data(), lines->size());
+    }
+
+    std::filesystem::path Path(const size_t bucket) const { return this->dir / ("bucket_" + std::to_string(bucket)); }
+
+private:
+    std::filesystem::path dir;
+};
+
+// Writes the chunks built by ChunkBuilder. Unknown dimensions are taken from the
+// largest read and reference ids in the chunks. If the number of references is not
+// known, the chunks are held until Finish is called so their rows can be shortened
+// to the number of references. Once the held chunks take more than
+// PACK_OUTPUT_MEMORY_BUDGET bytes they are moved to a file in the temporary directory.
+class PackOutput {
+public:
+    PackOutput(const size_t _n_refs, const size_t _n_reads, const ChunkPolicy &policy, std::ostream *_out) : n_refs(_n_refs), n_reads(_n_reads), relative(policy.relative), compression(policy.compression), out(_out) {
+	if (this->n_refs != UNKNOWN_DIMENSION) {
+	    if (this->n_reads != UNKNOWN_DIMENSION) {
+		CheckInput(this->n_refs, this->n_reads, this->relative);
+	    }
+	    this->writer.reset(new ChunkWriter(this->n_refs, this->n_reads, this->out, this->flags()));
+	}
     }
-    return n_alignments;
+
+    void Write(const BuiltChunk &built) {
+	if (built.chunk.first_read <= built.chunk.last_read) {
+	    this->n_reads_seen = std::max(this->n_reads_seen, built.chunk.last_read + 1);
+	}
+	this->n_refs_seen = std::max(this->n_refs_seen, built.n_refs);
+	if (this->writer) {
+	    this->writer->WriteBuffer(built.chunk);
+	} else {
+	    this->chunks.emplace_back(built);
+	    this->bytes_in_memory += built.chunk.data.size();
+	    if (this->bytes_in_memory > PACK_OUTPUT_MEMORY_BUDGET) {
+		this->Spill();
+	    }
+	}
+    }
+
+    void Finish() {
+	const size_t n_reads = (this->n_reads == UNKNOWN_DIMENSION ? this->n_reads_seen : this->n_reads);
+	if (this->writer) {
+	    CheckInput(this->n_refs, n_reads, this->relative);
+	    this->writer->Finish(n_reads);
+	    return;
+	}
+
+	const size_t n_refs = this->n_refs_seen;
+	CheckInput(n_refs, n_reads, this->relative);
+	ChunkWriter writer(n_refs, n_reads, this->out, this->flags());
+	bm::serializer<bm::bvector<>> bvs;
+	ConfigureSerializer(&bvs, this->compression);
+	auto write_chunk = [&](BuiltChunk &built) {
+	    if (built.row_size != n_refs) {
+		bm::bvector<> bits;
+		{
+		    run_stats::StageTimer timer(RunStats::deserialize);
+		    bm::deserialize(bits, built.chunk.data.buf());
+		}
+		run_stats::StageTimer timer(RunStats::serialize);
+		bm::bvector<> restrided;
+		Restride(bits, built.row_size, n_refs, &restrided);
+		bvs.serialize(restrided, built.chunk.data);
+	    }
+	    writer.WriteBuffer(built.chunk);
+	    built.chunk.data.release();
+	};
+	if (this->files) {
+	    // Read the chunks back one at a time in the order they were written
+	    this->Spill();
+	    this->spilled.close();
+	    std::ifstream in(this->files->Path(0), std::ios::binary);
+	    BuiltChunk built;
+	    for (size_t i = 0; i < this->n_spilled; ++i) {
+		run_stats::StageTimer timer(RunStats::read);
+		uint64_t record[5];
+		in.read(reinterpret_cast<char*>(record), sizeof(record));
+		built.row_size = record[0];
+		built.n_refs = record[1];
+		built.chunk.first_read = record[2];
+		built.chunk.last_read = record[3];
+		built.chunk.data.reserve(record[4]);
+		built.chunk.data.resize_no_check(record[4]);
+		in.read(reinterpret_cast<char*>(built.chunk.data.data()), record[4]);
+		if (!in) {
+		    throw std::runtime_error("could not read the chunks from " + this->files->Path(0).string());
+		}
+		write_chunk(built);
+	    }
+	} else {
+	    for (BuiltChunk &built : this->chunks) {
+		write_chunk(built);
+	    }
+	}
+	writer.Finish();
+    }
+
+private:
+    uint16_t flags() const { return (this->relative ? CHUNK_RELATIVE_FLAG : 0); }
+
+    // Append the held chunks to the temporary file
+    void Spill() {
+	run_stats::StageTimer timer(RunStats::write);
+	if (!this->files) {
+	    this->files.reset(new BucketFiles(""));
+	    this->spilled.open(this->files->Path(0), std::ios::binary);
+	}
+	for (const BuiltChunk &built : this->chunks) {
+	    const uint64_t record[5] = { built.row_size, built.n_refs, built.chunk.first_read, built.chunk.last_read, built.chunk.data.size() };
+	    this->spilled.write(reinterpret_cast<const char*>(record), sizeof(record));
+	    this->spilled.write(reinterpret_cast<const char*>(built.chunk.data.buf()), built.chunk.data.size());
+	}
+	if (!this->spilled) {
+	    throw std::runtime_error("could not write the chunks to " + this->files->Path(0).string());
+	}
+	this->n_spilled += this->chunks.size();
+	std::vector<BuiltChunk>().swap(this->chunks);
+	this->bytes_in_memory = 0;
+    }
+
+    size_t n_refs;
+    size_t n_reads;
+    bool relative;
+    CompressionProfile compression;
+    std::ostream *out;
+    std::unique_ptr<ChunkWriter> writer;
+    std::vector<BuiltChunk> chunks;
+    size_t bytes_in_memory = 0; // Packed bytes in `chunks`
+    std::unique_ptr<BucketFiles> files; // Chunks moved out of memory by Spill
+    std::ofstream spilled;
+    size_t n_spilled = 0;
+    size_t n_refs_seen = 0;
+    size_t n_reads_seen = 0;
+};
+
+template <Format F>
+void BufferedPackFormat(const size_t n_refs, const size_t n_reads, const ChunkPolicy &chunk_policy, std::istream *in, std::ostream *out) {
+    // Buffered read + packing from a stream containing lines in format `F`
+    // Write info about the pseudoalignment
+    const ChunkPolicy &policy = ResolvePolicy(chunk_policy, n_refs, n_reads);
+    PackOutput output(n_refs, n_reads, policy, out);
+
+    bm::serializer<bm::bvector<>> bvs;
+    ConfigureSerializer(&bvs, policy.compression);
+
+    ChunkBuilder builder(n_refs, policy.relative);
+    BuiltChunk chunk;
+    size_t line_number = 0;
+    run_stats::StageTimer timer(RunStats::parse);
+    ForEachLine(in, [&](const char *begin, const char *end) {
+	if (builder.CloseBefore<F>(begin, end, line_number, policy)) {
+	    builder.Serialize(bvs, &chunk);
+	    output.Write(chunk);
+	}
+	// Parse the line
+	builder.AddLine<F>(begin, end, line_number);
+	++line_number;
+    });
+
+    // Write the remaining bits
+    builder.Serialize(bvs, &chunk);
+    output.Write(chunk);
+    output.Finish();
 }
 
-size_t FulgorParser(const std::string &line, const size_t n_refs, bm::bvector<>::bulk_insert_iterator *it, size_t read_id) {
-    // Reads a pseudoalignment line stored in the *Fulgor* format and returns the number of pseudoalignments on the line
-    char separator = '\t';
-    std::stringstream stream(line);
-    std::string part;
-    std::getline(stream, part, separator); // First column is the fragment name
-    std::getline(stream, part, separator); // Second column is the number of alignments
-    size_t n_alignments = std::stoul(part);
-    while(std::getline(stream, part, separator)) {
-	// Buffered insertion to contiguously stored n_reads x n_refs pseudoalignment matrix
-	(*it) = read_id*n_refs + std::stoul(part);
+template <Format F>
+size_t PackBlock(const std::vector<char> &block, const size_t first_line, const size_t n_refs, const ChunkPolicy &policy, std::vector<BuiltChunk> *chunks) {
+    // Parse and serialize one block of lines, splitting it into chunks of the size given by `policy`.
+    // The chunks are stored from the start of `chunks` reusing the buffers of its elements,
+    // returns the number of chunks.
+    bm::serializer<bm::bvector<>> bvs;
+    ConfigureSerializer(&bvs, policy.compression);
+
+    ChunkBuilder builder(n_refs, policy.relative);
+    size_t n_chunks = 0;
+    const auto serialize = [&]() {
+	if (n_chunks == chunks->size()) {
+	    chunks->emplace_back(BuiltChunk());
+	}
+	builder.Serialize(bvs, &(*chunks)[n_chunks]);
+	++n_chunks;
+    };
+    size_t line_number = first_line;
+    run_stats::StageTimer timer(RunStats::parse);
+    ForEachLineInBlock(block.data(), block.data() + block.size(), [&](const char *begin, const char *end) {
+	if (builder.CloseBefore<F>(begin, end, line_number, policy)) {
+	    serialize();
+	}
+	builder.AddLine<F>(begin, end, line_number);
+	++line_number;
+    });
+    if (builder.size() > 0) {
+	serialize();
     }
-    return n_alignments;
+    return n_chunks;
 }
 
-void BufferedPack(const Format &format, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::istream *in, std::ostream *out) {
-    // Buffered read + packing from a stream
-    // Write info about the pseudoalignment
-    CheckInput(n_refs, n_reads);
-    WriteHeader(n_refs, n_reads, out);
+template <Format F>
+void ParallelBufferedPackFormat(const size_t n_refs, const size_t n_reads, const ChunkPolicy &chunk_policy, std::istream *in, std::ostream *out) {
+    // Pipelined packing: one thread reads line-aligned blocks of input and writes finished chunks
+    // in input order while the other threads parse and serialize blocks concurrently.
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    const ChunkPolicy &policy = ResolvePolicy(chunk_policy, n_refs, n_reads);
+    PackOutput output(n_refs, n_reads, policy, out);
+
+    LineBlockReader reader(in, PARALLEL_PACK_BLOCK_SIZE);
+
+    // Exceptions can not leave the parallel region, the first one is stored and rethrown after it
+    std::exception_ptr error;
+#pragma omp parallel
+    {
+#pragma omp single
+	{
+	    // At most two batches of `n_threads` blocks are held in memory at the same time.
+	    const size_t batch_size = omp_get_num_threads();
+	    std::vector<std::vector<char>> blocks(batch_size);
+	    std::vector<std::vector<char>> next_blocks(batch_size);
+	    std::vector<std::vector<BuiltChunk>> chunks(batch_size);
+	    std::vector<std::vector<BuiltChunk>> done_chunks(batch_size);
+	    std::vector<size_t> n_chunks(batch_size); // Chunks built from each block, the buffers are reused by the next batches
+	    std::vector<size_t> n_done_chunks(batch_size);
+	    std::vector<size_t> first_lines(batch_size);
+	    std::vector<std::exception_ptr> errors(batch_size); // Exception thrown by the task for each block
+
+	    // Reads the next batch of blocks, returns the number of blocks read
+	    size_t line_number = 0;
+	    auto read_batch = [&](std::vector<std::vector<char>> *batch) {
+		size_t n_blocks = 0;
+		while (n_blocks < batch_size && reader.NextBlock(&(*batch)[n_blocks])) {
+		    ++n_blocks;
+		}
+		return n_blocks;
+	    };
+
+	    try {
+		size_t n_blocks = read_batch(&blocks);
+		size_t n_done = 0;
+		while (n_blocks > 0) {
+		    // Parse and serialize the current batch
+		    for (size_t i = 0; i < n_blocks; ++i) {
+			first_lines[i] = line_number;
+			if constexpr (F == fulgor) {
+			    // Fulgor does not store read ids, they are given by the line number
+			    const std::vector<char> &block = blocks[i];
+			    line_number += std::count(block.begin(), block.end(), '\n') + (block.back() != '\n');
+			}
+#pragma omp task firstprivate(i) shared(blocks, chunks, n_chunks, first_lines, errors)
+			{
+			    try {
+				n_chunks[i] = PackBlock<F>(blocks[i], first_lines[i], n_refs, policy, &chunks[i]);
+			    } catch (...) {
+				errors[i] = std::current_exception();
+			    }
+			}
+		    }
+
+		    // Write the previous batch and read the next one while the tasks run
+		    for (size_t i = 0; i < n_done; ++i) {
+			for (size_t j = 0; j < n_done_chunks[i]; ++j) {
+			    output.Write(done_chunks[i][j]);
+			}
+		    }
+		    size_t n_next = read_batch(&next_blocks);
+
+#pragma omp taskwait
+		    // Report the error from the first block in input order like the serial path would
+		    for (size_t i = 0; i < n_blocks; ++i) {
+			if (errors[i]) {
+			    std::rethrow_exception(errors[i]);
+			}
+		    }
+		    blocks.swap(next_blocks);
+		    chunks.swap(done_chunks);
+		    n_chunks.swap(n_done_chunks);
+		    n_done = n_blocks;
+		    n_blocks = n_next;
+		}
+
+		// Write the last batch
+		for (size_t i = 0; i < n_done; ++i) {
+		    for (size_t j = 0; j < n_done_chunks[i]; ++j) {
+			output.Write(done_chunks[i][j]);
+		    }
+		}
+	    } catch (...) {
+		// The running tasks use the buffers of this block
+#pragma omp taskwait
+		error = std::current_exception();
+	    }
+	}
+    }
+    if (error) {
+	std::rethrow_exception(error);
+    }
+    output.Finish();
+#else
+    BufferedPackFormat<F>(n_refs, n_reads, chunk_policy, in, out);
+#endif
+}
 
-    // Next settings provide the lowest size (see BitMagic documentation/examples)
+template <Format F>
+void BucketedPackFormat(const size_t n_refs, const size_t n_reads, const ChunkPolicy &chunk_policy, const size_t memory_budget, const std::string &temp_dir, std::istream *in, std::ostream *out) {
+    // Distribute the lines to buckets of consecutive read ids
+    if (n_reads == UNKNOWN_DIMENSION) {
+	throw std::runtime_error("the number of reads is required for packing unsorted input");
+    }
+    const ChunkPolicy &policy = ResolvePolicy(chunk_policy, n_refs, n_reads);
+    if (n_refs != UNKNOWN_DIMENSION) {
+	CheckInput(n_refs, n_reads, policy.relative);
+    }
+    const size_t n_buckets = std::max((size_t)1, std::min(n_reads, PACK_BUCKETS));
+    const size_t bucket_width = (n_reads + n_buckets - 1)/n_buckets;
+    std::vector<std::vector<char>> buckets(n_buckets);
+    std::vector<char> spilled(n_buckets, false);
+    std::unique_ptr<BucketFiles> files;
+    size_t bytes_in_memory = 0;
+    run_stats::StageTimer timer(RunStats::parse);
+
+    ForEachLine(in, [&](const char *begin, const char *end) {
+	const size_t read_id = LineReadId<F>(begin, end, 0);
+	std::vector<char> &bucket = buckets[std::min(read_id/std::max(bucket_width, (size_t)1), n_buckets - 1)];
+	bucket.insert(bucket.end(), begin, end);
+	bucket.emplace_back('\n');
+	bytes_in_memory += (end - begin) + 1;
+
+	if (bytes_in_memory > memory_budget) {
+	    // Move all buckets to their files
+	    if (!files) {
+		files.reset(new BucketFiles(temp_dir));
+	    }
+	    for (size_t i = 0; i < n_buckets; ++i) {
+		if (!buckets[i].empty()) {
+		    run_stats::StageTimer timer(RunStats::write);
+		    files->Append(i, buckets[i]);
+		    spilled[i] = true;
+		    buckets[i].clear();
+		    buckets[i].shrink_to_fit();
+		}
+	    }
+	    bytes_in_memory = 0;
+	}
+    });
+
+    // Sort the lines of each bucket by read id and pack them as if they were read from sorted input
+    PackOutput output(n_refs, n_reads, policy, out);
     bm::serializer<bm::bvector<>> bvs;
-    bvs.byte_order_serialization(false);
-    bvs.gap_length_serialization(false);
+    ConfigureSerializer(&bvs, policy.compression);
+    ChunkBuilder builder(n_refs, policy.relative);
+    BuiltChunk chunk;
 
-    bm::bvector<> bits;
-    bits.set_new_blocks_strat(bm::BM_GAP);
-    bm::bvector<>::bulk_insert_iterator it(bits);
+    std::vector<char> lines;
+    std::vector<std::tuple<size_t, const char*, const char*>> order; // Read id, start and end of each line
+    for (size_t i = 0; i < n_buckets; ++i) {
+	lines.clear();
+	if (spilled[i]) {
+	    run_stats::StageTimer timer(RunStats::read);
+	    files->Read(i, &lines);
+	}
+	lines.insert(lines.end(), buckets[i].begin(), buckets[i].end());
+	std::vector<char>().swap(buckets[i]);
+
+	order.clear();
+	ForEachLineInBlock(lines.data(), lines.data() + lines.size(), [&](const char *begin, const char *end) {
+	    order.emplace_back(LineReadId<F>(begin, end, 0), begin, end);
+	});
+	std::stable_sort(order.begin(), order.end(), [](const auto &a, const auto &b) { return std::get<0>(a) < std::get<0>(b); });
+
+	for (const auto &line : order) {
+	    if (builder.CloseBefore<F>(std::get<1>(line), std::get<2>(line), 0, policy)) {
+		builder.Serialize(bvs, &chunk);
+		output.Write(chunk);
+	    }
+	    builder.AddLine<F>(std::get<1>(line), std::get<2>(line), 0);
+	}
+    }
+
+    // Write the remaining bits
+    builder.Serialize(bvs, &chunk);
+    output.Write(chunk);
+    output.Finish();
+}
 
-    std::function<size_t(const std::string &line, const size_t n_refs, bm::bvector<>::bulk_insert_iterator *it, size_t read_id)> parser;
+void BucketedPack(const Format &format, const size_t n_refs, const size_t n_reads, const ChunkPolicy &policy, const size_t memory_budget, const std::string &temp_dir, std::istream *in, std::ostream *out) {
     if (format == themisto) {
-	parser = ThemistoParser;
+	BucketedPackFormat<themisto>(n_refs, n_reads, policy, memory_budget, temp_dir, in, out);
     } else if (format == fulgor) {
-	parser = FulgorParser;
+	// The read ids are given by the line numbers
+	BufferedPackFormat<fulgor>(n_refs, n_reads, policy, in, out);
     } else {
 	throw std::runtime_error("Unrecognized input format.");
     }
+}
 
-    size_t line_number = 0;
-    size_t n_in_buffer = 0;
-    std::string line;
-    while (std::getline(*in, line)) {
-	// Parse the line
-	n_in_buffer += parser(line, n_refs, &it, line_number);
+void BufferedPack(const Format &format, const size_t n_refs, const size_t n_reads, const ChunkPolicy &policy, std::istream *in, std::ostream *out) {
+    // Select the parser at compile time so there is no indirect call per line
+    if (format == themisto) {
+	BufferedPackFormat<themisto>(n_refs, n_reads, policy, in, out);
+    } else if (format == fulgor) {
+	BufferedPackFormat<fulgor>(n_refs, n_reads, policy, in, out);
+    } else {
+	throw std::runtime_error("Unrecognized input format.");
+    }
+}
 
-	if (n_in_buffer > buffer_size) {
-  	    // Force flush on the inserter to ensure everything is saved
-	    it.flush();
+void BufferedPack(const Format &format, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::istream *in, std::ostream *out) {
+    ChunkPolicy policy;
+    policy.size = buffer_size;
+    BufferedPack(format, n_refs, n_reads, policy, in, out);
+}
 
-	    WriteBuffer(bits, bvs, out);
-	    bits.clear(true);
-	    bits.set_new_blocks_strat(bm::BM_GAP);
-	    n_in_buffer = 0;
+void ParallelBufferedPack(const Format &format, const size_t n_refs, const size_t n_reads, const ChunkPolicy &policy, std::istream *in, std::ostream *out) {
+    if (format == themisto) {
+	ParallelBufferedPackFormat<themisto>(n_refs, n_reads, policy, in, out);
+    } else if (format == fulgor) {
+	ParallelBufferedPackFormat<fulgor>(n_refs, n_reads, policy, in, out);
+    } else {
+	throw std::runtime_error("Unrecognized input format.");
+    }
+}
+
+void ParallelBufferedPack(const Format &format, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::istream *in, std::ostream *out) {
+    ChunkPolicy policy;
+    policy.size = buffer_size;
+    ParallelBufferedPack(format, n_refs, n_reads, policy, in, out);
+}
+
+// Writes the chunks of all SubWriters of a PackWriter
+class PackWriter::Output {
+public:
+    Output(const size_t n_refs, const size_t n_reads, const ChunkPolicy &chunk_policy, std::ostream *out)
+	: policy(ResolvePolicy(chunk_policy, n_refs, n_reads)), n_refs(n_refs), output(n_refs, n_reads, this->policy, out) {}
+
+    void Write(const BuiltChunk &chunk) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->output.Write(chunk);
+    }
+
+    ChunkPolicy policy;
+    size_t n_refs;
+    PackOutput output;
+    std::mutex mutex;
+};
+
+class PackWriter::SubWriter::Impl {
+public:
+    Impl(PackWriter::Output *_output) : output(_output), building(new Slot(_output)), serializing(new Slot(_output)) {}
+
+    void AddRead(const size_t read_id, const uint32_t *refs, const size_t n) {
+	if (this->building->builder.CloseBefore(read_id, this->output->policy)) {
+	    this->CloseChunk();
 	}
-	++line_number;
+	this->building->builder.AddRead(read_id, refs, n);
     }
 
-    // Write the remaining bits
-    it.flush();
-    WriteBuffer(bits, bvs, out);
-    out->flush(); // Flush
+    // Write the last chunk, empty chunks are written only if `always` is set
+    void Close(const bool always) {
+	this->Wait();
+	if (always || !this->building->builder.empty()) {
+	    this->building->Write(this->output);
+	}
+    }
+
+private:
+    // A chunk that is being built or serialized
+    struct Slot {
+	Slot(const PackWriter::Output *output) : builder(output->n_refs, output->policy.relative) { ConfigureSerializer(&this->bvs, output->policy.compression); }
+
+	void Write(PackWriter::Output *output) {
+	    this->builder.Serialize(this->bvs, &this->chunk);
+	    output->Write(this->chunk);
+	}
+
+	ChunkBuilder builder;
+	bm::serializer<bm::bvector<>> bvs;
+	BuiltChunk chunk;
+    };
+
+    void CloseChunk() {
+	// Serialize the full chunk in the background once the previous one has been written
+	this->Wait();
+	this->building.swap(this->serializing);
+	this->pending = std::async(std::launch::async, [this]() { this->serializing->Write(this->output); });
+    }
+
+    void Wait() {
+	if (this->pending.valid()) {
+	    this->pending.get();
+	}
+    }
+
+    PackWriter::Output *output;
+    std::unique_ptr<Slot> building;
+    std::unique_ptr<Slot> serializing;
+    std::future<void> pending;
+};
+
+PackWriter::SubWriter::SubWriter(Impl *_impl) : impl(_impl) {}
+PackWriter::SubWriter::~SubWriter() = default;
+
+void PackWriter::SubWriter::AddRead(const size_t read_id, const uint32_t *refs, const size_t n) {
+    this->impl->AddRead(read_id, refs, n);
 }
 
-void Pack(const bm::bvector<> &bits, const size_t n_refs, const size_t n_reads, std::ostream *out) {
+void PackWriter::SubWriter::AddBatch(const size_t n, const size_t *read_ids, const size_t *offsets, const uint32_t *refs) {
+    for (size_t i = 0; i < n; ++i) {
+	this->impl->AddRead(read_ids[i], refs + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+}
+
+PackWriter::PackWriter(const size_t n_refs, const size_t n_reads, const ChunkPolicy &policy, std::ostream *out) : output(new Output(n_refs, n_reads, policy, out)) {
+    this->main = &this->NewSubWriter();
+}
+
+PackWriter::~PackWriter() = default;
+
+PackWriter::SubWriter& PackWriter::NewSubWriter() {
+    std::lock_guard<std::mutex> lock(this->output->mutex);
+    this->writers.emplace_back(new SubWriter(new SubWriter::Impl(this->output.get())));
+    return *this->writers.back();
+}
+
+void PackWriter::Finish() {
+    // The last chunk of the main writer is always written like in BufferedPack
+    for (size_t i = 0; i < this->writers.size(); ++i) {
+	this->writers[i]->impl->Close(i == 0);
+    }
+    this->output->output.Finish();
+}
+
+void Pack(const bm::bvector<> &bits, const size_t n_refs, const size_t n_reads, std::ostream *out, const CompressionProfile &compression) {
     // Pack a pseudoalignment that has been stored in memory
     // Write info about the pseudoalignment
     CheckInput(n_refs, n_reads);
-    WriteHeader(n_refs, n_reads, out);
+    ChunkWriter writer(n_refs, n_reads, out);
+
+    bm::serializer<bm::bvector<>> bvs;
+    ConfigureSerializer(&bvs, compression);
+
+    SerializedChunk chunk;
+    bvs.serialize(bits, chunk.data);
+
+    // Read range of the single chunk is given by the first and last set bits
+    chunk.first_read = std::numeric_limits<size_t>::max();
+    chunk.last_read = 0;
+    bm::bvector<>::size_type first_bit, last_bit;
+    if (bits.find(first_bit) && bits.find_reverse(last_bit)) {
+	chunk.first_read = first_bit/n_refs;
+	chunk.last_read = last_bit/n_refs;
+    }
+
+    writer.WriteBuffer(chunk);
+    writer.Finish();
+}
+
+bm::bvector<> Transpose(const bm::bvector<> &bits, const size_t n_rows, const size_t n_cols) {
+    bm::bvector<> transposed(n_rows*n_cols, bm::BM_GAP);
+    bm::bvector<>::bulk_insert_iterator it(transposed);
+    for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+	const size_t row = (*en)/n_cols;
+	it = ((*en) - row*n_cols)*n_rows + row;
+    }
+    it.flush();
+    return transposed;
+}
+
+void WriteReferenceMajor(const bm::bvector<> &transposed, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, const CompressionProfile &compression, std::ostream *out) {
+    // Write a pseudoalignment stored at `ref_id*n_reads + read_id` in chunks of whole references
+    ChunkWriter writer(n_refs, n_reads, out, REFERENCE_MAJOR_FLAG);
 
-    // Next settings provide the lowest size (see BitMagic documentation/examples)
     bm::serializer<bm::bvector<>> bvs;
-    bvs.byte_order_serialization(false);
-    bvs.gap_length_serialization(false);
+    ConfigureSerializer(&bvs, compression);
+
+    SerializedChunk chunk;
+    size_t first_ref = 0;
+    size_t n_in_chunk = 0;
+    for (size_t ref = 0; ref < n_refs && n_reads > 0; ++ref) {
+	n_in_chunk += transposed.count_range(ref*n_reads, ref*n_reads + n_reads - 1);
+	if (n_in_chunk > buffer_size || ref == n_refs - 1) {
+	    run_stats::StageTimer timer(RunStats::serialize);
+	    bm::bvector<> part;
+	    part.copy_range(transposed, first_ref*n_reads, ref*n_reads + n_reads - 1);
+	    bvs.serialize(part, chunk.data);
+	    chunk.first_read = first_ref;
+	    chunk.last_read = ref;
+	    writer.WriteBuffer(chunk);
+
+	    first_ref = ref + 1;
+	    n_in_chunk = 0;
+	}
+    }
+    writer.Finish();
+}
+
+void CheckKnownDimensions(const size_t n_refs, const size_t n_reads, const std::string &layout) {
+    if (n_refs == UNKNOWN_DIMENSION || n_reads == UNKNOWN_DIMENSION) {
+	throw std::runtime_error("the number of reads and references are required for packing in the " + layout + " layout");
+    }
+}
+
+void PackReferenceMajor(const bm::bvector<> &bits, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::ostream *out, const CompressionProfile &compression) {
+    CheckKnownDimensions(n_refs, n_reads, "reference-major");
+    CheckInput(n_refs, n_reads);
+    WriteReferenceMajor(Transpose(bits, n_reads, n_refs), n_refs, n_reads, buffer_size, compression, out);
+}
+
+template <Format F>
+void BufferedPackReferenceMajorFormat(const size_t n_refs, const size_t n_reads, const size_t &buffer_size, const CompressionProfile &compression, std::istream *in, std::ostream *out) {
+    // Parse the lines directly into the reference-major layout
+    CheckKnownDimensions(n_refs, n_reads, "reference-major");
+    CheckInput(n_refs, n_reads);
+    bm::bvector<> transposed(n_reads*n_refs, bm::BM_GAP);
+    {
+	run_stats::StageTimer timer(RunStats::parse);
+	bm::bvector<>::bulk_insert_iterator it(transposed);
+	size_t line_number = 0;
+	size_t n_alignments = 0;
+	size_t n_text_bytes = 0;
+	ForEachLine(in, [&](const char *begin, const char *end) {
+	    size_t read_id = line_number;
+	    n_alignments += ParseLine<F>(begin, end, read_id, [&](const size_t ref_id) {
+		// An id out of range would land in the row of another reference
+		if (ref_id >= n_refs) {
+		    throw std::out_of_range("reference id " + std::to_string(ref_id) + " is not less than the number of references");
+		}
+		if (read_id >= n_reads) {
+		    throw std::out_of_range("read id " + std::to_string(read_id) + " is not less than the number of reads");
+		}
+		it = ref_id*n_reads + read_id;
+	    });
+	    n_text_bytes += end - begin + 1;
+	    ++line_number;
+	});
+	run_stats::StageTimer flush_timer(RunStats::flush);
+	it.flush();
+	run_stats::Count(run_stats::lines, line_number);
+	run_stats::Count(run_stats::alignments, n_alignments);
+	run_stats::Count(run_stats::text_bytes, n_text_bytes);
+    }
+    WriteReferenceMajor(transposed, n_refs, n_reads, buffer_size, compression, out);
+}
+
+void BufferedPackReferenceMajor(const Format &format, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::istream *in, std::ostream *out, const CompressionProfile &compression) {
+    if (format == themisto) {
+	BufferedPackReferenceMajorFormat<themisto>(n_refs, n_reads, buffer_size, compression, in, out);
+    } else if (format == fulgor) {
+	BufferedPackReferenceMajorFormat<fulgor>(n_refs, n_reads, buffer_size, compression, in, out);
+    } else {
+	throw std::runtime_error("Unrecognized input format.");
+    }
+}
+
+// Collects the class ids of the reads parsed from input lines
+class ClassChunkBuilder {
+public:
+    ClassChunkBuilder(const size_t _n_refs, const CompressionProfile &_compression, EquivalenceClasses *_classes) : n_refs(_n_refs), compression(_compression), classes(_classes) {}
+
+    // Add a read with the references in `refs`, reads without references are not stored
+    void AddRead(const size_t read_id, std::vector<uint32_t> &refs) {
+	if (refs.empty()) {
+	    return;
+	}
+	std::sort(refs.begin(), refs.end());
+	refs.erase(std::unique(refs.begin(), refs.end()), refs.end());
+	if (refs.back() >= this->n_refs) {
+	    // The dictionary would place the reference in the next class
+	    throw std::out_of_range("reference id " + std::to_string(refs.back()) + " is not less than the number of references");
+	}
+	this->reads.emplace_back(read_id, this->classes->Insert(refs));
+	this->n_in_buffer += refs.size();
+    }
 
-    WriteBuffer(bits, bvs, out);
-    out->flush(); // Flush
+    // Number of pseudoalignments in the chunk
+    size_t size() const { return this->n_in_buffer; }
+
+    // Serialize the chunk into `chunk` and start a new one
+    void Serialize(SerializedChunk *chunk) {
+	run_stats::StageTimer timer(RunStats::serialize);
+	run_stats::Count(run_stats::alignments, this->n_in_buffer);
+	// The class ids are inserted in read order
+	std::sort(this->reads.begin(), this->reads.end());
+	ClassIds ids;
+	for (const std::pair<size_t, uint32_t> &read : this->reads) {
+	    ids.push_back(read.first, read.second);
+	}
+	ids.optimize();
+	SerializeClassIds(ids, this->reads.front().first, this->reads.back().first, this->compression, chunk);
+	this->reads.clear();
+	this->n_in_buffer = 0;
+    }
+
+private:
+    size_t n_refs;
+    CompressionProfile compression;
+    EquivalenceClasses *classes;
+    std::vector<std::pair<size_t, uint32_t>> reads;
+    size_t n_in_buffer = 0;
+};
+
+void WriteEquivalenceClasses(const EquivalenceClasses &classes, const std::vector<SerializedChunk> &chunks, const size_t n_refs, const size_t n_reads, const CompressionProfile &compression, std::ostream *out) {
+    // The dictionary is written before the chunks that use it
+    ChunkWriter writer(n_refs, n_reads, out, EQUIVALENCE_CLASS_FLAG);
+    SerializedChunk dictionary;
+    classes.Serialize(n_refs, compression, &dictionary);
+    writer.WriteBuffer(dictionary);
+    for (const SerializedChunk &chunk : chunks) {
+	writer.WriteBuffer(chunk);
+    }
+    writer.Finish();
+}
+
+void PackEquivalenceClasses(const bm::bvector<> &bits, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::ostream *out, const CompressionProfile &compression) {
+    CheckKnownDimensions(n_refs, n_reads, "equivalence class");
+    CheckInput(n_refs, n_reads);
+    EquivalenceClasses classes;
+    ClassChunkBuilder builder(n_refs, compression, &classes);
+    std::vector<SerializedChunk> chunks;
+
+    // Collect the references of each read from its row
+    std::vector<uint32_t> refs;
+    size_t read_id = 0;
+    for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+	if ((*en)/n_refs != read_id) {
+	    builder.AddRead(read_id, refs);
+	    refs.clear();
+	    if (builder.size() > buffer_size) {
+		chunks.emplace_back(SerializedChunk());
+		builder.Serialize(&chunks.back());
+	    }
+	    read_id = (*en)/n_refs;
+	}
+	refs.emplace_back((*en) - read_id*n_refs);
+    }
+    builder.AddRead(read_id, refs);
+    if (builder.size() > 0) {
+	chunks.emplace_back(SerializedChunk());
+	builder.Serialize(&chunks.back());
+    }
+
+    WriteEquivalenceClasses(classes, chunks, n_refs, n_reads, compression, out);
+}
+
+template <Format F>
+void BufferedPackEquivalenceClassesFormat(const size_t n_refs, const size_t n_reads, const size_t &buffer_size, const CompressionProfile &compression, std::istream *in, std::ostream *out) {
+    // The chunks are written after the dictionary so unknown dimensions can be taken from the input
+    if (n_refs != UNKNOWN_DIMENSION && n_reads != UNKNOWN_DIMENSION) {
+	CheckInput(n_refs, n_reads);
+    }
+    EquivalenceClasses classes;
+    ClassChunkBuilder builder(n_refs, compression, &classes);
+    std::vector<SerializedChunk> chunks;
+
+    std::vector<uint32_t> refs;
+    size_t line_number = 0;
+    size_t n_refs_seen = 0;
+    size_t n_reads_seen = 0;
+    size_t n_text_bytes = 0;
+    run_stats::StageTimer timer(RunStats::parse);
+    ForEachLine(in, [&](const char *begin, const char *end) {
+	n_text_bytes += end - begin + 1;
+	size_t read_id = line_number;
+	ParseLine<F>(begin, end, read_id, [&](const size_t ref_id) {
+	    refs.emplace_back(ref_id);
+	    n_refs_seen = std::max(n_refs_seen, ref_id + 1);
+	});
+	n_reads_seen = std::max(n_reads_seen, read_id + 1);
+	builder.AddRead(read_id, refs);
+	refs.clear();
+	if (builder.size() > buffer_size) {
+	    chunks.emplace_back(SerializedChunk());
+	    builder.Serialize(&chunks.back());
+	}
+	++line_number;
+    });
+    if (builder.size() > 0) {
+	chunks.emplace_back(SerializedChunk());
+	builder.Serialize(&chunks.back());
+    }
+
+    run_stats::Count(run_stats::lines, line_number);
+    run_stats::Count(run_stats::text_bytes, n_text_bytes);
+    const size_t n_refs_packed = (n_refs == UNKNOWN_DIMENSION ? n_refs_seen : n_refs);
+    const size_t n_reads_packed = (n_reads == UNKNOWN_DIMENSION ? n_reads_seen : n_reads);
+    CheckInput(n_refs_packed, n_reads_packed);
+    WriteEquivalenceClasses(classes, chunks, n_refs_packed, n_reads_packed, compression, out);
+}
+
+void BufferedPackEquivalenceClasses(const Format &format, const size_t n_refs, const size_t n_reads, const size_t &buffer_size, std::istream *in, std::ostream *out, const CompressionProfile &compression) {
+    if (format == themisto) {
+	BufferedPackEquivalenceClassesFormat<themisto>(n_refs, n_reads, buffer_size, compression, in, out);
+    } else if (format == fulgor) {
+	BufferedPackEquivalenceClassesFormat<fulgor>(n_refs, n_reads, buffer_size, compression, in, out);
+    } else {
+	throw std::runtime_error("Unrecognized input format.");
+    }
 }
 }
@@ -0,0 +1,202 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "query.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include "bmaggregator.h"
+#include "bmserial.h"
+
+#include "chunk_source.hpp"
+#include "chunk_writer.hpp"
+#include "equivalence_classes.hpp"
+#include "file_format.hpp"
+#include "text_writer.hpp"
+#include "unpack.hpp"
+
+namespace alignment_writer {
+std::vector<size_t> QueryReferences(const ReferenceQuery &query) {
+    // Sorted list of the distinct references in `query`
+    std::vector<size_t> ref_ids(query.any_of);
+    ref_ids.insert(ref_ids.end(), query.all_of.begin(), query.all_of.end());
+    ref_ids.insert(ref_ids.end(), query.none_of.begin(), query.none_of.end());
+    std::sort(ref_ids.begin(), ref_ids.end());
+    ref_ids.erase(std::unique(ref_ids.begin(), ref_ids.end()), ref_ids.end());
+    return ref_ids;
+}
+
+bm::bvector<> SelectReads(const ReferenceQuery &query, const std::vector<size_t> &ref_ids, const std::vector<bm::bvector<>> &reads, const size_t n_reads) {
+    // Find the read set of a reference in the query
+    auto reads_of = [&](const size_t ref_id) {
+	const size_t i = std::lower_bound(ref_ids.begin(), ref_ids.end(), ref_id) - ref_ids.begin();
+	if (i == ref_ids.size() || ref_ids[i] != ref_id) {
+	    throw std::invalid_argument("reference " + std::to_string(ref_id) + " is not in `ref_ids`");
+	}
+	return &reads[i];
+    };
+
+    bm::aggregator<bm::bvector<>> agg;
+    bm::bvector<> candidates(n_reads);
+    if (query.any_of.empty()) {
+	if (n_reads > 0) {
+	    candidates.set_range(0, n_reads - 1);
+	}
+    } else {
+	// OR of the `any_of` references
+	for (const size_t ref_id : query.any_of) {
+	    agg.add(reads_of(ref_id));
+	}
+	agg.combine_or(candidates);
+	agg.reset();
+    }
+
+    // AND of the candidates and the `all_of` references minus the `none_of` references in one pass
+    bm::bvector<> selected(n_reads);
+    agg.add(&candidates, 0);
+    for (const size_t ref_id : query.all_of) {
+	agg.add(reads_of(ref_id), 0);
+    }
+    for (const size_t ref_id : query.none_of) {
+	agg.add(reads_of(ref_id), 1);
+    }
+    agg.combine_and_sub(selected);
+    return selected;
+}
+
+bm::bvector<> QueryReads(std::istream *in, const ReferenceQuery &query, size_t *n_reads, size_t *n_refs) {
+    const std::vector<size_t> &ref_ids = QueryReferences(query);
+    const std::vector<bm::bvector<>> &reads = UnpackReferences(in, ref_ids, n_reads, n_refs);
+    return SelectReads(query, ref_ids, reads, *n_reads);
+}
+
+void PrintQuery(std::istream *in, const ReferenceQuery &query, std::ostream *out) {
+    size_t n_reads;
+    size_t n_refs;
+    const bm::bvector<> &selected = QueryReads(in, query, &n_reads, &n_refs);
+
+    // Write the read ids in blocks
+    std::vector<char> buffer(65536);
+    size_t pos = 0;
+    for (bm::bvector<>::enumerator en = selected.first(); en.valid(); ++en) {
+	if (pos + MAX_NUMBER_DIGITS + 1 > buffer.size()) {
+	    out->write(buffer.data(), pos);
+	    pos = 0;
+	}
+	char *line = FormatNumber(*en, buffer.data() + pos);
+	*(line++) = '\n';
+	pos = line - buffer.data();
+    }
+    out->write(buffer.data(), pos);
+    out->flush();
+}
+
+void QueryPack(std::istream *in, const ReferenceQuery &query, std::ostream *out, const CompressionProfile &compression) {
+    const FileHeader &header = ReadFileHeader(in);
+    CheckDimensions(header);
+    if (header.flags & REFERENCE_MAJOR_FLAG) {
+	throw std::runtime_error("packed query output is not supported for reference-major files");
+    }
+    const size_t n_refs = header.n_refs;
+
+    const std::vector<size_t> &ref_ids = QueryReferences(query);
+    for (const size_t ref_id : ref_ids) {
+	if (ref_id >= n_refs) {
+	    throw std::out_of_range("reference id " + std::to_string(ref_id) + " is not in the alignment");
+	}
+    }
+    std::vector<size_t> position(n_refs, ref_ids.size()); // Position of each reference in `ref_ids`
+    for (size_t i = 0; i < ref_ids.size(); ++i) {
+	position[ref_ids[i]] = i;
+    }
+
+    ChunkWriter writer(n_refs, header.n_reads, out);
+    std::vector<SerializedChunk> chunks(ChunkSlots());
+    std::vector<char> has_reads(ChunkSlots());
+
+    StreamChunks source(in, header);
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(source);
+    ForEachChunkInParallel(source, [&](const size_t slot, const ChunkInfo &info, const unsigned char *chunk) {
+	bm::bvector<> bits;
+	decoder.Deserialize(info, chunk, &bits);
+	bm::bvector<>::size_type first_bit, last_bit;
+	has_reads[slot] = bits.find(first_bit) && bits.find_reverse(last_bit);
+	if (!has_reads[slot]) {
+	    return;
+	}
+	const size_t first_read = first_bit/n_refs;
+	const size_t last_read = last_bit/n_refs;
+
+	// Read sets of the query references in this chunk
+	std::vector<bm::bvector<>> reads(ref_ids.size());
+	for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+	    const size_t read_id = (*en)/n_refs;
+	    const size_t i = position[(*en) - read_id*n_refs];
+	    if (i < ref_ids.size()) {
+		reads[i].set(read_id);
+	    }
+	}
+	bm::bvector<> selected = SelectReads(query, ref_ids, reads, header.n_reads);
+	selected.keep_range(first_read, last_read);
+
+	// Keep the rows of the selected reads
+	bm::bvector<> rows;
+	for (bm::bvector<>::enumerator en = selected.first(); en.valid(); ++en) {
+	    rows.set_range((*en)*n_refs, (*en)*n_refs + n_refs - 1);
+	}
+	bits &= rows;
+
+	bm::serializer<bm::bvector<>> bvs;
+	ConfigureSerializer(&bvs, compression);
+	bvs.serialize(bits, chunks[slot].data);
+	chunks[slot].first_read = std::numeric_limits<size_t>::max();
+	chunks[slot].last_read = 0;
+	has_reads[slot] = bits.find(first_bit) && bits.find_reverse(last_bit);
+	if (has_reads[slot]) {
+	    chunks[slot].first_read = first_bit/n_refs;
+	    chunks[slot].last_read = last_bit/n_refs;
+	}
+    }, [&](const size_t slot, const ChunkInfo &) {
+	if (has_reads[slot]) {
+	    writer.WriteBuffer(chunks[slot]);
+	}
+    });
+    writer.Finish();
+}
+}
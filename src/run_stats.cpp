@@ -0,0 +1,189 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "run_stats.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+
+#include <sys/resource.h>
+
+namespace alignment_writer {
+// Number of chunk size classes in the histogram
+constexpr size_t CHUNK_SIZE_CLASSES = 64;
+
+namespace run_stats {
+std::atomic<bool> enabled(false);
+
+std::atomic<uint64_t> stage_nanoseconds[RunStats::n_stages];
+std::atomic<uint64_t> counters[n_counters];
+std::atomic<uint64_t> chunk_sizes[CHUNK_SIZE_CLASSES];
+std::atomic<uint64_t> chunk_bytes;
+
+// Innermost running StageTimer on this thread
+thread_local StageTimer *active = nullptr;
+
+void AddCount(const Counter counter, const size_t n) {
+    counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void AddChunk(const size_t bytes) {
+    size_t size_class = 0;
+    while (size_class + 1 < CHUNK_SIZE_CLASSES && (bytes >> (size_class + 1)) > 0) {
+	++size_class;
+    }
+    chunk_sizes[size_class].fetch_add(1, std::memory_order_relaxed);
+    chunk_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void StageTimer::Start() {
+    this->running = true;
+    this->parent = active;
+    active = this;
+    this->start = std::chrono::steady_clock::now();
+}
+
+void StageTimer::Stop() {
+    const std::chrono::steady_clock::duration &elapsed = std::chrono::steady_clock::now() - this->start;
+    active = this->parent;
+    if (this->parent != nullptr) {
+	this->parent->nested += elapsed;
+    }
+    const uint64_t own = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed - this->nested).count();
+    stage_nanoseconds[this->stage].fetch_add(own, std::memory_order_relaxed);
+}
+}
+
+const char* RunStats::StageName(const Stage stage) {
+    static const char *names[n_stages] = { "read", "parse", "flush", "serialize", "deserialize", "format", "write" };
+    return names[stage];
+}
+
+StatsCollector::StatsCollector() {
+    if (run_stats::enabled.load()) {
+	throw std::runtime_error("only one StatsCollector may exist at a time");
+    }
+    for (size_t i = 0; i < RunStats::n_stages; ++i) {
+	run_stats::stage_nanoseconds[i] = 0;
+    }
+    for (size_t i = 0; i < run_stats::n_counters; ++i) {
+	run_stats::counters[i] = 0;
+    }
+    for (size_t i = 0; i < CHUNK_SIZE_CLASSES; ++i) {
+	run_stats::chunk_sizes[i] = 0;
+    }
+    run_stats::chunk_bytes = 0;
+    this->start = std::chrono::steady_clock::now();
+    run_stats::enabled.store(true);
+}
+
+StatsCollector::~StatsCollector() {
+    run_stats::enabled.store(false);
+}
+
+RunStats StatsCollector::Stats() const {
+    RunStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+    for (size_t i = 0; i < RunStats::n_stages; ++i) {
+	stats.stage_seconds[i] = run_stats::stage_nanoseconds[i].load()/1e9;
+    }
+    stats.bytes_in = run_stats::counters[run_stats::bytes_in].load();
+    stats.bytes_out = run_stats::counters[run_stats::bytes_out].load();
+    stats.text_bytes = run_stats::counters[run_stats::text_bytes].load();
+    stats.lines = run_stats::counters[run_stats::lines].load();
+    stats.alignments = run_stats::counters[run_stats::alignments].load();
+    stats.chunk_bytes = run_stats::chunk_bytes.load();
+
+    // The histogram ends at the largest chunk
+    for (size_t i = 0; i < CHUNK_SIZE_CLASSES; ++i) {
+	stats.chunk_sizes.emplace_back(run_stats::chunk_sizes[i].load());
+	stats.chunks += stats.chunk_sizes.back();
+    }
+    while (!stats.chunk_sizes.empty() && stats.chunk_sizes.back() == 0) {
+	stats.chunk_sizes.pop_back();
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+	stats.peak_rss_kb = usage.ru_maxrss;
+    }
+    return stats;
+}
+
+void PrintRunStats(const RunStats &stats, std::ostream *out) {
+    *out << "seconds\t" << stats.seconds << '\n';
+    for (size_t i = 0; i < RunStats::n_stages; ++i) {
+	*out << RunStats::StageName((RunStats::Stage)i) << "_seconds\t" << stats.stage_seconds[i] << '\n';
+    }
+    *out << "bytes_in\t" << stats.bytes_in << '\n'
+	 << "bytes_out\t" << stats.bytes_out << '\n'
+	 << "text_bytes\t" << stats.text_bytes << '\n'
+	 << "lines\t" << stats.lines << '\n'
+	 << "alignments\t" << stats.alignments << '\n'
+	 << "chunks\t" << stats.chunks << '\n'
+	 << "chunk_bytes\t" << stats.chunk_bytes << '\n'
+	 << "compression_ratio\t" << stats.CompressionRatio() << '\n'
+	 << "peak_rss_kb\t" << stats.peak_rss_kb << '\n';
+    *out << "#chunks_by_size\n";
+    // Smallest size in each size class with at least one chunk
+    for (size_t i = 0; i < stats.chunk_sizes.size(); ++i) {
+	if (stats.chunk_sizes[i] > 0) {
+	    *out << ((size_t)1 << i) << '\t' << stats.chunk_sizes[i] << '\n';
+	}
+    }
+    out->flush();
+}
+
+void WriteRunStatsJson(const RunStats &stats, std::ostream *out) {
+    *out << "{\"seconds\": " << stats.seconds << ", \"stage_seconds\": {";
+    for (size_t i = 0; i < RunStats::n_stages; ++i) {
+	*out << (i > 0 ? ", " : "") << '"' << RunStats::StageName((RunStats::Stage)i) << "\": " << stats.stage_seconds[i];
+    }
+    *out << "}, \"bytes_in\": " << stats.bytes_in
+	 << ", \"bytes_out\": " << stats.bytes_out
+	 << ", \"text_bytes\": " << stats.text_bytes
+	 << ", \"lines\": " << stats.lines
+	 << ", \"alignments\": " << stats.alignments
+	 << ", \"chunks\": " << stats.chunks
+	 << ", \"chunk_bytes\": " << stats.chunk_bytes
+	 << ", \"compression_ratio\": " << stats.CompressionRatio()
+	 << ", \"peak_rss_kb\": " << stats.peak_rss_kb
+	 << ", \"chunks_by_size\": [";
+    // Element `i` counts the chunks with [2^i, 2^(i+1)) bytes
+    for (size_t i = 0; i < stats.chunk_sizes.size(); ++i) {
+	*out << (i > 0 ? ", " : "") << stats.chunk_sizes[i];
+    }
+    *out << "]}" << std::endl;
+}
+}
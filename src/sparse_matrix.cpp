@@ -0,0 +1,269 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "sparse_matrix.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+
+#include "file_format.hpp"
+#include "alignment-writer_openmp_config.hpp"
+
+namespace alignment_writer {
+namespace {
+bool LittleEndianHost() {
+    const uint16_t value = 1;
+    return *reinterpret_cast<const unsigned char*>(&value) == 1;
+}
+
+template <typename Index>
+void CheckFits(const size_t value, const std::string &what) {
+    if (value > std::numeric_limits<Index>::max()) {
+	throw std::overflow_error("the " + what + " does not fit in " + std::to_string(8*sizeof(Index)) + "-bit indices");
+    }
+}
+
+template <typename Index>
+void WriteArray(const std::vector<Index> &values, std::ostream *out) {
+    if (LittleEndianHost()) {
+	out->write(reinterpret_cast<const char*>(values.data()), values.size()*sizeof(Index));
+	return;
+    }
+    for (const Index value : values) {
+	WriteLittleEndian(value, sizeof(Index), out);
+    }
+}
+
+// Ranges of reads with about the same number of set bits. Range `i` contains the reads in
+// [first_rows[i], first_rows[i + 1]) and its first set bit is the first_bits[i]th bit of `bits`.
+struct RowRanges {
+    std::vector<size_t> first_rows;
+    std::vector<size_t> first_bits;
+
+    size_t size() const { return this->first_rows.size() - 1; }
+};
+
+RowRanges SplitRows(const bm::bvector<> &bits, const bm::bvector<>::rs_index_type &rs_idx, const size_t n_bits, const size_t n_reads, const size_t n_refs) {
+    size_t n_ranges = 1;
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    // More ranges than threads balance the rows that are slower to enumerate
+    n_ranges = 4*omp_get_max_threads();
+#endif
+    n_ranges = std::max(std::min(n_ranges, std::min(n_bits, n_reads)), (size_t)1);
+
+    RowRanges ranges;
+    ranges.first_rows.assign(n_ranges + 1, 0);
+    ranges.first_rows[n_ranges] = n_reads;
+    for (size_t i = 1; i < n_ranges; ++i) {
+	bm::bvector<>::size_type pos = 0;
+	bits.select(n_bits/n_ranges*i + 1, pos, rs_idx);
+	ranges.first_rows[i] = std::max(ranges.first_rows[i - 1], (size_t)(pos/n_refs));
+    }
+    ranges.first_bits.assign(n_ranges + 1, n_bits);
+    for (size_t i = 0; i < n_ranges; ++i) {
+	ranges.first_bits[i] = (ranges.first_rows[i] == 0 ? 0 : bits.count_to(ranges.first_rows[i]*n_refs - 1, rs_idx));
+    }
+    return ranges;
+}
+
+template <typename Index>
+void FillRows(const bm::bvector<> &bits, const size_t n_refs, const RowRanges &ranges, const size_t range, SparseMatrix<Index> *matrix) {
+    // Write the reference ids of the reads in the range and the offsets of their rows. The bits
+    // are read row by row so the rows are found without dividing each bit position.
+    const size_t first_row = ranges.first_rows[range];
+    const size_t end_row = ranges.first_rows[range + 1];
+    size_t index = ranges.first_bits[range];
+    size_t next_row = first_row; // First row whose offset has not been written
+    size_t row_start = 0;
+    size_t row_end = 0; // First bit after the current row
+    for (bm::bvector<>::enumerator en = bits.get_enumerator(first_row*n_refs); en.valid() && *en < end_row*n_refs; ++en) {
+	if (*en >= row_end) {
+	    const size_t row = (*en)/n_refs;
+	    while (next_row <= row) {
+		matrix->offsets[next_row++] = index;
+	    }
+	    row_start = row*n_refs;
+	    row_end = row_start + n_refs;
+	}
+	matrix->indices[index++] = (*en) - row_start;
+    }
+    while (next_row < end_row) {
+	matrix->offsets[next_row++] = index;
+    }
+}
+
+void CountColumns(const bm::bvector<> &bits, const size_t n_refs, const RowRanges &ranges, const size_t range, std::vector<size_t> *counts) {
+    counts->assign(n_refs, 0);
+    const size_t end_bit = ranges.first_rows[range + 1]*n_refs;
+    size_t row_start = 0;
+    size_t row_end = 0;
+    for (bm::bvector<>::enumerator en = bits.get_enumerator(ranges.first_rows[range]*n_refs); en.valid() && *en < end_bit; ++en) {
+	if (*en >= row_end) {
+	    row_start = ((*en)/n_refs)*n_refs;
+	    row_end = row_start + n_refs;
+	}
+	++(*counts)[(*en) - row_start];
+    }
+}
+
+template <typename Index>
+void FillColumns(const bm::bvector<> &bits, const size_t n_refs, const RowRanges &ranges, const size_t range, std::vector<size_t> *positions, SparseMatrix<Index> *matrix) {
+    // Append the reads in the range to the columns of their references, `positions` contains
+    // the next free index in each column for this range
+    const size_t end_bit = ranges.first_rows[range + 1]*n_refs;
+    size_t row = 0;
+    size_t row_start = 0;
+    size_t row_end = 0;
+    for (bm::bvector<>::enumerator en = bits.get_enumerator(ranges.first_rows[range]*n_refs); en.valid() && *en < end_bit; ++en) {
+	if (*en >= row_end) {
+	    row = (*en)/n_refs;
+	    row_start = row*n_refs;
+	    row_end = row_start + n_refs;
+	}
+	matrix->indices[(*positions)[(*en) - row_start]++] = row;
+    }
+}
+}
+
+template <typename Index>
+SparseMatrix<Index> ToSparseMatrix(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs, const SparseLayout layout) {
+    SparseMatrix<Index> matrix;
+    matrix.layout = layout;
+    matrix.n_reads = n_reads;
+    matrix.n_refs = n_refs;
+
+    std::unique_ptr<bm::bvector<>::rs_index_type> rs_idx(new bm::bvector<>::rs_index_type());
+    bits.build_rs_index(rs_idx.get());
+    const size_t n_bits = (n_reads == 0 || n_refs == 0 ? 0 : bits.count_to(n_reads*n_refs - 1, *rs_idx));
+    CheckFits<Index>(n_bits, "number of pseudoalignments");
+    CheckFits<Index>((layout == csr ? n_refs : n_reads), (layout == csr ? "number of references" : "number of reads"));
+    matrix.offsets.assign((layout == csr ? n_reads : n_refs) + 1, 0);
+    matrix.indices.resize(n_bits);
+    if (n_bits == 0) {
+	return matrix;
+    }
+
+    const RowRanges &ranges = SplitRows(bits, *rs_idx, n_bits, n_reads, n_refs);
+    if (layout == csr) {
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+	for (size_t i = 0; i < ranges.size(); ++i) {
+	    FillRows(bits, n_refs, ranges, i, &matrix);
+	}
+	matrix.offsets[n_reads] = n_bits;
+	return matrix;
+    }
+
+    // Count the reads of each reference in each range, the columns are then filled in the order of the ranges
+    std::vector<std::vector<size_t>> positions(ranges.size());
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (size_t i = 0; i < ranges.size(); ++i) {
+	CountColumns(bits, n_refs, ranges, i, &positions[i]);
+    }
+    size_t index = 0;
+    for (size_t ref = 0; ref < n_refs; ++ref) {
+	matrix.offsets[ref] = index;
+	for (size_t i = 0; i < ranges.size(); ++i) {
+	    const size_t count = positions[i][ref];
+	    positions[i][ref] = index;
+	    index += count;
+	}
+    }
+    matrix.offsets[n_refs] = index;
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (size_t i = 0; i < ranges.size(); ++i) {
+	FillColumns(bits, n_refs, ranges, i, &positions[i], &matrix);
+    }
+    return matrix;
+}
+
+template <typename Index>
+void WriteSparseMatrix(const SparseMatrix<Index> &matrix, std::ostream *out) {
+    out->write(reinterpret_cast<const char*>(SPARSE_MATRIX_MAGIC), 4);
+    WriteLittleEndian(SPARSE_MATRIX_VERSION, 2, out);
+    WriteLittleEndian(matrix.layout, 1, out);
+    WriteLittleEndian(sizeof(Index), 1, out);
+    WriteLittleEndian(matrix.n_reads, 8, out);
+    WriteLittleEndian(matrix.n_refs, 8, out);
+    WriteLittleEndian(matrix.indices.size(), 8, out);
+    WriteArray(matrix.offsets, out);
+    WriteArray(matrix.indices, out);
+    if (!(*out)) {
+	throw std::runtime_error("could not write the sparse matrix");
+    }
+}
+
+void WriteSparseMatrix(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs, const SparseLayout layout, const size_t index_bytes, std::ostream *out) {
+    if (index_bytes == 4) {
+	WriteSparseMatrix(ToSparseMatrix<uint32_t>(bits, n_reads, n_refs, layout), out);
+    } else if (index_bytes == 8) {
+	WriteSparseMatrix(ToSparseMatrix<uint64_t>(bits, n_reads, n_refs, layout), out);
+    } else {
+	throw std::invalid_argument("sparse matrix indices must have 4 or 8 bytes");
+    }
+}
+
+MappedSparseMatrix::MappedSparseMatrix(const std::string &path) : file(path) {
+    const unsigned char *data = this->file.data();
+    if (this->file.size() < SPARSE_MATRIX_HEADER_SIZE || !std::equal(SPARSE_MATRIX_MAGIC, SPARSE_MATRIX_MAGIC + 4, data)) {
+	throw std::runtime_error(path + " is not a sparse matrix file");
+    }
+    if (DecodeLittleEndian(data + 4, 2) != SPARSE_MATRIX_VERSION) {
+	throw std::runtime_error(path + " has an unsupported sparse matrix format version");
+    }
+    if (!LittleEndianHost()) {
+	throw std::runtime_error("sparse matrix files can only be mapped on little-endian machines");
+    }
+    this->matrix_layout = (data[6] == csc ? csc : csr);
+    this->element_size = data[7];
+    this->n_rows = DecodeLittleEndian(data + 8, 8);
+    this->n_cols = DecodeLittleEndian(data + 16, 8);
+    this->n_indices = DecodeLittleEndian(data + 24, 8);
+    const size_t n_offsets = (this->matrix_layout == csr ? this->n_rows : this->n_cols) + 1;
+    if ((this->element_size != 4 && this->element_size != 8) || this->file.size() != SPARSE_MATRIX_HEADER_SIZE + (n_offsets + this->n_indices)*this->element_size) {
+	throw std::runtime_error(path + " is truncated or corrupted");
+    }
+}
+
+template SparseMatrix<uint32_t> ToSparseMatrix<uint32_t>(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs, const SparseLayout layout);
+template SparseMatrix<uint64_t> ToSparseMatrix<uint64_t>(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs, const SparseLayout layout);
+template void WriteSparseMatrix<uint32_t>(const SparseMatrix<uint32_t> &matrix, std::ostream *out);
+template void WriteSparseMatrix<uint64_t>(const SparseMatrix<uint64_t> &matrix, std::ostream *out);
+}
@@ -0,0 +1,207 @@
+// alignment-writer: pack/unpack Themisto pseudoalignment files
+// https://github.com/tmaklin/alignment-writer
+// Copyright (c) 2022 Tommi Mäklin (tommi@maklin.fi)
+//
+// BSD-3-Clause license
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     (1) Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//
+//     (2) Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in
+//     the documentation and/or other materials provided with the
+//     distribution.
+//
+//     (3)The name of the author may not be used to
+//     endorse or promote products derived from this software without
+//     specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+// IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+#include "text_writer.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <exception>
+
+#include "run_stats.hpp"
+#include "alignment-writer_openmp_config.hpp"
+
+namespace alignment_writer {
+// Number of reads formatted into one buffer before it is written out
+constexpr size_t FORMAT_BLOCK_READS = 65536;
+
+// Two-digit lookup table for FormatNumber
+constexpr char DIGIT_PAIRS[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+char* FormatNumber(size_t value, char *out) {
+    // Write the digits backwards into a scratch buffer two at a time, then copy them to `out`
+    char digits[MAX_NUMBER_DIGITS];
+    char *pos = digits + MAX_NUMBER_DIGITS;
+    while (value >= 100) {
+	const size_t pair = (value % 100)*2;
+	value /= 100;
+	*(--pos) = DIGIT_PAIRS[pair + 1];
+	*(--pos) = DIGIT_PAIRS[pair];
+    }
+    if (value >= 10) {
+	*(--pos) = DIGIT_PAIRS[value*2 + 1];
+	*(--pos) = DIGIT_PAIRS[value*2];
+    } else {
+	*(--pos) = '0' + value;
+    }
+    const size_t n_digits = digits + MAX_NUMBER_DIGITS - pos;
+    std::memcpy(out, pos, n_digits);
+    return out + n_digits;
+}
+
+template <Format F>
+void FormatReadsFormat(const bm::bvector<> &bits, const size_t n_refs, const size_t first_read, const size_t last_read, const size_t first_row, std::vector<char> *buffer) {
+    // Use an enumerator to traverse the pseudoaligned bits starting from the first requested read
+    bm::bvector<>::enumerator en = bits.get_enumerator((first_read - first_row)*n_refs);
+
+    // `buffer` is grown so that there is always room for the next line before it is formatted
+    const size_t start = buffer->size();
+    size_t pos = start;
+    size_t n_alignments = 0;
+    std::vector<size_t> refs; // Fulgor writes the number of alignments before the ref ids
+    for (size_t i = first_read; i <= last_read; ++i) {
+	const size_t row_start = (i - first_row)*n_refs;
+	refs.clear();
+	while (en.valid() && *en < row_start + n_refs) {
+	    refs.emplace_back(*en - row_start);
+	    ++en;
+	}
+	n_alignments += refs.size();
+
+	const size_t max_line_size = (refs.size() + 2)*(MAX_NUMBER_DIGITS + 1) + 1;
+	if (buffer->size() < pos + max_line_size) {
+	    buffer->resize(std::max(2*buffer->size(), pos + max_line_size));
+	}
+	char *line = buffer->data() + pos;
+	line = FormatNumber(i, line);
+	if constexpr (F == themisto) {
+	    *(line++) = ' ';
+	    for (const size_t ref : refs) {
+		line = FormatNumber(ref, line);
+		*(line++) = ' ';
+	    }
+	} else if constexpr (F == fulgor) {
+	    *(line++) = '\t';
+	    line = FormatNumber(refs.size(), line);
+	    for (const size_t ref : refs) {
+		*(line++) = '\t';
+		line = FormatNumber(ref, line);
+	    }
+	}
+	*(line++) = '\n';
+	pos = line - buffer->data();
+    }
+    buffer->resize(pos);
+    run_stats::Count(run_stats::lines, last_read - first_read + 1);
+    run_stats::Count(run_stats::alignments, n_alignments);
+    run_stats::Count(run_stats::text_bytes, pos - start);
+}
+
+void FormatReads(const Format &format, const bm::bvector<> &bits, const size_t n_refs, const size_t first_read, const size_t last_read, std::vector<char> *buffer, const size_t first_row) {
+    // Select the layout at compile time so there is no branch per field
+    if (format == themisto) {
+	FormatReadsFormat<themisto>(bits, n_refs, first_read, last_read, first_row, buffer);
+    } else if (format == fulgor) {
+	FormatReadsFormat<fulgor>(bits, n_refs, first_read, last_read, first_row, buffer);
+    } else {
+	throw std::runtime_error("Unrecognized output format.");
+    }
+}
+
+void WriteReads(const Format &format, const bm::bvector<> &bits, const size_t n_refs, const size_t first_read, const size_t last_read, std::ostream *out, const size_t first_row) {
+    if (first_read > last_read) {
+	return;
+    }
+    const size_t n_blocks = (last_read - first_read)/FORMAT_BLOCK_READS + 1;
+
+    // Formats block `i` into `buffer`
+    auto format_block = [&](const size_t i, std::vector<char> *buffer) {
+	const size_t block_first = first_read + i*FORMAT_BLOCK_READS;
+	const size_t block_last = std::min(last_read, block_first + FORMAT_BLOCK_READS - 1);
+	run_stats::StageTimer timer(RunStats::format);
+	buffer->clear();
+	FormatReads(format, bits, n_refs, block_first, block_last, buffer, first_row);
+    };
+
+    // Writes a formatted block to `out`
+    auto write_block = [&](const std::vector<char> &buffer) {
+	run_stats::StageTimer timer(RunStats::write);
+	out->write(buffer.data(), buffer.size());
+	run_stats::Count(run_stats::bytes_out, buffer.size());
+    };
+
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+#pragma omp parallel
+    {
+#pragma omp single
+	{
+	    // The blocks are formatted in batches of `n_threads`. While the worker threads format
+	    // one batch, this thread writes the previous batch. The buffers are reused between batches.
+	    const size_t batch_size = omp_get_num_threads();
+	    std::vector<std::vector<char>> buffers(batch_size);
+	    std::vector<std::vector<char>> done_buffers(batch_size);
+
+	    size_t n_done = 0;
+	    for (size_t batch_start = 0; batch_start < n_blocks; batch_start += batch_size) {
+		const size_t n_batch = std::min(batch_size, n_blocks - batch_start);
+		for (size_t i = 0; i < n_batch; ++i) {
+#pragma omp task firstprivate(i) shared(buffers)
+		    format_block(batch_start + i, &buffers[i]);
+		}
+
+		for (size_t i = 0; i < n_done; ++i) {
+		    write_block(done_buffers[i]);
+		}
+
+#pragma omp taskwait
+		buffers.swap(done_buffers);
+		n_done = n_batch;
+	    }
+
+	    // Write the last batch
+	    for (size_t i = 0; i < n_done; ++i) {
+		write_block(done_buffers[i]);
+	    }
+	}
+    }
+#else
+    std::vector<char> buffer;
+    for (size_t i = 0; i < n_blocks; ++i) {
+	format_block(i, &buffer);
+	write_block(buffer);
+    }
+#endif
+    run_stats::StageTimer timer(RunStats::write);
+    out->flush();
+}
+}
@@ -37,127 +37,379 @@
 #include <string>
 #include <cmath>
 #include <sstream>
+#include <cstring>
+#include <limits>
+#include <charconv>
+#include <algorithm>
+#include <iterator>
 #include <exception>
+#include <stdexcept>
+#include <system_error>
 
 #include "bmserial.h"
 
+#include "block_pool.hpp"
+#include "chunk_index.hpp"
+#include "chunk_source.hpp"
+#include "equivalence_classes.hpp"
+#include "file_format.hpp"
+#include "read_visitor.hpp"
+#include "text_writer.hpp"
 #include "alignment-writer_openmp_config.hpp"
 
 namespace alignment_writer {
-void ReadHeader(const std::string &header_line, size_t *n_reads, size_t *n_refs) {
-    std::stringstream header(header_line);
-    std::string line;
-    std::getline(header, line, ',');
-    (*n_reads) = std::stoul(line); // First value is number of reads
-    std::getline(header, line, ',');
-    (*n_refs) = std::stoul(line); // Second value is number of references
+void DeserializeBuffer(const size_t buffer_size, std::istream *in, bm::bvector<> *out) {
+  // Read the next block into a buffer that is kept for the next call
+  thread_local std::vector<unsigned char> buf;
+  buf.resize(buffer_size);
+  in->read(reinterpret_cast<char*>(buf.data()), buffer_size);
+
+  // Deserialize block (OR with old data in bits)
+  DeserializeChunk(buf.data(), out);
 }
 
-void DeserializeBuffer(const size_t buffer_size, std::istream *in, bm::bvector<> *out) {
-  // Allocate space for the block
-  char* cbuf = new char[buffer_size];
+template <typename ChunkSource>
+void UnpackChunks(ChunkSource &source, const ChunkDecoder &decoder, bm::bvector<> &pseudoalignment) {
+    // Deserialize all chunks from `source` (OR with old data in `pseudoalignment`)
+    std::vector<unsigned char> storage;
+    ChunkInfo info;
+    const unsigned char *chunk;
+    while (source.Next(&info, &chunk, &storage)) {
+	decoder.Deserialize(info, chunk, &pseudoalignment);
+    }
+}
 
-  // Read the next block into buf
-  in->read(cbuf, buffer_size);
-  unsigned char* buf = reinterpret_cast<unsigned char*>(const_cast<char*>(cbuf));
+template <typename ChunkSource>
+void ParallelUnpackChunks(ChunkSource &source, const ChunkDecoder &decoder, bm::bvector<> &pseudoalignment) {
+    // Deserialize all chunks from `source` into `pseudoalignment` in parallel.
+#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
+    // Exceptions can not leave the parallel region, the first one is stored and rethrown after it
+    std::exception_ptr error;
+#pragma omp parallel
+    {
+#pragma omp single
+	{
+	    // The chunks are processed in batches of `n_threads`. While the worker threads deserialize one batch,
+	    // this thread merges the previous batch into `pseudoalignment` and reads the next batch from `source`.
+	    const size_t batch_size = omp_get_num_threads();
+	    std::vector<const unsigned char*> chunks(batch_size);
+	    std::vector<const unsigned char*> next_chunks(batch_size);
+	    std::vector<std::vector<unsigned char>> storage(batch_size);
+	    std::vector<std::vector<unsigned char>> next_storage(batch_size);
+	    std::vector<ChunkInfo> infos(batch_size);
+	    std::vector<ChunkInfo> next_infos(batch_size);
+	    std::vector<bm::bvector<>> parts(batch_size, bm::bvector<>(pseudoalignment.size()));
+	    std::vector<bm::bvector<>> done_parts(batch_size, bm::bvector<>(pseudoalignment.size()));
+	    std::vector<std::exception_ptr> errors(batch_size); // Exception thrown by the task for each chunk
+
+	    // Reads the next batch of chunks, returns the number of chunks read
+	    auto read_batch = [&](std::vector<const unsigned char*> *batch, std::vector<std::vector<unsigned char>> *batch_storage, std::vector<ChunkInfo> *batch_infos) {
+		size_t n_chunks = 0;
+		while (n_chunks < batch_size && source.Next(&(*batch_infos)[n_chunks], &(*batch)[n_chunks], &(*batch_storage)[n_chunks])) {
+		    ++n_chunks;
+		}
+		return n_chunks;
+	    };
+
+	    try {
+		size_t n_chunks = read_batch(&chunks, &storage, &infos);
+		size_t n_done = 0;
+		while (n_chunks > 0) {
+		    // Deserialize each chunk into its own vector
+		    for (size_t i = 0; i < n_chunks; ++i) {
+#pragma omp task firstprivate(i) shared(chunks, infos, parts, decoder, errors)
+			{
+			    try {
+				decoder.Deserialize(infos[i], chunks[i], &parts[i]);
+			    } catch (...) {
+				errors[i] = std::current_exception();
+			    }
+			}
+		    }
+
+		    // Chunks from sorted input cover disjoint blocks of the result, so merging
+		    // them mostly moves the block pointers instead of ORring the contents.
+		    for (size_t i = 0; i < n_done; ++i) {
+			pseudoalignment.merge(done_parts[i]);
+			done_parts[i].clear(true);
+		    }
+		    size_t n_next = read_batch(&next_chunks, &next_storage, &next_infos);
+
+#pragma omp taskwait
+		    for (size_t i = 0; i < n_chunks; ++i) {
+			if (errors[i]) {
+			    std::rethrow_exception(errors[i]);
+			}
+		    }
+		    chunks.swap(next_chunks);
+		    storage.swap(next_storage);
+		    infos.swap(next_infos);
+		    parts.swap(done_parts);
+		    n_done = n_chunks;
+		    n_chunks = n_next;
+		}
 
-  // Deserialize block (OR with old data in bits)
-  bm::deserialize((*out), buf);
+		// Merge the last batch
+		for (size_t i = 0; i < n_done; ++i) {
+		    pseudoalignment.merge(done_parts[i]);
+		}
+	    } catch (...) {
+		// The running tasks use the buffers of this block
+#pragma omp taskwait
+		error = std::current_exception();
+	    }
+	}
+    }
+    if (error) {
+	std::rethrow_exception(error);
+    }
+#else
+    throw std::runtime_error("Error in alignment-writer::ParallelUnpack: Alignment-writer was not compiled with OpenMP support.");
+#endif
+}
+
+std::vector<ChunkInfo> ScanChunks(const unsigned char *data, const size_t size, FileHeader *header) {
+    // Find the chunks with one pass over the chunk frames, skipping over the chunk contents
+    size_t pos;
+    (*header) = ParseFileHeader(data, size, &pos);
 
-  delete[] cbuf;
+    std::vector<ChunkInfo> chunks;
+    ChunkInfo chunk;
+    while (ParseChunk(data, size, header->version, &pos, &chunk)) {
+	chunks.emplace_back(chunk);
+    }
+    return chunks;
 }
 
-void Print(std::istream *in, std::ostream *out) {
-    // Read size of alignment from the file
-    size_t n_reads;
-    size_t n_refs;
-    std::string line;
-    std::getline(*in, line);
-    ReadHeader(line, &n_reads, &n_refs);
+std::vector<ChunkInfo> ScanChunks(const unsigned char *data, const size_t size, size_t *n_reads, size_t *n_refs) {
+    FileHeader header;
+    const std::vector<ChunkInfo> &chunks = ScanChunks(data, size, &header);
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
+    return chunks;
+}
 
-    // Deserialize the buffer
-    bm::bvector<> bits(n_reads*n_refs, bm::BM_GAP);
+void ToReadMajor(const FileHeader &header, bm::bvector<> *bits) {
+    // Files packed in the reference-major layout are transposed to the layout returned by Unpack
+    if (header.flags & REFERENCE_MAJOR_FLAG) {
+	(*bits) = Transpose(*bits, header.n_refs, header.n_reads);
+    }
+}
 
-    while (std::getline(*in, line)) { // Read size of next block
-	size_t next_buffer_size = std::stoul(line);
-	DeserializeBuffer(next_buffer_size, in, &bits);
+size_t AlignmentSize(const FileHeader &header) {
+    // Files that store the number of reads at the end are read into a vector of the maximum size
+    if (header.flags & DIMENSIONS_IN_TRAILER_FLAG) {
+	return bm::id_max;
     }
+    if (header.n_reads != 0 && header.n_refs > bm::id_max/header.n_reads) {
+	throw std::length_error("the alignment does not fit in one bit vector (number of reads x number of references > 2^48 - 1), read it by chunk instead");
+    }
+    return header.n_reads*header.n_refs;
+}
 
-    // Use an enumerator to traverse the pseudoaligned bits
-    bm::bvector<>::enumerator en = bits.first();
-    bm::bvector<>::enumerator en_end = bits.end();
+void ReadTrailingDimensions(std::istream *in, FileHeader *header, bm::bvector<> *bits) {
+    // Read the dimensions after the chunks of a file that was not seekable when the header was read
+    if (header->flags & DIMENSIONS_IN_TRAILER_FLAG) {
+	ReadDimensions(in, header);
+	bits->resize(header->n_reads*header->n_refs);
+    }
+}
 
-    for (size_t i = 0; i < n_reads; ++i) {
-	// Write read id (data compressed with Pack() is sorted so read id is just the iterator id)
-	*out << i << ' ';
-	if (*en < i*n_refs + n_refs) { // Next pseudoalignment is for this read
-	    // Write found pseudoalignments using the enumerator
-	    while (*en < i*n_refs + n_refs && en < en_end) {
-		*out<< (*en) - i*n_refs << ' ';
-		++en;
+template <typename ChunkSource>
+void PrintChunksInOrder(ChunkSource &source, const ChunkDecoder &decoder, FileHeader header, const Format &format, std::ostream *out, std::istream *trailer = nullptr,
+			const size_t first_read = 0, const size_t last_read = std::numeric_limits<size_t>::max()) {
+    // Print the reads as soon as all chunks that can contain them have been read. The reads before
+    // the first pseudoalignment in a chunk are complete if the chunks are in read order, so only the
+    // bits of the last read in the previous chunks and the current chunk are held in memory.
+    // If the number of reads is stored at the end of the file, it is read from `trailer` after the chunks.
+    // The chunks are kept in their own rows (see ChunkDecoder::DeserializeLocal) so the size of the
+    // alignment is not limited by the size of a bit vector in files with chunk-relative addressing.
+    // Only the reads in [first_read, last_read] are printed, `source` may skip the chunks outside the range.
+    const size_t n_refs = header.n_refs;
+    PooledBitVector pending(bm::BM_GAP);
+    size_t pending_first_row = 0; // Read id of the first row of `pending`
+    size_t next_read = 0; // First read that has not been printed
+    const auto print = [&](const size_t first, const size_t last) {
+	if (std::max(first, first_read) <= std::min(last, last_read)) {
+	    WriteReads(format, pending, n_refs, std::max(first, first_read), std::min(last, last_read), out, pending_first_row);
+	}
+    };
+
+    std::vector<unsigned char> storage;
+    ChunkInfo info;
+    const unsigned char *chunk;
+    while (source.Next(&info, &chunk, &storage)) {
+	PooledBitVector bits(bm::BM_GAP);
+	const size_t first_row = decoder.DeserializeLocal(info, chunk, &bits);
+
+	bm::bvector<>::size_type first_bit;
+	if (!bits.find(first_bit)) {
+	    continue; // No pseudoalignments in this chunk
+	}
+	const size_t chunk_first_read = first_row + first_bit/n_refs;
+	if (chunk_first_read < next_read) {
+	    throw std::runtime_error("the chunks are not in read order (was the input sorted by read id?)");
+	}
+
+	// Print the complete reads and drop their bits, a read that continues in this chunk stays pending
+	if (chunk_first_read > next_read) {
+	    print(next_read, chunk_first_read - 1);
+	    next_read = chunk_first_read;
+	}
+	if (first_row == pending_first_row) {
+	    pending.keep_range((chunk_first_read - first_row)*n_refs, bm::id_max - 1);
+	    pending.merge(bits);
+	} else {
+	    // Move the bits of the continuing read to the rows of the chunk
+	    bm::bvector<>::bulk_insert_iterator it(bits);
+	    for (bm::bvector<>::enumerator en = pending.get_enumerator((chunk_first_read - pending_first_row)*n_refs); en.valid(); ++en) {
+		it = (*en) + pending_first_row*n_refs - first_row*n_refs;
 	    }
+	    it.flush();
+	    pending.swap(bits);
+	    pending_first_row = first_row;
 	}
-	*out << '\n';
     }
-    out->flush(); // Flush
+
+    // Print the remaining reads, including the trailing reads without pseudoalignments
+    if (header.flags & DIMENSIONS_IN_TRAILER_FLAG) {
+	ReadDimensions(trailer, &header);
+    }
+    if (next_read < header.n_reads) {
+	print(next_read, header.n_reads - 1);
+    }
+}
+
+bool ChunksInReadOrder(const std::vector<ChunkInfo> &chunks) {
+    // Consecutive chunks may share the read at their boundary. Chunks without reads
+    // have first_read > last_read and chunks from legacy files cover all reads.
+    size_t prev_last = 0;
+    for (const ChunkInfo &chunk : chunks) {
+	if (chunk.first_read > chunk.last_read) {
+	    continue;
+	}
+	if (chunk.first_read < prev_last) {
+	    return false;
+	}
+	prev_last = chunk.last_read;
+    }
+    return true;
 }
 
-void StreamingUnpack(std::istream *in, std::ostream *out) {
+void Print(std::istream *in, std::ostream *out, const Format &format) {
     // Read size of alignment from the file
+    FileHeader header = ReadFileHeader(in);
+    StreamChunks chunks(in, header);
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(chunks);
+    if (decoder.ChunkRelative()) {
+	// Chunk-relative files can be larger than one bit vector, they are printed one chunk at a time
+	PrintChunksInOrder(chunks, decoder, header, format, out, in);
+	return;
+    }
+
+    // Deserialize the buffer
+    bm::bvector<> bits(AlignmentSize(header), bm::BM_GAP);
+    UnpackChunks(chunks, decoder, bits);
+    ReadTrailingDimensions(in, &header, &bits);
+    ToReadMajor(header, &bits);
+
+    if (header.n_reads > 0) {
+	WriteReads(format, bits, header.n_refs, 0, header.n_reads - 1, out);
+    }
+}
+
+void Print(const MappedFile &file, std::ostream *out, const Format &format) {
+    // Find the chunks and the size of alignment in the file
+    FileHeader header;
+    const std::vector<ChunkInfo> &index = ScanChunks(file.data(), file.size(), &header);
+    size_t n_reads = header.n_reads;
+    size_t n_refs = header.n_refs;
+
+    // Deserialize directly from the mapped file
+    MappedChunks chunks(file.data(), index);
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(chunks);
+    if (!(header.flags & REFERENCE_MAJOR_FLAG) && ChunksInReadOrder(index)) {
+	// Files packed from sorted input can be printed while reading
+	PrintChunksInOrder(chunks, decoder, header, format, out);
+	return;
+    }
+    bm::bvector<> bits(AlignmentSize(header), bm::BM_GAP);
+    UnpackChunks(chunks, decoder, bits);
+    ToReadMajor(header, &bits);
+
+    if (n_reads > 0) {
+	WriteReads(format, bits, n_refs, 0, n_reads - 1, out);
+    }
+}
+
+void PrintRange(std::istream *in, const size_t first_read, const size_t last_read, std::ostream *out, const Format &format) {
+    // Read only the chunks that contain reads in [first_read, last_read]
+    FileHeader header = ReadFileHeader(in);
+    if (header.flags & CHUNK_RELATIVE_FLAG) {
+	// Print chunk by chunk, the alignment may not fit in one bit vector
+	ChunkDecoder decoder(header);
+	std::vector<ChunkInfo> index;
+	if (ReadIndex(in, &index) && ChunksInReadOrder(index)) {
+	    std::vector<ChunkInfo> needed;
+	    std::copy_if(index.begin(), index.end(), std::back_inserter(needed), [&](const ChunkInfo &chunk) { return chunk.Overlaps(first_read, last_read); });
+	    IndexedChunks chunks(in, needed);
+	    PrintChunksInOrder(chunks, decoder, header, format, out, in, first_read, last_read);
+	} else {
+	    StreamChunks chunks(in, header);
+	    PrintChunksInOrder(chunks, decoder, header, format, out, in, first_read, last_read);
+	}
+	return;
+    }
     size_t n_reads;
     size_t n_refs;
-    std::string line;
-    std::getline(*in, line);
-    ReadHeader(line, &n_reads, &n_refs);
-
-    while (std::getline(*in, line)) { // Read size of next block
-	bm::bvector<> bits;
-	size_t next_buffer_size = std::stoul(line);
-	DeserializeBuffer(next_buffer_size, in, &bits);
-
-	// Use an enumerator to traverse the pseudoaligned bits
-	bm::bvector<>::enumerator en = bits.first();
-	bm::bvector<>::enumerator en_end = bits.end();
-
-	bool first = true;
-	while (en < en_end) {
-	    size_t read_id = std::floor((*en)/n_refs);
-	    if (!first) {
-		*out << read_id << ' ';
-	    }
-	    while (std::floor((*en)/n_refs) == read_id && en < en_end) {
-		if (first) {
-		    *out << read_id << ' ';
-		    first = false;
-		}
-		*out << (*en) - read_id*n_refs << ' ';
-		++en;
-	    }
-	    *out << '\n';
-	}
+    const bm::bvector<> &bits = UnpackRange(in, header, first_read, last_read, &n_reads, &n_refs);
+
+    // Clamp the range to the reads in the file
+    if (first_read < n_reads) {
+	WriteReads(format, bits, n_refs, first_read, std::min(last_read, n_reads - 1), out);
     }
+}
 
-    out->flush(); // Flush
+void StreamingPrint(std::istream *in, std::ostream *out, const Format &format) {
+    // Read size of alignment from the file
+    const FileHeader &header = ReadFileHeader(in);
+    if (header.flags & REFERENCE_MAJOR_FLAG) {
+	throw std::runtime_error("reference-major files can not be unpacked in bounded memory");
+    }
+
+    StreamChunks chunks(in, header);
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(chunks);
+    PrintChunksInOrder(chunks, decoder, header, format, out, in);
+}
+
+void UnpackData(std::istream *infile, const FileHeader &header, bm::bvector<> &pseudoalignment) {
+    StreamChunks chunks(infile, header);
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(chunks);
+    UnpackChunks(chunks, decoder, pseudoalignment);
 }
 
 void UnpackData(std::istream *infile, bm::bvector<> &pseudoalignment) {
-    std::string next_line;
-    while (std::getline(*infile, next_line)) {
-        size_t next_buffer_size = std::stoul(next_line); // Read the size of the next chunk
-	alignment_writer::DeserializeBuffer(next_buffer_size, infile, &pseudoalignment); // Read the next chunk
-    }
+    FileHeader header;
+    header.version = LEGACY_TEXT_VERSION;
+    header.flags = 0;
+    UnpackData(infile, header, pseudoalignment);
 }
 
 bm::bvector<> Unpack(std::istream *infile, size_t *n_reads, size_t *n_refs) {
-    std::string next_line;
-
-    // Read the number of reads and reference sequences from the first line
-    std::getline(*infile, next_line);
-    alignment_writer::ReadHeader(next_line, n_reads, n_refs);
+    // Read the number of reads and reference sequences from the header
+    FileHeader header = ReadFileHeader(infile);
 
     // Read the chunks into `pseudoalignment`
-    bm::bvector<> pseudoalignment((*n_reads)*(*n_refs));
-    UnpackData(infile, pseudoalignment);
+    bm::bvector<> pseudoalignment(AlignmentSize(header));
+    UnpackData(infile, header, pseudoalignment);
+    ReadTrailingDimensions(infile, &header, &pseudoalignment);
+    ToReadMajor(header, &pseudoalignment);
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
 
     // Return the `n_reads x n_refs` contiguously stored matrix containing the pseudoalignment.
     // The pseudoalignment for the `n`th read against the `k`th reference sequence is contained
@@ -165,74 +417,348 @@ bm::bvector<> Unpack(std::istream *infile, size_t *n_reads, size_t *n_refs) {
     return pseudoalignment;
 }
 
-void ParallelUnpackData(std::istream *infile, bm::bvector<> &pseudoalignment) {
-    // Read the chunks into `pseudoalignment` in parallel.
-#if defined(ALIGNMENTWRITER_OPENMP_SUPPORT) && (ALIGNMENTWRITER_OPENMP_SUPPORT) == 1
-    // Get number of threads
-    size_t n_threads;
-    #pragma omp parallel
-    {
-      n_threads = omp_get_num_threads();
-    }
+bm::bvector<> Unpack(const MappedFile &file, size_t *n_reads, size_t *n_refs) {
+    // Find the chunks and the number of reads and reference sequences
+    FileHeader header;
+    const std::vector<ChunkInfo> &index = ScanChunks(file.data(), file.size(), &header);
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
+
+    // Deserialize the chunks directly from the mapped file
+    bm::bvector<> pseudoalignment(AlignmentSize(header));
+    MappedChunks chunks(file.data(), index);
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(chunks);
+    UnpackChunks(chunks, decoder, pseudoalignment);
+    ToReadMajor(header, &pseudoalignment);
+
+    // Return the `n_reads x n_refs` contiguously stored matrix containing the pseudoalignment.
+    return pseudoalignment;
+}
 
-    std::string next_line;
-    // This loop reads in four chunks at a time using a single thread and then deserializes them in parallel.
-    while (std::getline(*infile, next_line)) { // Read size of next block
-        std::vector<std::basic_string<unsigned char>> vals;
-	for (size_t i = 0; i < n_threads && *infile; ++i) {
-	    size_t next_buffer_size = std::stoul(next_line);
+void ParallelUnpackData(std::istream *infile, const FileHeader &header, bm::bvector<> &pseudoalignment) {
+    // Read the chunks into `pseudoalignment` in parallel.
+    StreamChunks chunks(infile, header);
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(chunks);
+    ParallelUnpackChunks(chunks, decoder, pseudoalignment);
+}
 
-	    // Allocate space for the block
-	    char* cbuf = new char[next_buffer_size];
+void ParallelUnpackData(std::istream *infile, bm::bvector<> &pseudoalignment) {
+    FileHeader header;
+    header.version = LEGACY_TEXT_VERSION;
+    header.flags = 0;
+    ParallelUnpackData(infile, header, pseudoalignment);
+}
 
-	    // Read the next block into buf
-	    infile->read(cbuf, next_buffer_size);
+bm::bvector<> UnpackRange(std::istream *infile, const size_t first_read, const size_t last_read, size_t *n_reads, size_t *n_refs) {
+    // Read the number of reads and reference sequences from the header
+    const FileHeader &header = ReadFileHeader(infile);
+    return UnpackRange(infile, header, first_read, last_read, n_reads, n_refs);
+}
 
-	    // Store the block in `vals`
-	    unsigned char* buf = reinterpret_cast<unsigned char*>(const_cast<char*>(cbuf));
-	    vals.emplace_back(std::basic_string<unsigned char>(buf, next_buffer_size));
+bm::bvector<> UnpackRange(std::istream *infile, const FileHeader &header, const size_t first_read, const size_t last_read, size_t *n_reads, size_t *n_refs) {
+    CheckDimensions(header);
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
 
-	    delete[] cbuf;
+    bm::bvector<> pseudoalignment(AlignmentSize(header));
+    if (first_read > last_read || first_read >= (*n_reads)) {
+	return pseudoalignment;
+    }
+    // Bits of the reads in [first_read, last_read]
+    size_t first_bit = first_read*(*n_refs);
+    size_t last_bit = (std::min(last_read, (*n_reads) - 1) + 1)*(*n_refs) - 1;
+
+    if (header.flags & REFERENCE_MAJOR_FLAG) {
+	// Every chunk of a reference-major file can contain reads from the range
+	UnpackData(infile, header, pseudoalignment);
+	ToReadMajor(header, &pseudoalignment);
+	pseudoalignment.keep_range(first_bit, last_bit);
+	return pseudoalignment;
+    }
 
-	    // Check if there is more to read
-	    infile->peek();
-	    if (i < n_threads - 1 && *infile) {
-	        // If there is more, get the size of the next buffer.
-	      std::getline(*infile, next_line);
+    std::vector<unsigned char> buf;
+    std::vector<ChunkInfo> index;
+    // Chunks with equivalence classes or chunk-relative addressing are decoded in full
+    const bool decode = header.flags & (EQUIVALENCE_CLASS_FLAG | CHUNK_RELATIVE_FLAG);
+    if (decode && ReadIndex(infile, &index)) {
+	// Read the dictionary and expand the chunks that overlap the range
+	std::vector<ChunkInfo> needed(index.begin(), index.begin() + ((header.flags & EQUIVALENCE_CLASS_FLAG) ? std::min(index.size(), (size_t)1) : 0));
+	std::copy_if(index.begin(), index.end(), std::back_inserter(needed), [&](const ChunkInfo &chunk) { return chunk.Overlaps(first_read, last_read); });
+	IndexedChunks chunks(infile, needed);
+	ChunkDecoder decoder(header);
+	decoder.ReadDictionary(chunks);
+	UnpackChunks(chunks, decoder, pseudoalignment);
+	pseudoalignment.keep_range(first_bit, last_bit);
+    } else if (decode) {
+	UnpackData(infile, header, pseudoalignment);
+	pseudoalignment.keep_range(first_bit, last_bit);
+    } else if (ReadIndex(infile, &index)) {
+	// Seek directly to the chunks that overlap the range
+	for (const ChunkInfo &chunk : index) {
+	    if (chunk.Overlaps(first_read, last_read) && chunk.OverlapsBits(first_bit, last_bit)) {
+		buf.resize(chunk.size);
+		infile->seekg(chunk.offset);
+		infile->read(reinterpret_cast<char*>(buf.data()), chunk.size);
+		bm::deserialize_range(pseudoalignment, buf.data(), first_bit, last_bit);
 	    }
 	}
-	// Deserialize the blocks in parallel (reduce by ORring into output variable)
-#pragma omp parallel shared(vals) reduction(bm_bvector_or : pseudoalignment)
-	{
-	    size_t thread_id = omp_get_thread_num();
-	    // If we are at end of file there might be fewer blocks read than there are worker threads
-	    if (thread_id < vals.size()) {
-	        bm::deserialize(pseudoalignment, vals[thread_id].c_str());
+    } else {
+	// No index (legacy file or non-seekable stream), read through all chunks
+	StreamChunks chunks(infile, header);
+	ChunkInfo info;
+	const unsigned char *chunk;
+	while (chunks.Next(&info, &chunk, &buf)) {
+	    if (info.Overlaps(first_read, last_read)) {
+		bm::deserialize_range(pseudoalignment, chunk, first_bit, last_bit);
 	    }
 	}
     }
-    // Return the `n_reads x n_refs` contiguously stored matrix containing the pseudoalignment.
-    // The pseudoalignment for the `n`th read against the `k`th reference sequence is contained
-    // at position `n*n_refs + k` assuming indexing starts at 0.
-#else
-    throw std::runtime_error("Error in alignment-writer::ParallelUnpack: Alignment-writer was not compiled with OpenMP support.");
-#endif
+
+    // Return the `n_reads x n_refs` contiguously stored matrix containing the pseudoalignment
+    // for the reads in [first_read, last_read], all other reads are empty.
+    return pseudoalignment;
 }
 
 bm::bvector<> ParallelUnpack(std::istream *infile, size_t *n_reads, size_t *n_refs) {
+    // Read the number of reads and reference sequences from the header
+    FileHeader header = ReadFileHeader(infile);
 
-    // Read the number of reads and reference sequences from the first line
-    std::string header_line;
-
-    std::getline(*infile, header_line);
-    alignment_writer::ReadHeader(header_line, n_reads, n_refs);
-
-    bm::bvector<> pseudoalignment((*n_reads)*(*n_refs));
-    ParallelUnpackData(infile, pseudoalignment);
+    bm::bvector<> pseudoalignment(AlignmentSize(header));
+    ParallelUnpackData(infile, header, pseudoalignment);
+    ReadTrailingDimensions(infile, &header, &pseudoalignment);
+    ToReadMajor(header, &pseudoalignment);
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
 
     // Return the `n_reads x n_refs` contiguously stored matrix containing the pseudoalignment.
     // The pseudoalignment for the `n`th read against the `k`th reference sequence is contained
     // at position `n*n_refs + k` assuming indexing starts at 0.
     return pseudoalignment;
 }
+
+bm::bvector<> ParallelUnpack(const MappedFile &file, size_t *n_reads, size_t *n_refs) {
+    // Find the chunks and the number of reads and reference sequences
+    FileHeader header;
+    const std::vector<ChunkInfo> &index = ScanChunks(file.data(), file.size(), &header);
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
+
+    // Deserialize the chunks directly from the mapped file in parallel
+    bm::bvector<> pseudoalignment(AlignmentSize(header));
+    MappedChunks chunks(file.data(), index);
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(chunks);
+    ParallelUnpackChunks(chunks, decoder, pseudoalignment);
+    ToReadMajor(header, &pseudoalignment);
+
+    // Return the `n_reads x n_refs` contiguously stored matrix containing the pseudoalignment.
+    return pseudoalignment;
+}
+
+template <typename ChunkSource>
+void ForEachUnpackedChunk(ChunkSource &source, const FileHeader &header, const std::function<void(const UnpackedChunk &chunk)> &func) {
+    if (header.flags & REFERENCE_MAJOR_FLAG) {
+	throw std::runtime_error("reference-major files can not be unpacked by chunk");
+    }
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(source);
+
+    UnpackedChunk unpacked;
+    unpacked.n_refs = header.n_refs;
+    // Blocks freed when the next chunk is deserialized are reused for it
+    bm::bvector<>::mem_pool_guard pool_guard(ThreadBlockPool(), unpacked.bits);
+    std::vector<unsigned char> storage;
+    ChunkInfo info;
+    const unsigned char *chunk;
+    while (source.Next(&info, &chunk, &storage)) {
+	unpacked.bits.clear(true);
+	unpacked.bits.set_new_blocks_strat(bm::BM_GAP);
+	unpacked.first_row = decoder.DeserializeLocal(info, chunk, &unpacked.bits);
+	func(unpacked);
+    }
+}
+
+void UnpackByChunk(std::istream *infile, const std::function<void(const UnpackedChunk &chunk)> &func, size_t *n_reads, size_t *n_refs) {
+    FileHeader header = ReadFileHeader(infile);
+    StreamChunks chunks(infile, header);
+    ForEachUnpackedChunk(chunks, header, func);
+    if (header.flags & DIMENSIONS_IN_TRAILER_FLAG) {
+	ReadDimensions(infile, &header);
+    }
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
+}
+
+void UnpackByChunk(const MappedFile &file, const std::function<void(const UnpackedChunk &chunk)> &func, size_t *n_reads, size_t *n_refs) {
+    FileHeader header;
+    const std::vector<ChunkInfo> &index = ScanChunks(file.data(), file.size(), &header);
+    MappedChunks chunks(file.data(), index);
+    ForEachUnpackedChunk(chunks, header, func);
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
+}
+
+std::vector<std::pair<size_t, size_t>> UnpackPairs(std::istream *infile, size_t *n_reads, size_t *n_refs) {
+    std::vector<std::pair<size_t, size_t>> pairs;
+    ForEachRead(infile, [&](const size_t read_id, const size_t *refs_begin, const size_t *refs_end) {
+	for (const size_t *ref = refs_begin; ref != refs_end; ++ref) {
+	    pairs.emplace_back(read_id, *ref);
+	}
+    }, n_reads, n_refs);
+    return pairs;
+}
+
+void ExtractReference(const bm::bvector<> &bits, const size_t ref_id, const size_t n_reads, bm::bvector<> *reads) {
+    // Add the reads aligned to `ref_id` in a reference-major bit vector to `reads`
+    const size_t first_bit = ref_id*n_reads;
+    bm::bvector<>::bulk_insert_iterator it(*reads);
+    for (bm::bvector<>::enumerator en = bits.get_enumerator(first_bit); en.valid() && *en < first_bit + n_reads; ++en) {
+	it = (*en) - first_bit;
+    }
+    it.flush();
+}
+
+template <typename ChunkSource>
+void ExtractReferences(ChunkSource &source, const FileHeader &header, const std::vector<size_t> &ref_ids, std::vector<bm::bvector<>> *reads) {
+    // Find the reads of `ref_ids` in each chunk in parallel and add them to `reads` in file order.
+    // The ids in `ref_ids` must be distinct.
+    std::vector<size_t> position(header.n_refs, ref_ids.size()); // Position of each reference in `ref_ids`
+    for (size_t i = 0; i < ref_ids.size(); ++i) {
+	position[ref_ids[i]] = i;
+    }
+
+    // Positions in `ref_ids` of the references in each equivalence class
+    ChunkDecoder decoder(header);
+    decoder.ReadDictionary(source);
+    const EquivalenceClasses &classes = decoder.classes();
+    std::vector<std::vector<size_t>> class_positions(classes.size());
+    for (size_t class_id = 0; class_id < classes.size(); ++class_id) {
+	for (const uint32_t *ref = classes.begin(class_id); ref != classes.end(class_id); ++ref) {
+	    if (position[*ref] < ref_ids.size()) {
+		class_positions[class_id].emplace_back(position[*ref]);
+	    }
+	}
+    }
+
+    std::vector<std::vector<bm::bvector<>>> parts(ChunkSlots(), std::vector<bm::bvector<>>(ref_ids.size()));
+    ForEachChunkInParallel(source, [&](const size_t slot, const ChunkInfo &info, const unsigned char *chunk) {
+	std::vector<bm::bvector<>> &part = parts[slot];
+	PooledBitVector bits;
+	if (decoder.HasClasses()) {
+	    // The class of each read tells which of the references it pseudoaligns to
+	    ClassIds ids;
+	    DeserializeClassIds(chunk, &ids);
+	    ForEachClassId(ids, [&](const size_t read_id, const uint32_t class_id) {
+		for (const size_t i : class_positions[class_id]) {
+		    part[i].set(read_id);
+		}
+	    });
+	} else if (header.flags & REFERENCE_MAJOR_FLAG) {
+	    // Only the chunks that contain the references need to be deserialized
+	    for (size_t i = 0; i < ref_ids.size(); ++i) {
+		if (info.Overlaps(ref_ids[i], ref_ids[i])) {
+		    if (!bits.any()) {
+			DeserializeChunk(chunk, &bits);
+		    }
+		    ExtractReference(bits, ref_ids[i], header.n_reads, &part[i]);
+		}
+	    }
+	} else {
+	    // Read-major chunks are scanned in full
+	    const size_t first_row = decoder.DeserializeLocal(info, chunk, &bits);
+	    for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+		const size_t row = (*en)/header.n_refs;
+		const size_t i = position[(*en) - row*header.n_refs];
+		if (i < ref_ids.size()) {
+		    part[i].set(first_row + row);
+		}
+	    }
+	}
+    }, [&](const size_t slot, const ChunkInfo &) {
+	for (size_t i = 0; i < ref_ids.size(); ++i) {
+	    (*reads)[i].merge(parts[slot][i]);
+	    parts[slot][i].clear(true);
+	}
+    });
+}
+
+std::vector<bm::bvector<>> UnpackReferences(std::istream *infile, const std::vector<size_t> &ref_ids, size_t *n_reads, size_t *n_refs) {
+    // Read the number of reads and reference sequences from the header
+    const FileHeader &header = ReadFileHeader(infile);
+    CheckDimensions(header);
+    (*n_reads) = header.n_reads;
+    (*n_refs) = header.n_refs;
+
+    for (const size_t ref_id : ref_ids) {
+	if (ref_id >= (*n_refs)) {
+	    throw std::out_of_range("reference id " + std::to_string(ref_id) + " is not in the alignment");
+	}
+    }
+
+    // Each distinct reference is extracted once
+    std::vector<size_t> distinct_ids(ref_ids);
+    std::sort(distinct_ids.begin(), distinct_ids.end());
+    distinct_ids.erase(std::unique(distinct_ids.begin(), distinct_ids.end()), distinct_ids.end());
+    const bool has_duplicates = (distinct_ids.size() < ref_ids.size());
+    const std::vector<size_t> &extracted_ids = (has_duplicates ? distinct_ids : ref_ids);
+
+    std::vector<bm::bvector<>> reads(extracted_ids.size(), bm::bvector<>(*n_reads));
+    std::vector<ChunkInfo> index;
+    if ((header.flags & REFERENCE_MAJOR_FLAG) && ReadIndex(infile, &index)) {
+	// Seek directly to the chunks that contain the references
+	std::vector<ChunkInfo> needed;
+	for (const ChunkInfo &chunk : index) {
+	    if (std::any_of(extracted_ids.begin(), extracted_ids.end(), [&](const size_t ref_id) { return chunk.Overlaps(ref_id, ref_id); })) {
+		needed.emplace_back(chunk);
+	    }
+	}
+	IndexedChunks chunks(infile, needed);
+	ExtractReferences(chunks, header, extracted_ids, &reads);
+    } else {
+	StreamChunks chunks(infile, header);
+	ExtractReferences(chunks, header, extracted_ids, &reads);
+    }
+
+    if (has_duplicates) {
+	// Map the distinct references back to their positions in `ref_ids`
+	std::vector<bm::bvector<>> distinct_reads;
+	distinct_reads.swap(reads);
+	for (const size_t ref_id : ref_ids) {
+	    const size_t i = std::lower_bound(distinct_ids.begin(), distinct_ids.end(), ref_id) - distinct_ids.begin();
+	    reads.emplace_back(distinct_reads[i]);
+	}
+    }
+
+    // Element `i` contains the ids of the reads that pseudoalign to reference `ref_ids[i]`
+    return reads;
+}
+
+void PrintReferences(std::istream *in, const std::vector<size_t> &ref_ids, std::ostream *out) {
+    size_t n_reads;
+    size_t n_refs;
+    const std::vector<bm::bvector<>> &reads = UnpackReferences(in, ref_ids, &n_reads, &n_refs);
+
+    // Write `<ref id> <read id> <read id> ...` for each reference
+    std::vector<char> buffer;
+    for (size_t i = 0; i < ref_ids.size(); ++i) {
+	buffer.resize(MAX_NUMBER_DIGITS + 1);
+	char *line = FormatNumber(ref_ids[i], buffer.data());
+	*(line++) = ' ';
+	size_t pos = line - buffer.data();
+	for (bm::bvector<>::enumerator en = reads[i].first(); en.valid(); ++en) {
+	    if (buffer.size() < pos + MAX_NUMBER_DIGITS + 2) {
+		buffer.resize(2*buffer.size() + MAX_NUMBER_DIGITS + 2);
+	    }
+	    line = FormatNumber(*en, buffer.data() + pos);
+	    *(line++) = ' ';
+	    pos = line - buffer.data();
+	}
+	buffer.resize(pos);
+	buffer.emplace_back('\n');
+	out->write(buffer.data(), buffer.size());
+    }
+    out->flush();
+}
 }
@@ -0,0 +1,45 @@
+## Pack INPUT with PACK_ARGS, unpack the packed file from a path and from a stream, and
+## unpack from a pipe that the file was packed into. Packing into a pipe stores unknown
+## dimensions after the chunks since the header cannot be rewritten. All results are
+## compared byte by byte with EXPECTED.
+## Usage: cmake -DALIGNMENT_WRITER=<exe> -DINPUT=<file> -DEXPECTED=<file> -DPACK_ARGS=<args> -DNAME=<name> -P round_trip.cmake
+separate_arguments(PACK_ARGS UNIX_COMMAND "${PACK_ARGS}")
+set(PACKED ${CMAKE_CURRENT_BINARY_DIR}/${NAME}.aln)
+
+execute_process(COMMAND ${ALIGNMENT_WRITER} -f ${INPUT} ${PACK_ARGS}
+  OUTPUT_FILE ${PACKED}
+  RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+  message(FATAL_ERROR "packing ${INPUT} with `${PACK_ARGS}` failed")
+endif()
+
+execute_process(COMMAND ${ALIGNMENT_WRITER} -d -f ${PACKED}
+  OUTPUT_FILE ${CMAKE_CURRENT_BINARY_DIR}/${NAME}_file.txt
+  RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+  message(FATAL_ERROR "unpacking ${PACKED} failed")
+endif()
+
+execute_process(COMMAND ${ALIGNMENT_WRITER} -d
+  INPUT_FILE ${PACKED}
+  OUTPUT_FILE ${CMAKE_CURRENT_BINARY_DIR}/${NAME}_stream.txt
+  RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+  message(FATAL_ERROR "unpacking ${PACKED} from a stream failed")
+endif()
+
+execute_process(COMMAND ${ALIGNMENT_WRITER} -f ${INPUT} ${PACK_ARGS}
+  COMMAND ${ALIGNMENT_WRITER} -d
+  OUTPUT_FILE ${CMAKE_CURRENT_BINARY_DIR}/${NAME}_pipe.txt
+  RESULTS_VARIABLE results)
+if (NOT results STREQUAL "0;0")
+  message(FATAL_ERROR "packing into a pipe and unpacking from it failed")
+endif()
+
+foreach(unpacked ${NAME}_file.txt ${NAME}_stream.txt ${NAME}_pipe.txt)
+  execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${CMAKE_CURRENT_BINARY_DIR}/${unpacked} ${EXPECTED}
+    RESULT_VARIABLE result)
+  if (NOT result EQUAL 0)
+    message(FATAL_ERROR "${unpacked} differs from ${EXPECTED}")
+  endif()
+endforeach()